@@ -3,17 +3,42 @@
 
 // main configuration
 #define USE_WIFI
-//#define USE_GSM
+//#define USE_GSM // with USE_WIFI, each upload goes over one of them (see WIFI_COST)
 //#define USE_SD
 //#define ENABLE_WDT
+//#define USE_DUST_CAPTURE // time the last two dust sensors with Timer4/Timer5 input capture (pins 49, 48)
+//#define DUST_SENSOR_PULSE_STATS // send pulse counts and width histograms along with the dust ratios
+//#define USE_DUST_SAMPLER // poll additional dust sensors on pins without interrupts (uses Timer2)
+//#define SEND_DUST_CONCENTRATION // send converted concentrations along with the dust ratios
+//#define WIFI_KEEP_ALIVE // keep the WiFi connection to the server open between uploads
+//#define SEND_PACKED_RECORDS // send the samples as one compact binary value instead of text rows (see PACKED_SCHEMA)
 
 
 #include "SoftwareSerial.h"
 #include "ChainableLED.h"
 #include "sha256.h"
 #include "DustSensor.h"
+#include "DustConcentration.h"
+#ifdef USE_DUST_CAPTURE
+#include "DustSensorCapture.h"
+#endif
+#ifdef USE_DUST_SAMPLER
+#include "DustPortSampler.h"
+#endif
 #include "ManylabsDataAuth.h"
+#define TASK_SCHEDULER_MAX_TASKS 9 // the most tasks setup() adds (with USE_WIFI and USE_GSM)
+#include "TaskScheduler.h"
+#include "SampleQueue.h"
+#include "SampleClock.h"
+#include "HttpResponse.h"
+#include "ReplyMatcher.h"
+#include "LatencyTracker.h"
+#include "RetryPolicy.h"
+#include "DataTransport.h"
+#include "TransportRouter.h"
+#include "RecordCodec.h"
 #include "DHT.h"
+#include "DHTReader.h"
 #ifdef USE_WIFI
 #include "WiFly.h"
 #define WIFI_POST_URL "http://www.manylabs.org/data/api/v1/appendData/"
@@ -38,14 +63,130 @@
 #define DHT_PIN 4
 #define LED_PIN 6
 #define SD_PIN 8
-#define DUST_SENSOR_COUNT 6
 #define BATTERY_VOLTS_PIN A0
-const int dustPins[] = { 2, 3, 18, 19, 20, 21 };
+#define NOISE_PIN A15 // unconnected; seeds random()
+
+// time between samples (msec); each sample holds the dust ratios of one window
+#define DUST_PERIOD 30000
+
+// time between temperature/humidity readings (msec); samples in between repeat
+// the last reading. keep it a multiple of DUST_PERIOD
+#define DHT_PERIOD 30000
+
+// time between uploads of the samples collected since the last one (msec);
+// each device uploads at a random point of the period, so devices started
+// together don't all reach the server at the same moment
+#define UPLOAD_PERIOD 30000
+
+// retries after a failed upload, for each transport (msec): the first after
+// RETRY_MIN_DELAY, doubling after each failure up to RETRY_MAX_DELAY (each
+// wait is cut at random by up to half). after RETRY_OPEN_AFTER failures in a
+// row, uploads stop for RETRY_OPEN_TIME, then one upload is tried. the module
+// is reset only after RETRY_RESET_AFTER failures in a row in which it didn't
+// answer; failures of the network or the server are just retried
+#define RETRY_MIN_DELAY 5000
+#define RETRY_MAX_DELAY 120000
+#define RETRY_OPEN_AFTER 6
+#define RETRY_OPEN_TIME 600000
+#define RETRY_RESET_AFTER 2
+
+// cost weights of the upload links when both are used: uploads go over the
+// cheaper link, and over the other one while it fails often (the costs are
+// divided by the recent success rates) or waits to retry
+#define WIFI_COST 1
+#define GSM_COST 4 // cellular data
+
+// most samples sent in one request; a backlog goes out in several requests,
+// one after another. each sample takes up to SAMPLE_TEXT_SIZE bytes of RAM in
+// the WiFi parameter buffer
+#define UPLOAD_BATCH_SIZE 6
+
+// number of samples held for upload in RAM; covers UPLOAD_PERIOD / DUST_PERIOD
+// samples. they survive watchdog resets
+#define SAMPLE_BUFFER_SIZE 12
+
+// bytes of EEPROM for samples that don't fit in RAM while uploads fail; these
+// also survive power loss. the oldest are dropped when it is full
+#define SAMPLE_EEPROM_BYTES 4096
+
+// send/save samples only after this warm-up time (msec)
+#define WARMUP_TIME 90000
+
+// start reading the temperature/humidity sensor this long (msec) before a sample
+#define DHT_LEAD_TIME 1000
+
+// time between status LED blinks (msec)
+#define LED_BLINK_PERIOD 1000
+
+// dust sensor pins; each must have a hardware interrupt (checked at compile time);
+// with USE_DUST_CAPTURE the last two sensors move to the input capture pins
+#ifdef USE_DUST_CAPTURE
+typedef DustSensorArray< 2, 3, 18, 19 > DustSensors;
+#define DUST_CAPTURE_COUNT 2
+#else
+typedef DustSensorArray< 2, 3, 18, 19, 20, 21 > DustSensors;
+#define DUST_CAPTURE_COUNT 0
+#endif
+#define DUST_SENSOR_COUNT (DustSensors::count + DUST_CAPTURE_COUNT)
+
+// sensor model of each dust sensor, used to convert ratios to concentrations;
+// no concentration is sent for DUST_MODEL_NONE. the PPD60 sensors stay at
+// DUST_MODEL_NONE until DUST_MODEL_PPD60 has a calibrated curve
+const byte dustModels[ DUST_SENSOR_COUNT ] = { DUST_MODEL_PPD42, DUST_MODEL_PPD42, DUST_MODEL_PPD42,
+  DUST_MODEL_NONE, DUST_MODEL_NONE, DUST_MODEL_NONE };
+
+// additional dust sensors sampled at 10 kHz; any pins on at most two ports
+#define POLLED_DUST_COUNT 8
+const byte polledDustPins[ POLLED_DUST_COUNT ] = { 22, 23, 24, 25, 26, 27, 28, 29 };
+
+// samples are uploaded in batches as a table: the "fields" value names the
+// columns and the "records" value holds one row per sample, e.g.
+//   ...&now=3630&fields=time,missed,temperature,...&records=3570,0,21.5,...;3600,0,21.4,...
+// values are separated by ',' and rows by ';'. time is in seconds since
+// startup, like "now" (the time the request was built), so the server can
+// timestamp each row as its arrival time - (now - time)
+#ifdef SEND_DUST_CONCENTRATION
+#define DUST_VALUE_COUNT (2 * DUST_SENSOR_COUNT)
+#else
+#define DUST_VALUE_COUNT DUST_SENSOR_COUNT
+#endif
+#ifdef USE_DUST_SAMPLER
+#define SAMPLE_VALUE_COUNT (4 + DUST_VALUE_COUNT + POLLED_DUST_COUNT)
+#else
+#define SAMPLE_VALUE_COUNT (4 + DUST_VALUE_COUNT)
+#endif
+#define SAMPLE_TEXT_SIZE (10 * SAMPLE_VALUE_COUNT) // longest row, with separators
+
+// with SEND_PACKED_RECORDS the rows are sent in one "packed" value instead:
+//   ...&now=3630&packed=AQegOACuA4gH2Az-_wcAeAAB...
+// a RecordCodec payload (base64url) of schema PACKED_SCHEMA, where each row
+// holds time, missed, temperature, humidity, the dust ratios and the polled
+// dust ratios as stored in SampleRecord (tenths and 65535 = 1). the ratios
+// of a sensor change little between rows, so most values take a byte or two
+// instead of about 8 chars. concentrations are left out (the server derives
+// them from the ratios). tools/decode_records.cpp prints a payload as CSV
+#define PACKED_SCHEMA 1
+#define PACKED_FIELD_COUNT (SAMPLE_VALUE_COUNT - DUST_VALUE_COUNT + DUST_SENSOR_COUNT)
+#define PACKED_RECORD_SIZE (3 * PACKED_FIELD_COUNT + 2) // longest row, unless rows are 12 days apart
+#define PACKED_BUFFER_SIZE (2 + UPLOAD_BATCH_SIZE * PACKED_RECORD_SIZE)
+#ifdef SEND_PACKED_RECORDS
+#define BATCH_TEXT_SIZE RECORD_BASE64_SIZE( PACKED_BUFFER_SIZE )
+#else
+#define BATCH_TEXT_SIZE (UPLOAD_BATCH_SIZE * SAMPLE_TEXT_SIZE)
+#endif
 
 
 // WIFI settings
 #define NETWORK_NAME "x"
 #define NETWORK_PASSWORD "x"
+
+// serial rates of the modules: the default one and the one the link is moved
+// to at startup (saved on the module). faster rates fill the 64-byte receive
+// buffer sooner (in 5.6 ms at 115200), so the loop must poll the senders
+// at least that often
+#define WIFI_BAUD 9600
+#define WIFI_FAST_BAUD 57600
+#define WIFI_RESET_PIN -1 // wired to the WiFly's RESET, if at all; restarts it if the fast rate fails
 const char contentTypeHeader[] PROGMEM = "Content-Type: application/x-www-form-urlencoded\r\n";
 
 
@@ -56,8 +197,10 @@ const char contentTypeHeader[] PROGMEM = "Content-Type: application/x-www-form-u
 
 
 // GSM settings
-//#define GPRS_RESET_PIN 4
+#define GPRS_RESET_PIN 9 // the FONA is on Serial3 (pins 14, 15); Serial1 shares pins 18, 19 with dust sensors
 #define APN "truphone.com" // Set to the APN for your sim card
+#define GSM_BAUD 19200
+#define GSM_FAST_BAUD 57600 // (see the WIFI rates above)
 
 
 // ======== GLOBAL DATA ========
@@ -66,7 +209,13 @@ const char contentTypeHeader[] PROGMEM = "Content-Type: application/x-www-form-u
 // wifi connection objects/data
 #ifdef USE_WIFI
 WifiSender g_wifiSender( Serial2, &Serial );
-#define PARAM_BUF_SIZE 300
+RetryPolicy g_wifiRetry( RETRY_MIN_DELAY, RETRY_MAX_DELAY, RETRY_OPEN_AFTER, RETRY_OPEN_TIME, RETRY_RESET_AFTER );
+byte g_wifiLink = TRANSPORT_NONE;
+#ifdef DUST_SENSOR_PULSE_STATS
+#define PARAM_BUF_SIZE (1000 + BATCH_TEXT_SIZE)
+#else
+#define PARAM_BUF_SIZE (400 + BATCH_TEXT_SIZE)
+#endif
 char g_wifiParamBuffer[ PARAM_BUF_SIZE ];
 #define HEADER_BUFFER_LENGTH 200
 char g_headerBuffer[ HEADER_BUFFER_LENGTH ];
@@ -75,9 +224,10 @@ char g_headerBuffer[ HEADER_BUFFER_LENGTH ];
 
 // GSM connection objects/data
 #ifdef USE_GSM
-//SoftwareSerial g_gprsSerial( 4, 5 ); // use Serial2?
-GprsSender g_gprsSender( GPRS_RESET_PIN, g_gprsSerial, Serial );
-uint8_t g_gprsFailCount = 0;
+GprsSender g_gprsSender( GPRS_RESET_PIN, Serial3, Serial );
+RetryPolicy g_gsmRetry( RETRY_MIN_DELAY, RETRY_MAX_DELAY, RETRY_OPEN_AFTER, RETRY_OPEN_TIME, RETRY_RESET_AFTER );
+byte g_gsmLink = TRANSPORT_NONE;
+unsigned long g_sendNow = 0; // the "now" value of the request being written
 #endif
 
 
@@ -88,21 +238,69 @@ boolean g_sensorFileReady = false;
 
 
 // dust sensor objects and data
-DustSensor g_dustSensors[ DUST_SENSOR_COUNT ];
-float g_dustRatios[ DUST_SENSOR_COUNT ];
+DustSensors g_dustSensors;
+#ifdef USE_DUST_CAPTURE
+DustSensorCapture<4> g_dustCapture4; // pin 49
+DustSensorCapture<5> g_dustCapture5; // pin 48
+#endif
+#ifdef DUST_SENSOR_PULSE_STATS
+DustPulseStats g_dustStats[ DUST_SENSOR_COUNT ]; // of the last window only
+#endif
+#ifdef USE_DUST_SAMPLER
+DustPortSampler g_dustSampler;
+byte g_polledDustChannels[ POLLED_DUST_COUNT ];
+#endif
+
+
+// a sample: the values of one dust window in raw form; they are converted
+// for display only when logged, saved or uploaded
+#define SAMPLE_NO_VALUE -32768 // temperature/humidity when the reading failed
+struct SampleRecord {
+  unsigned long time; // g_sampleClock seconds at the end of the window
+  byte missed; // windows missed (and merged into this one) just before it
+  int temperature; // tenths of a degree Celsius
+  int humidity; // tenths of a percent
+  unsigned int dustRatios[ DUST_SENSOR_COUNT ]; // fraction of the window spent low; 65535 = all
+#ifdef USE_DUST_SAMPLER
+  unsigned int polledDustRatios[ POLLED_DUST_COUNT ];
+#endif
+};
+
+
+
+// samples waiting for upload, oldest first; the batch being uploaded is
+// identified by sequence numbers, so samples dropped meanwhile are skipped
+SampleRecord g_sample; // the last sample
+SampleQueue< SampleRecord, SAMPLE_BUFFER_SIZE > g_sampleQueue SAMPLE_QUEUE_NOINIT;
+SampleClock g_sampleClock SAMPLE_QUEUE_NOINIT; // sample times; goes on across resets, so queued samples keep theirs
+SampleRecord g_sendSample; // a sample of the batch, read by readSendSample()
+unsigned long g_sendSeq = 0; // first sample of the batch
+byte g_sendCount = 0; // samples in the batch
+TransportRouter g_router; // picks the link each batch goes over
+#ifdef SEND_PACKED_RECORDS
+byte g_packedBuffer[ PACKED_BUFFER_SIZE ];
+RecordEncoder g_packedEncoder( g_packedBuffer, PACKED_BUFFER_SIZE );
+char g_packedText[ RECORD_BASE64_SIZE( PACKED_BUFFER_SIZE ) ];
+#endif
 
 
 // other globals
 ManylabsDataAuth g_dataAuth;
-unsigned long g_lastSensorTime = 0;
-unsigned long g_uptimeSeconds = 0; // seconds
-unsigned long g_uptimeMSec = 0; // msec part
-float g_temperature = 0;
-float g_humidity = 0;
+unsigned long g_missedWindows = 0; // sample windows missed since startup
+int g_temperature = SAMPLE_NO_VALUE; // last reading, tenths of a degree Celsius
+int g_humidity = SAMPLE_NO_VALUE; // last reading, tenths of a percent
 float g_batteryVolts = 0;
 float g_signalStrength = 0;
 ChainableLED g_led( LED_PIN, LED_PIN + 1, 1 );
-DHT g_dht( DHT_PIN, DHT22 );
+DHTReader g_dht( DHT_PIN, DHT22 );
+int g_ledHue = 0;
+float g_ledSaturation = 0, g_ledLightness = 0;
+
+
+// task scheduler; sampling never waits for logging, sending or the LED
+TaskScheduler g_scheduler;
+byte g_logTaskId = TASK_NONE;
+byte g_sendTaskId = TASK_NONE;
 
 
 // ======== MAIN FUNCTIONS ========
@@ -118,24 +316,45 @@ void setup() {
   setLedHsl( 60, 1, 0.5 ); // yellow
   pinMode( DHT_PIN, INPUT );
   pinMode( DHT_PIN + 1, INPUT );
+  g_dht.begin();
 #ifdef ENABLE_WDT
   wdt_enable( WDTO_8S ); // enable watchdog timer with 8-second timeout
 #endif
 
+  // keep the samples that were waiting for upload before a reset
+  g_sampleQueue.begin( 0, SAMPLE_EEPROM_BYTES / g_sampleQueue.slotSize() );
+  Serial.print( "queued samples: " );
+  Serial.println( g_sampleQueue.count() );
+
+  // go on with the sample times where the last run left them, so the server
+  // times the queued samples right against the "now" of later uploads
+  SampleRecord newest;
+  unsigned long newestTime = 0;
+  if (g_sampleQueue.count() && g_sampleQueue.read( g_sampleQueue.count() - 1, newest )) {
+    newestTime = newest.time;
+  }
+  g_sampleClock.begin( newestTime );
+
   // prep dust sensors
-  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
-    g_dustSensors[ i ].init( dustPins[ i ] );
+  g_dustSensors.begin();
+#ifdef USE_DUST_CAPTURE
+  g_dustCapture4.init();
+  g_dustCapture5.init();
+#endif
+#ifdef USE_DUST_SAMPLER
+  for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+    g_polledDustChannels[ i ] = g_dustSampler.addChannel( polledDustPins[ i ] );
+    if (g_polledDustChannels[ i ] == DUST_SAMPLER_NO_CHANNEL) {
+      Serial.print( "dust sampler: no room for pin " );
+      Serial.println( polledDustPins[ i ] );
+    }
   }
-  attachInterrupt( digitalPinToInterrupt( g_dustSensors[ 0 ].pin() ), timeDustPulse0, CHANGE );
-  attachInterrupt( digitalPinToInterrupt( g_dustSensors[ 1 ].pin() ), timeDustPulse1, CHANGE );
-  attachInterrupt( digitalPinToInterrupt( g_dustSensors[ 2 ].pin() ), timeDustPulse2, CHANGE );
-  attachInterrupt( digitalPinToInterrupt( g_dustSensors[ 3 ].pin() ), timeDustPulse3, CHANGE );
-  attachInterrupt( digitalPinToInterrupt( g_dustSensors[ 4 ].pin() ), timeDustPulse4, CHANGE );
-  attachInterrupt( digitalPinToInterrupt( g_dustSensors[ 5 ].pin() ), timeDustPulse5, CHANGE );
+  g_dustSampler.begin();
+#endif
 
   // prep wifi
 #ifdef USE_WIFI
-  Serial2.begin( 9600 );
+  Serial2.begin( WIFI_BAUD );
   g_dataAuth.init( F(PUBLIC_KEY), F(PRIVATE_KEY) );
   g_wifiParamBuffer[ 0 ] = 0;
   if (g_wifiSender.init( NETWORK_NAME, NETWORK_PASSWORD, g_wifiParamBuffer, PARAM_BUF_SIZE )) {
@@ -143,20 +362,24 @@ void setup() {
   } else {
     Serial.println( "wifi init failed" );
   }
+  Serial.print( "wifi baud: " );
+  Serial.println( g_wifiSender.setBaudRate( Serial2, WIFI_BAUD, WIFI_FAST_BAUD, WIFI_RESET_PIN ) );
+#ifdef WIFI_KEEP_ALIVE
+  g_wifiSender.setKeepAlive( true );
+#endif
+  g_wifiSender.setUploadHeaders( g_headerBuffer ); // written by addWifiData
+  g_wifiLink = g_router.add( g_wifiSender, addWifiData, g_wifiRetry, WIFI_COST );
 #endif
 
   // prep GSM
 #ifdef USE_GSM
-  g_gprsSerial.begin( 19200 );
+  Serial3.begin( GSM_BAUD );
   g_dataAuth.init( F(PUBLIC_KEY), F(PRIVATE_KEY) );
   g_gprsSender.addManylabsDataAuth( &g_dataAuth );
-  if (g_gprsSender.init( F(APN) )) {
-    Serial.println( "GSM init success" );    
-    setLedHsl( 120, 1, 0.5 ); // Green
-  } else {
-    Serial.println( "GSM init failed" );    
-    setLedHsl( 0, 1, 0.5 ); // Red
-  }
+  g_gprsSender.setBaudRate( Serial3, GSM_BAUD, GSM_FAST_BAUD ); // moved during init
+  g_gprsSender.startInit( F(APN) ); // finished by gsmTask
+  Serial.println( "GSM init started" );
+  g_gsmLink = g_router.add( g_gprsSender, addGsmData, g_gsmRetry, GSM_COST );
 #endif
 
   // prep SD
@@ -183,6 +406,35 @@ void setup() {
     }
   }
 #endif
+
+  // start the tasks; this device's upload slot is picked at random
+  randomSeed( noiseSeed() );
+  addTask( pollTask, 1, 0 );
+  addTask( dhtTask, DHT_PERIOD, DUST_PERIOD - DHT_LEAD_TIME );
+  addTask( sampleTask, DUST_PERIOD, DUST_PERIOD );
+  addTask( uploadTask, UPLOAD_PERIOD, UPLOAD_PERIOD + random( UPLOAD_PERIOD ) );
+  g_logTaskId = addTask( logTask, 0, 0 );
+  g_sendTaskId = addTask( sendTask, 0, 0 );
+  addTask( ledTask, LED_BLINK_PERIOD, 0 );
+#ifdef USE_WIFI
+  addTask( wifiTask, 1, 0 );
+#endif
+#ifdef USE_GSM
+  addTask( gsmTask, 1, 0 );
+#endif
+}
+
+
+// add a task to the scheduler; stops here if the task table is full, since
+// the sketch doesn't work with a task missing (raise TASK_SCHEDULER_MAX_TASKS)
+byte addTask( TaskFunction function, unsigned long period, unsigned long delay ) {
+  byte id = g_scheduler.add( function, period, delay );
+  if (id == TASK_NONE) {
+    Serial.println( "too many tasks" );
+    setLedHsl( 0, 1, 0.5 ); // Red
+    while (true) {}
+  }
+  return id;
 }
 
 
@@ -194,54 +446,292 @@ void loop() {
   wdt_reset();
 #endif
 
-  // read the sensor data
-  unsigned long time = millis();
-  if (time - g_lastSensorTime > 30000LL) { 
-  
-    // read sensors
-    unsigned long elapsedTime = time - g_lastSensorTime;
-    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
-      g_dustRatios[ i ] = g_dustSensors[ i ].pulseRatio( elapsedTime );
-    }
-    g_temperature = g_dht.readTemperature();
-    g_humidity = g_dht.readHumidity();
-#ifdef USE_GSM
-    g_signalStrength = g_gprsSender.signalStrength();
-#endif
-    g_batteryVolts = 0; //analogRead( BATTERY_VOLTS_PIN ) * 5.0 * 3.0 / 1023.0; // using voltage divider scale factor of 3 
-    updateUptime();
-    
-    // display sensor values
-    Serial.print( "time: " );
-    Serial.print( g_uptimeSeconds );
-    Serial.print( ", temp: " );
-    Serial.print( g_temperature );
-    Serial.print( ", batt: " );
-    Serial.print( g_batteryVolts );
-    Serial.print( ", sig: " );
-    Serial.print( g_signalStrength );
-    Serial.print( ", dust: " );
-    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
-      if (i) {
-        Serial.print( ", " );
-      }
-      Serial.print( g_dustRatios[ i ], 3 );
-    }
-    Serial.println();
+  g_scheduler.run();
+}
 
-    // send/save sensor values after the first iteration
-    if (time > 90000LL) {
-#ifdef USE_WIFI
-      sendWifiData();
+
+// ======== TASKS ========
+
+
+// poll background work that needs frequent attention
+void pollTask() {
+#ifdef DUST_SENSOR_PULSE_STATS
+  g_dustSensors.pollEdges();
+#ifdef USE_DUST_CAPTURE
+  g_dustCapture4.pollEdges();
+  g_dustCapture5.pollEdges();
 #endif
-#ifdef USE_GSM
-      sendGsmData();
+#endif
+  if (g_dht.poll()) {
+    DHTReading reading = g_dht.reading();
+    g_temperature = reading.valid ? reading.temperature : SAMPLE_NO_VALUE;
+    g_humidity = reading.valid ? reading.humidity : SAMPLE_NO_VALUE;
+  }
+}
+
+
+// start reading the temperature/humidity sensor shortly before each sample
+void dhtTask() {
+  g_dht.start();
+}
+
+
+// close the sample window and record a sample
+void sampleTask() {
+
+  // read sensors; all dust windows are closed in one critical section (the
+  // interrupt-pin ones at the same timestamp, the capture ones on their own
+  // timers) before any ratio or pulse statistics are read
+  byte sreg = SREG;
+  cli();
+  g_dustSensors.closeAll( micros() );
+#ifdef USE_DUST_CAPTURE
+  g_dustCapture4.close();
+  g_dustCapture5.close();
+#endif
+  SREG = sreg;
+  g_dustSensors.collectAll();
+#ifdef USE_DUST_CAPTURE
+  g_dustCapture4.collectWindow();
+  g_dustCapture5.collectWindow();
+#endif
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+    g_sample.dustRatios[ i ] = dustSensorRatioQ16( i );
+  }
+#ifdef USE_DUST_SAMPLER
+  g_dustSampler.snapshot();
+  for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+    byte channel = g_polledDustChannels[ i ];
+    g_sample.polledDustRatios[ i ] = channel == DUST_SAMPLER_NO_CHANNEL ? 0 :
+      dustRatioQ16( g_dustSampler.lowSamples( channel ), g_dustSampler.samples() );
+  }
+#endif
+#ifdef DUST_SENSOR_PULSE_STATS
+  for (int i = 0; i < DustSensors::count; i++) {
+    g_dustStats[ i ] = g_dustSensors[ i ].pulseStats();
+  }
+#ifdef USE_DUST_CAPTURE
+  g_dustStats[ DustSensors::count ] = g_dustCapture4.pulseStats();
+  g_dustStats[ DustSensors::count + 1 ] = g_dustCapture5.pulseStats();
+#endif
+#endif
+  g_sample.temperature = g_temperature;
+  g_sample.humidity = g_humidity;
+  g_batteryVolts = 0; //analogRead( BATTERY_VOLTS_PIN ) * 5.0 * 3.0 / 1023.0; // using voltage divider scale factor of 3 
+
+  // time the sample by the window's deadline so samples are exactly
+  // DUST_PERIOD apart; a late run closes a window that includes any missed
+  // ones, so report those with the sample
+  unsigned long missed = g_scheduler.missed();
+  g_sample.time = g_sampleClock.seconds( g_scheduler.deadline() / 1000 );
+  g_sample.missed = missed > 255 ? 255 : missed;
+  g_missedWindows += missed;
+
+  // log the sample and keep/save it after the first few windows
+  g_scheduler.wake( g_logTaskId );
+  if (g_scheduler.deadline() >= WARMUP_TIME) {
+#if defined(USE_WIFI) || defined(USE_GSM)
+    g_sampleQueue.push( g_sample );
 #endif
 #ifdef USE_SD
-      saveData();
+    saveData();
 #endif
+  }
+}
+
+
+// display sensor values and task statistics
+void logTask() {
+  Serial.print( "time: " );
+  Serial.print( g_sample.time );
+  Serial.print( ", temp: " );
+  Serial.print( tenthsValue( g_sample.temperature ) );
+  Serial.print( ", batt: " );
+  Serial.print( g_batteryVolts );
+  Serial.print( ", sig: " );
+  Serial.print( g_signalStrength );
+  Serial.print( ", dust: " );
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+    if (i) {
+      Serial.print( ", " );
+    }
+    Serial.print( ratioValue( g_sample.dustRatios[ i ] ), 3 );
+  }
+#ifdef USE_DUST_SAMPLER
+  for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+    Serial.print( ", " );
+    Serial.print( ratioValue( g_sample.polledDustRatios[ i ] ), 3 );
+  }
+#endif
+  Serial.println();
+  Serial.print( "queued: " );
+  Serial.print( g_sampleQueue.count() );
+  Serial.print( " (" );
+  Serial.print( g_sampleQueue.spilled() );
+  Serial.print( " in EEPROM), dropped: " );
+  Serial.print( g_sampleQueue.dropped() );
+  Serial.print( ", missed windows: " );
+  Serial.print( g_missedWindows );
+  Serial.print( ", overruns:" );
+  for (byte i = 0; i < g_scheduler.count(); i++) {
+    Serial.print( ' ' );
+    Serial.print( g_scheduler.overruns( i ) );
+  }
+  Serial.println();
+}
+
+
+// start uploading the samples collected since the last upload
+void uploadTask() {
+  g_scheduler.wake( g_sendTaskId );
+}
+
+
+// start uploading the oldest queued samples in one request over the link
+// the router picks; uploadFinished() goes on with the next batch
+void sendTask() {
+  if (g_router.uploading() != TRANSPORT_NONE || g_sampleQueue.count() == 0) {
+    return;
+  }
+  byte link = g_router.choose();
+  if (link == TRANSPORT_NONE) {
+    scheduleRetry();
+    return;
+  }
+  g_sendSeq = g_sampleQueue.firstSeq();
+  g_sendCount = min( g_sampleQueue.count(), UPLOAD_BATCH_SIZE );
+  Serial.println(); // Blank line
+  Serial.print( F("Sending via ") );
+  Serial.println( linkName( link ) );
+
+  // a link that can't start now (e.g. an operation of its module is still
+  // running) counts as no failure; keep the LED and try again soon
+  if (g_router.startUpload( link ) == false) {
+    Serial.println( F("not started") );
+    g_scheduler.wake( g_sendTaskId, RETRY_MIN_DELAY );
+    return;
+  }
+  setLedHsl( 240, 1, 0.5 ); // Blue
+}
+
+
+// run sendTask again when the first link that is waiting to retry may
+// upload; a busy link is tried at the next upload period
+void scheduleRetry() {
+  unsigned long wait = g_router.wait();
+  if (wait) {
+    Serial.print( F("retry in ") );
+    Serial.println( wait );
+    g_scheduler.wake( g_sendTaskId, wait );
+  }
+}
+
+
+// blink the status LED so a stalled loop is visible
+void ledTask() {
+  static boolean s_lit = true;
+  s_lit = !s_lit;
+  showLed( g_ledHue, g_ledSaturation, s_lit ? g_ledLightness : 0 );
+}
+
+
+// ======== SAMPLE QUEUE ========
+
+
+// read sample i of the batch into g_sendSample; returns false if it was
+// dropped since the batch started or its EEPROM copy is damaged (it is
+// removed with the batch)
+boolean readSendSample( int i ) {
+  unsigned long seq = g_sendSeq + i;
+  if (seq < g_sampleQueue.firstSeq()) {
+    return false;
+  }
+  if (!g_sampleQueue.read( seq - g_sampleQueue.firstSeq(), g_sendSample )) {
+    Serial.println( F("damaged sample skipped") );
+    return false;
+  }
+  return true;
+}
+
+
+// pack the samples of the batch into g_packedText (see PACKED_SCHEMA); the
+// batch ends early if the buffer is full. the same samples give the same
+// text, so GSM can count it and then write it
+#ifdef SEND_PACKED_RECORDS
+const char *packedRecords() {
+  g_packedEncoder.start( PACKED_SCHEMA, PACKED_FIELD_COUNT );
+  for (int s = 0; s < g_sendCount; s++) {
+    if (readSendSample( s ) == false) {
+      continue;
+    }
+    g_packedEncoder.startRecord();
+    g_packedEncoder.add( g_sendSample.time );
+    g_packedEncoder.add( g_sendSample.missed );
+    g_packedEncoder.add( g_sendSample.temperature );
+    g_packedEncoder.add( g_sendSample.humidity );
+    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+      g_packedEncoder.add( g_sendSample.dustRatios[ i ] );
+    }
+#ifdef USE_DUST_SAMPLER
+    for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+      g_packedEncoder.add( g_sendSample.polledDustRatios[ i ] );
+    }
+#endif
+    if (g_packedEncoder.endRecord() == false) {
+      g_sendCount = s;
+      break;
+    }
+  }
+  RecordEncoder::toBase64( g_packedEncoder.data(), g_packedEncoder.length(), g_packedText );
+  return g_packedText;
+}
+#endif
+
+
+// called when a link has finished uploading the batch; remove the batch if
+// it was delivered and go on with the next one. after a failure the samples
+// wait for the retry (see RetryPolicy), over this link or another one
+void uploadFinished( byte link ) {
+  boolean delivered = g_router.finished( link );
+  DataTransport &transport = g_router.transport( link );
+  if (delivered) {
+
+    // We don't consider a status code other than 201 an error: a 4xx is the
+    // server rejecting these values, and sending them again won't help (see
+    // TransportRouter::finished())
+    int statusCode = transport.lastStatusCode(); // Get HTTP response code
+    if (statusCode == 201) { // OK
+      setLedHsl( 120, 1, 0.5 ); // Green - Everything's ok
+      Serial.println( F("Success") );
+    } else {
+      Serial.print( F("Status: ") );
+      Serial.println( statusCode );
+      setLedHsl( 29, 1, 0.5 ); // Orange - Didn't get a 201 status
+    }
+  } else if (transport.lastErrorCode() == 1) {
+    Serial.println( F("Module Fail") );
+    setLedHsl( 0, 1, 0.5 ); // Red - the module didn't answer
+  } else {
+    Serial.println( F("Network Fail") );
+    setLedHsl( 300, 1, 0.5 ); // Magenta - network or server failed
+  }
+
+  // If the module keeps failing to answer, reset it (a GSM reset reconnects
+  // to the network too); failures of the network or the server are only
+  // retried. the link's task reports the end of the reset
+  if (g_router.resetDue( link )) {
+    Serial.print( F("resetting ") );
+    Serial.println( linkName( link ) );
+    g_router.startReset( link );
+  }
+  if (delivered) {
+    unsigned long end = g_sendSeq + g_sendCount;
+    if (end > g_sampleQueue.firstSeq()) { // not all dropped meanwhile
+      g_sampleQueue.pop( end - g_sampleQueue.firstSeq() );
     }
-    g_lastSensorTime = time;
+    g_scheduler.wake( g_sendTaskId );
+  } else {
+    scheduleRetry();
   }
 }
 
@@ -249,21 +739,98 @@ void loop() {
 // ======== SEND DATA TO SERVER ========
 
 
-// send data to server via WiFi
+// the name of an upload link for the log
+const __FlashStringHelper *linkName( byte link ) {
 #ifdef USE_WIFI
-void sendWifiData() {
+  if (link == g_wifiLink) {
+    return F("WiFi");
+  }
+#endif
+  return F("GSM");
+}
+
+
+// Adds the batch of samples and the current diagnostic values to the WiFi
+// sender and writes the headers for them; the router starts the send with
+// these
+#ifdef USE_WIFI
+void addWifiData() {
   Serial.println(F("Adding Data"));
   g_wifiSender.add( F("dataSetId"), DATA_SET_ID );
   g_wifiSender.add( F("addTimestamp"), 1 );
-  g_wifiSender.add( F("uptime"), (float) g_uptimeSeconds / 86400000.0, 3 );
-  g_wifiSender.add( F("temperature"), g_temperature, 2 );
-  g_wifiSender.add( F("humidity"), g_humidity, 2 );
-  g_wifiSender.add( F("ppd42_1"), g_dustRatios[ 0 ], 5 );
-  g_wifiSender.add( F("ppd42_2"), g_dustRatios[ 1 ], 5 );
-  g_wifiSender.add( F("ppd42_3"), g_dustRatios[ 2 ], 5 );
-  g_wifiSender.add( F("ppd60_1"), g_dustRatios[ 3 ], 4 );
-  g_wifiSender.add( F("ppd60_2"), g_dustRatios[ 4 ], 4 );
-  g_wifiSender.add( F("ppd60_3"), g_dustRatios[ 5 ], 4 );
+  g_wifiSender.add( F("now"), g_sampleClock.seconds( Timebase::seconds() ) );
+  char latency[ 24 ];
+  g_wifiSender.add( "latency_cmd", latencyValue( latency, g_wifiSender.commandLatency() ) );
+  g_wifiSender.add( "latency_join", latencyValue( latency, g_wifiSender.joinLatency() ) );
+  g_wifiSender.add( "latency_open", latencyValue( latency, g_wifiSender.openLatency() ) );
+  char name[ 16 ];
+#ifdef DUST_SENSOR_PULSE_STATS
+  char value[ 50 ];
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) { // of the last window only
+    const DustPulseStats &stats = g_dustStats[ i ];
+    g_wifiSender.add( dustFieldName( name, i, "_n" ), (unsigned long) stats.count );
+    g_wifiSender.add( dustFieldName( name, i, "_wmin" ), stats.minWidth );
+    g_wifiSender.add( dustFieldName( name, i, "_wmax" ), stats.maxWidth );
+    g_wifiSender.add( dustFieldName( name, i, "_hist" ), pulseHistogram( value, stats ) );
+  }
+#endif
+
+#ifdef SEND_PACKED_RECORDS
+  g_wifiSender.add( "packed", packedRecords() );
+#else
+
+  // the column names
+  g_wifiSender.startList( F("fields") );
+  g_wifiSender.startListItem();
+  g_wifiSender.addListValue( F("time,missed,temperature,humidity") );
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+    g_wifiSender.addListValue( dustFieldName( name, i, "" ) );
+  }
+#ifdef SEND_DUST_CONCENTRATION
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+    if (dustModels[ i ] != DUST_MODEL_NONE) {
+      g_wifiSender.addListValue( dustFieldName( name, i, "_conc" ) );
+    }
+  }
+#endif
+#ifdef USE_DUST_SAMPLER
+  for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+    g_wifiSender.addListValue( polledDustName( name, i ) );
+  }
+#endif
+
+  // one row per sample; the batch ends early if the buffer is full
+  g_wifiSender.startList( F("records") );
+  for (int s = 0; s < g_sendCount; s++) {
+    if (g_wifiSender.spaceLeft() < SAMPLE_TEXT_SIZE) {
+      g_sendCount = s;
+      break;
+    }
+    if (readSendSample( s ) == false) {
+      continue;
+    }
+    g_wifiSender.startListItem();
+    g_wifiSender.addListValue( g_sendSample.time );
+    g_wifiSender.addListValue( g_sendSample.missed );
+    g_wifiSender.addListValue( tenthsValue( g_sendSample.temperature ), 1 );
+    g_wifiSender.addListValue( tenthsValue( g_sendSample.humidity ), 1 );
+    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+      g_wifiSender.addListValue( ratioValue( g_sendSample.dustRatios[ i ] ), i < 3 ? 5 : 4 );
+    }
+#ifdef SEND_DUST_CONCENTRATION
+    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+      if (dustModels[ i ] != DUST_MODEL_NONE) {
+        g_wifiSender.addListValue( dustConcentration( dustModels[ i ], g_sendSample.dustRatios[ i ] ) );
+      }
+    }
+#endif
+#ifdef USE_DUST_SAMPLER
+    for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+      g_wifiSender.addListValue( ratioValue( g_sendSample.polledDustRatios[ i ] ), 4 );
+    }
+#endif
+  }
+#endif
 
   // Setup header
   Serial.println(F("Creating Header"));
@@ -277,114 +844,129 @@ void sendWifiData() {
   g_dataAuth.print(g_wifiParamBuffer);
   g_dataAuth.writeAuthHeader(g_headerBuffer, HEADER_BUFFER_LENGTH);
   Serial.println(g_headerBuffer);
+}
 
-  Serial.println(F("Sending"));
-#ifdef ENABLE_WDT
-  wdt_reset();
-#endif
-  if(g_wifiSender.send(g_headerBuffer)){
-    setLedHsl( 120, 1, 0.5 ); // Green
-    Serial.println(F("Success"));
-  }else{
-    setLedHsl( 0, 1, 0.5 ); // Red
-    Serial.println(F("Failure"));
+
+// advance the WiFi module; a finished reboot lets the waiting samples go out
+void wifiTask() {
+  if (g_wifiSender.poll()) {
+    if (g_router.uploading() == g_wifiLink) {
+      uploadFinished( g_wifiLink );
+    } else {
+      Serial.println( F("WiFi rebooted") );
+      g_scheduler.wake( g_sendTaskId );
+    }
   }
-#ifdef ENABLE_WDT
-  wdt_reset();
-#endif
 }
 #endif
 
 
-// Takes an AQSensorValues object and adds the values it contains to the gprs
-// sender. If includeDiagnostics is true, it also adds diagnostic values.
-// Depending on the state of the gprs sender, this is either for the purpose of
-// determining the content-length, or for adding the data to be sent.
+// Adds the batch of samples and the current diagnostic values to the gprs
+// sender. Depending on the state of the gprs sender, this is either for the
+// purpose of determining the content-length, or for adding the data to be
+// sent, so it must add the same text both times.
 #ifdef USE_GSM
 void addGsmData() {
   g_gprsSender.add( F("dataSetId"), DATA_SET_ID );
   g_gprsSender.add( F("addTimestamp"), 1 );
-  g_gprsSender.add( F("uptime"), (float) g_uptimeSeconds / 86400000.0, 2 );
-  g_gprsSender.add( F("temperature"), g_temperature, 2 );
-  g_gprsSender.add( F("humidity"), g_humidity, 2 );
+  g_gprsSender.add( F("now"), g_sendNow );
   g_gprsSender.add( F("battery_volts"), g_batteryVolts, 3 );
   g_gprsSender.add( F("signal_strength"), g_signalStrength );
-  g_gprsSender.add( F("ppd42_1"), g_dustRatios[ 0 ], 4 );
-  g_gprsSender.add( F("ppd42_2"), g_dustRatios[ 1 ], 4 );
-  g_gprsSender.add( F("ppd42_3"), g_dustRatios[ 2 ], 4 );
-  g_gprsSender.add( F("ppd60_1"), g_dustRatios[ 3 ], 4 );
-  g_gprsSender.add( F("ppd60_2"), g_dustRatios[ 4 ], 4 );
-  g_gprsSender.add( F("ppd60_3"), g_dustRatios[ 5 ], 4 );
-}
+  char latency[ 24 ];
+  g_gprsSender.add( "latency_cmd", latencyValue( latency, g_gprsSender.commandLatency() ) );
+  g_gprsSender.add( "latency_bearer", latencyValue( latency, g_gprsSender.bearerLatency() ) );
+  g_gprsSender.add( "latency_server", latencyValue( latency, g_gprsSender.serverLatency() ) );
+  g_gprsSender.add( "latency_shut", latencyValue( latency, g_gprsSender.shutLatency() ) );
+  char name[ 16 ];
+#ifdef DUST_SENSOR_PULSE_STATS
+  char value[ 50 ];
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) { // of the last window only
+    const DustPulseStats &stats = g_dustStats[ i ];
+    g_gprsSender.add( dustFieldName( name, i, "_n" ), (unsigned long) stats.count );
+    g_gprsSender.add( dustFieldName( name, i, "_wmin" ), stats.minWidth );
+    g_gprsSender.add( dustFieldName( name, i, "_wmax" ), stats.maxWidth );
+    g_gprsSender.add( dustFieldName( name, i, "_hist" ), pulseHistogram( value, stats ) );
+  }
 #endif
 
+#ifdef SEND_PACKED_RECORDS
+  g_gprsSender.add( "packed", packedRecords() );
+#else
 
-#ifdef USE_GSM
-void sendGsmData() {
-
-  // Add data to generate auth and content-length headers. This doesn't actually
-  // add the data to the request body until we call prepare to send.
-  addData();
-
-  bool error = true; // We'll set this to false if send is successful
-
-  if( g_gprsSender.prepareToSend() ){
-    // Now when we call add, we're adding the data to the body of the request.
-    addData();
-
-    Serial.println(); // Blank line
-    Serial.println( F("Sending") );
-    setLedHsl( 240,1,0.5 ); // Blue
-
-    if (g_gprsSender.send()) {
-
-      // We don't consider a status code other than 201 an error (nothing we can
-      // do about it here), so set this before checking the status code.
-      error = false;
-
-      int statusCode = g_gprsSender.lastStatusCode(); // Get HTTP response code
-      if (statusCode == 201) { // OK
-        setLedHsl( 120, 1, 0.5 ); // Green - Everything's ok
-        Serial.println( "success" );
-      } else {
-        Serial.println( F("Status: ") );
-        Serial.println( statusCode );
-        setLedHsl( 29, 1, 0.5 ); // Orange - Didn't get a 201 status
-      }
+  // the column names
+  g_gprsSender.startList( F("fields") );
+  g_gprsSender.startListItem();
+  g_gprsSender.addListValue( F("time,missed,temperature,humidity") );
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+    g_gprsSender.addListValue( dustFieldName( name, i, "" ) );
+  }
+#ifdef SEND_DUST_CONCENTRATION
+  for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+    if (dustModels[ i ] != DUST_MODEL_NONE) {
+      g_gprsSender.addListValue( dustFieldName( name, i, "_conc" ) );
     }
   }
+#endif
+#ifdef USE_DUST_SAMPLER
+  for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+    g_gprsSender.addListValue( polledDustName( name, i ) );
+  }
+#endif
 
-  if (error) { // prepareToSend or send failed
-    int errorCause = g_gprsSender.lastErrorCode();
-    if (errorCause == 2) {
-      Serial.println( F("Network Fail") );
-      setLedHsl( 300,1,0.5 ); // Magenta - TCP Failed
-    } else {
-      Serial.println( F("GPRS Fail") );
-      setLedHsl( 0,1,0.5 ); // Red - GPRS Failed
+  // one row per sample
+  g_gprsSender.startList( F("records") );
+  for (int s = 0; s < g_sendCount; s++) {
+    if (readSendSample( s ) == false) {
+      continue;
     }
-
-    // If we have repeated problems with the gprs sender, reboot and reconnect
-    g_gprsFailCount++;
-    if (g_gprsFailCount > 1) {
-      g_gprsFailCount = 0;
-      rebootAndReconnect();
+    g_gprsSender.startListItem();
+    g_gprsSender.addListValue( g_sendSample.time );
+    g_gprsSender.addListValue( g_sendSample.missed );
+    g_gprsSender.addListValue( tenthsValue( g_sendSample.temperature ), 1 );
+    g_gprsSender.addListValue( tenthsValue( g_sendSample.humidity ), 1 );
+    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+      g_gprsSender.addListValue( ratioValue( g_sendSample.dustRatios[ i ] ), 4 );
+    }
+#ifdef SEND_DUST_CONCENTRATION
+    for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
+      if (dustModels[ i ] != DUST_MODEL_NONE) {
+        g_gprsSender.addListValue( dustConcentration( dustModels[ i ], g_sendSample.dustRatios[ i ] ) );
+      }
     }
+#endif
+#ifdef USE_DUST_SAMPLER
+    for (int i = 0; i < POLLED_DUST_COUNT; i++) {
+      g_gprsSender.addListValue( ratioValue( g_sendSample.polledDustRatios[ i ] ), 4 );
+    }
+#endif
   }
+#endif
 }
 #endif
 
 
 #ifdef USE_GSM
-// Reboot the gprs module and reconnect to the GSM network
-void rebootAndReconnect() {
-  Serial.println( F("rebooting") );
-  g_gprsSender.reboot();
-  Serial.println( F("reconnecting") );
-  if (g_gprsSender.waitForNetworkReg()) {
-    Serial.println( "success" );
-  } else {
-    Serial.println( F("fail") );
+// advance the GSM module; sampling continues while it registers, attaches or
+// waits for the server
+void gsmTask() {
+
+  // Once the connection is open, poll() counts and writes the values in one
+  // go with addGsmData; these must stay the same in both passes
+  if (g_gprsSender.readyForData()) {
+    g_signalStrength = g_gprsSender.lastSignalStrength();
+    g_sendNow = g_sampleClock.seconds( Timebase::seconds() );
+  }
+  if (g_gprsSender.poll()) {
+    if (g_router.uploading() == g_gsmLink) {
+      uploadFinished( g_gsmLink );
+    } else if (g_gprsSender.lastErrorCode() == 0) {
+      Serial.println( "GSM init success" );
+      setLedHsl( 120, 1, 0.5 ); // Green
+      g_scheduler.wake( g_sendTaskId );
+    } else {
+      Serial.println( "GSM init failed" );
+      setLedHsl( 0, 1, 0.5 ); // Red
+    }
   }
 }
 #endif
@@ -407,18 +989,18 @@ void saveDataHeader() {
 #ifdef USE_SD
 void saveData() {
   if (g_sensorFileReady) {
-    g_sensorFile.print( g_uptimeSeconds );
+    g_sensorFile.print( g_sample.time );
     g_sensorFile.print( "," );
-    g_sensorFile.print( g_temperature );
+    g_sensorFile.print( tenthsValue( g_sample.temperature ) );
     g_sensorFile.print( "," );
-    g_sensorFile.print( g_humidity );
+    g_sensorFile.print( tenthsValue( g_sample.humidity ) );
     g_sensorFile.print( "," );
     g_sensorFile.print( g_batteryVolts );
     g_sensorFile.print( "," );
     g_sensorFile.print( g_signalStrength );
     for (int i = 0; i < DUST_SENSOR_COUNT; i++) {
       g_sensorFile.print( "," );
-      g_sensorFile.print( g_dustRatios[ i ], 4 );
+      g_sensorFile.print( ratioValue( g_sample.dustRatios[ i ] ), 4 );
     }
     g_sensorFile.println();
     g_sensorFile.flush();
@@ -431,15 +1013,6 @@ void saveData() {
 // ======== HELPER FUNCTIONS ========
 
 
-// interrupt handler for dust sensor - times low pulse occupancy
-void timeDustPulse0( void ) { g_dustSensors[ 0 ].change(); }
-void timeDustPulse1( void ) { g_dustSensors[ 1 ].change(); }
-void timeDustPulse2( void ) { g_dustSensors[ 2 ].change(); }
-void timeDustPulse3( void ) { g_dustSensors[ 3 ].change(); }
-void timeDustPulse4( void ) { g_dustSensors[ 4 ].change(); }
-void timeDustPulse5( void ) { g_dustSensors[ 5 ].change(); }
-
-
 // Sets the color of the RGB LED using HSL color format.
 // h: Hue - between 0 and 360
 // s: Saturation - between 0 and 1
@@ -449,6 +1022,15 @@ void timeDustPulse5( void ) { g_dustSensors[ 5 ].change(); }
 // Note: l = 0.5 is the "brightest" the led can get for a given color before
 // moving towards white. At l = 1 all colors will show as white.
 void setLedHsl( int h, float s, float l ) {
+  g_ledHue = h;
+  g_ledSaturation = s;
+  g_ledLightness = l;
+  showLed( h, s, l );
+}
+
+
+// set the LED color without storing it as the status color
+void showLed( int h, float s, float l ) {
 
   // 1 / 360 = 0.00278
   float convertedHue = h * 0.00278;
@@ -458,27 +1040,89 @@ void setLedHsl( int h, float s, float l ) {
 }
 
 
-// not need with newer Arduino IDE
-byte digitalPinToInterrupt( byte pin ) {
-  switch (pin) {
-  case 2: return 0; // uno/mega
-  case 3: return 1; // uno/mega
-  case 21: return 2; // mega
-  case 20: return 3; // mega
-  case 19: return 4; // mega
-  case 18: return 5; // mega
-  } 
-  return -1;
+// convert a fixed-point ratio (65535 = 1) for display
+float ratioValue( unsigned int ratio ) {
+  return ratio / 65535.0;
+}
+
+
+// convert tenths for display; NAN for SAMPLE_NO_VALUE
+float tenthsValue( int value ) {
+  return value == SAMPLE_NO_VALUE ? NAN : value / 10.0;
+}
+
+
+// fixed-point ratio of a dust sensor from the last closed window
+unsigned int dustSensorRatioQ16( int sensor ) {
+#ifdef USE_DUST_CAPTURE
+  if (sensor == DustSensors::count) {
+    return g_dustCapture4.ratioQ16();
+  }
+  if (sensor == DustSensors::count + 1) {
+    return g_dustCapture5.ratioQ16();
+  }
+#endif
+  return g_dustSensors[ sensor ].ratioQ16();
+}
+
+
+// build the name of a field for a dust sensor, e.g. "ppd42_1" or "ppd42_1_n"
+char *dustFieldName( char *name, int sensor, const char *suffix ) {
+  strcpy( name, sensor < 3 ? "ppd42_" : "ppd60_" );
+  name[ 6 ] = '1' + sensor % 3;
+  strcpy( name + 7, suffix );
+  return name;
+}
+
+
+#ifdef DUST_SENSOR_PULSE_STATS
+// format a pulse width histogram as counts joined by '+' (spaces once decoded)
+char *pulseHistogram( char *value, const DustPulseStats &stats ) {
+  char *pos = value;
+  for (int i = 0; i < DUST_HISTOGRAM_BUCKETS; i++) {
+    if (i) {
+      *pos++ = '+';
+    }
+    utoa( stats.histogram[ i ], pos, 10 );
+    pos += strlen( pos );
+  }
+  return value;
+}
+#endif
+
+
+// a seed for random() that differs between devices and startups: the noise
+// of an unconnected analog input mixed with the time setup took (which
+// depends on the modules' replies)
+unsigned long noiseSeed() {
+  unsigned long seed = micros();
+  for (int i = 0; i < 32; i++) {
+    seed = (seed << 1 | seed >> 31) ^ analogRead( NOISE_PIN );
+  }
+  return seed;
 }
 
 
-// compute how long the device has been active
-void updateUptime() {
-  static unsigned long s_lastUptimeCheck = 0;
-  unsigned long now = millis();
-  g_uptimeMSec += (now - s_lastUptimeCheck);
-  g_uptimeSeconds += g_uptimeMSec / 1000;
-  g_uptimeMSec = g_uptimeMSec % 1000;
-  s_lastUptimeCheck = now;
+// format the reply times learned for a kind of module command (see
+// LatencyTracker) as the average and deviation in ms joined by '+' (a space
+// once decoded), e.g. "240+35"; they are sent with each upload to show the
+// health of the link
+char *latencyValue( char *value, const LatencyTracker &latency ) {
+  ultoa( latency.average(), value, 10 );
+  char *pos = value + strlen( value );
+  *pos++ = '+';
+  ultoa( latency.deviation(), pos, 10 );
+  return value;
 }
 
+
+#ifdef USE_DUST_SAMPLER
+// build the field name of a polled dust sensor, e.g. "dust_p1"
+char *polledDustName( char *name, int sensor ) {
+  strcpy( name, "dust_p" );
+  itoa( sensor + 1, name + 6, 10 );
+  return name;
+}
+#endif
+
+
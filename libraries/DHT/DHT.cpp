@@ -23,6 +23,7 @@ void DHT::begin(void) {
   pinMode(_pin, INPUT);
   digitalWrite(_pin, HIGH);
   _lastreadtime = 0;
+  _lastresult = false;
 }
 
 //boolean S == Scale.  True == Farenheit; False == Celcius
@@ -86,17 +87,16 @@ boolean DHT::read(void) {
   uint8_t j = 0, i;
   unsigned long currenttime;
 
-  // pull the pin high and wait 250 milliseconds
+  // the pin is left pulled high after begin() and after every transaction
   digitalWrite(_pin, HIGH);
-  delay(250);
 
   currenttime = millis();
   if (currenttime < _lastreadtime) {
     // ie there was a rollover
     _lastreadtime = 0;
   }
-  if (!firstreading && ((currenttime - _lastreadtime) < 2000)) {
-    return true; // return last correct measurement
+  if (!firstreading && ((currenttime - _lastreadtime) < DHT_MIN_INTERVAL)) {
+    return _lastresult; // return the result of the last transaction
     //delay(2000 - (currenttime - _lastreadtime));
   }
   firstreading = false;
@@ -155,12 +155,8 @@ boolean DHT::read(void) {
   */
 
   // check we read 40 bits and that the checksum matches
-  if ((j >= 40) && 
-      (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF)) ) {
-    return true;
-  }
-  
-
-  return false;
+  _lastresult = (j >= 40) &&
+      (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF));
+  return _lastresult;
 
 }
@@ -21,6 +21,17 @@ written by Adafruit Industries
 #define DHT21 21
 #define AM2301 21
 
+// the sensor must not be read more often than this (milliseconds)
+#define DHT_MIN_INTERVAL 2000
+
+// one combined reading of a sensor (see DHTReader::reading())
+struct DHTReading {
+  int temperature; // tenths of a degree Celsius
+  int humidity; // tenths of a percent relative humidity
+  boolean valid; // false if the transaction failed or the checksum did not match
+  unsigned long age; // milliseconds since the transaction
+};
+
 class DHT {
  private:
   uint8_t data[6];
@@ -28,6 +39,7 @@ class DHT {
   boolean read(void);
   unsigned long _lastreadtime;
   boolean firstreading;
+  boolean _lastresult;
 
  public:
   DHT(uint8_t pin, uint8_t type);
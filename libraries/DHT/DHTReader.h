@@ -0,0 +1,245 @@
+// Manylabs DHT reader
+// copyright Manylabs 2015; MIT license
+// --------
+// This file provides a non-blocking reader for DHT22/DHT21 (and DHT11)
+// sensors. Including it claims the Timer1 compare interrupt (this disables
+// the Servo library and PWM on the Timer1 pins), so only include it if you
+// use it.
+#ifndef _MANYLABS_DHT_READER_H_
+#define _MANYLABS_DHT_READER_H_
+#include "Arduino.h"
+#include "DHT.h"
+
+
+// microseconds between samples of the data pin while receiving (at least)
+#define DHT_SAMPLE_MICROS 10
+
+// Timer1 counts per microsecond (the timer runs at F_CPU / 8)
+#define DHT_TIMER_COUNTS_PER_MICRO (F_CPU / 8000000L)
+
+// a high period longer than this (in microseconds) is a one bit; the sensor
+// sends 26-28 us for a zero and 70 us for a one
+#define DHT_ONE_THRESHOLD 48
+
+// how long the start pulse holds the line low (milliseconds)
+#define DHT_START_MILLIS 20
+
+// how long a transmission may take before it is abandoned (milliseconds)
+#define DHT_RECEIVE_TIMEOUT 10
+
+
+// The DHTReader class reads a DHT sensor without blocking and without
+// disabling interrupts. start() pulls the line low and returns; poll(),
+// called from loop(), releases it after the start pulse and later collects
+// the result.
+//
+// While receiving, the Timer1 compare interrupt samples the pin about every
+// DHT_SAMPLE_MICROS microseconds and timestamps each level change with the
+// free-running Timer1 count; the decoder measures the width of every high
+// period from those timestamps. Other interrupts (such as the dust sensor
+// edges) keep running; one that delays or merges samples only delays the
+// timestamp of the next edge by as much, instead of shifting every later
+// timestamp as counting samples would. (The data pin needs no interrupt of
+// its own, so any pin works.)
+class DHTReader {
+public:
+
+	// create a new DHTReader object for a sensor type (DHT11, DHT21, DHT22)
+	DHTReader( byte pin, byte type ) {
+		_pin = pin;
+		_type = type;
+		_state = IDLE;
+		_started = false;
+		_valid = false;
+		_temperature = 0;
+		_humidity = 0;
+	}
+
+	// prepare the data pin
+	void begin() {
+		pinMode( _pin, INPUT_PULLUP );
+		_input = portInputRegister( digitalPinToPort( _pin ) );
+		_mask = digitalPinToBitMask( _pin );
+		s_instance = this;
+	}
+
+	// begin a transaction by pulling the line low; returns false if one is
+	// already running or the last one started less than DHT_MIN_INTERVAL ago
+	bool start() {
+		unsigned long now = millis();
+		if (_state != IDLE || (_started && now - _startTime < DHT_MIN_INTERVAL))
+			return false;
+		digitalWrite( _pin, LOW );
+		pinMode( _pin, OUTPUT );
+		_started = true;
+		_startTime = now;
+		_stateTime = now;
+		_state = STARTING;
+		return true;
+	}
+
+	// advance the transaction; returns true once when it has finished (check
+	// valid() to see whether it succeeded)
+	bool poll() {
+		switch (_state) {
+		case STARTING:
+			if (millis() - _stateTime >= DHT_START_MILLIS) {
+				receive();
+			}
+			break;
+		case RECEIVING:
+			if (_received || millis() - _stateTime > DHT_RECEIVE_TIMEOUT) {
+				stopSampling();
+				asm volatile( "" ::: "memory" ); // read the data only after sampling stops
+				_state = IDLE;
+				decode();
+				return true;
+			}
+			break;
+		}
+		return false;
+	}
+
+	// true while a transaction is running
+	inline bool busy() const { return _state != IDLE; }
+
+	// true if the last finished transaction passed the checksum
+	inline bool valid() const { return _valid; }
+
+	// temperature of the last valid transaction in tenths of a degree Celsius
+	inline int temperature() const { return _temperature; }
+
+	// relative humidity of the last valid transaction in tenths of a percent
+	inline int humidity() const { return _humidity; }
+
+	// the result of the last finished transaction
+	DHTReading reading() const {
+		DHTReading reading;
+		reading.temperature = _temperature;
+		reading.humidity = _humidity;
+		reading.valid = _valid;
+		reading.age = millis() - _startTime;
+		return reading;
+	}
+
+	// timer interrupt handler
+	static inline void tick() {
+		s_instance->sample();
+	}
+
+private:
+
+	// release the line and start sampling the sensor's response
+	void receive() {
+		memset( _data, 0, sizeof( _data ) );
+		_edges = 0;
+		_received = false;
+		_riseTime = 0;
+		_high = false; // the line was low until now
+		_state = RECEIVING;
+		_stateTime = millis();
+		byte sreg = SREG;
+		cli();
+		pinMode( _pin, INPUT_PULLUP );
+		TCCR1A = 0;
+		TCCR1B = _BV( CS11 ); // normal mode, F_CPU / 8
+		TCNT1 = 0;
+		OCR1A = DHT_SAMPLE_MICROS * DHT_TIMER_COUNTS_PER_MICRO;
+		TIFR1 = _BV( OCF1A );
+		TIMSK1 |= _BV( OCIE1A );
+		SREG = sreg;
+	}
+
+	// stop the timer interrupt
+	inline void stopSampling() {
+		TIMSK1 &= ~_BV( OCIE1A );
+	}
+
+	// sample the pin and pass level changes to the decoder; the next sample
+	// is scheduled from now, so a late one doesn't leave the compare behind
+	inline void sample() {
+		unsigned int now = TCNT1;
+		OCR1A = now + DHT_SAMPLE_MICROS * DHT_TIMER_COUNTS_PER_MICRO;
+		bool high = (*_input & _mask) != 0;
+		if (high != _high) {
+			_high = high;
+			edge( high, now );
+		}
+	}
+
+	// decode one edge; now is the Timer1 count (the transmission takes less
+	// than one timer period, so differences don't wrap)
+	inline void edge( bool high, unsigned int now ) {
+		if (high) {
+			_riseTime = now;
+			return;
+		}
+
+		// a falling edge ends a high period: the first two are the end of our
+		// release and the sensor's 80 us response, then one per data bit
+		if (_edges >= 2) {
+			byte bit = _edges - 2;
+			byte *data = _data + (bit >> 3);
+			*data <<= 1;
+			if ((unsigned int) (now - _riseTime) > DHT_ONE_THRESHOLD * DHT_TIMER_COUNTS_PER_MICRO)
+				*data |= 1;
+			if (bit == 39) {
+				_received = true;
+				stopSampling();
+			}
+		}
+		_edges++;
+	}
+
+	// check the received bytes and convert them to tenths
+	void decode() {
+		_valid = _received && _data[ 4 ] == (byte) (_data[ 0 ] + _data[ 1 ] + _data[ 2 ] + _data[ 3 ]);
+		if (!_valid)
+			return;
+		if (_type == DHT11) {
+			_humidity = _data[ 0 ] * 10;
+			_temperature = _data[ 2 ] * 10;
+		} else {
+			_humidity = ((int) _data[ 0 ] << 8) | _data[ 1 ];
+			_temperature = ((int) (_data[ 2 ] & 0x7F) << 8) | _data[ 3 ];
+			if (_data[ 2 ] & 0x80)
+				_temperature = -_temperature;
+		}
+	}
+
+	enum { IDLE, STARTING, RECEIVING };
+
+	// configuration
+	byte _pin;
+	byte _type;
+	volatile uint8_t *_input;
+	byte _mask;
+
+	// transaction state
+	byte _state;
+	unsigned long _stateTime;
+	bool _started;
+	unsigned long _startTime;
+
+	// decoder state (written by the interrupt handler while receiving)
+	byte _data[ 5 ];
+	byte _edges;
+	volatile bool _received;
+	unsigned int _riseTime; // Timer1 count
+	bool _high;
+
+	// result of the last finished transaction (tenths)
+	bool _valid;
+	int _temperature;
+	int _humidity;
+
+	static DHTReader *s_instance;
+};
+
+DHTReader *DHTReader::s_instance = NULL;
+
+
+ISR( TIMER1_COMPA_vect ) { DHTReader::tick(); }
+
+
+#endif // _MANYLABS_DHT_READER_H_
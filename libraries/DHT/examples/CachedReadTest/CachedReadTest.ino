@@ -0,0 +1,38 @@
+// Manylabs DHT example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example checks that a read within DHT_MIN_INTERVAL of the last
+// transaction returns that transaction's result instead of stale data. Run
+// it with NO sensor on the pin, so every transaction fails.
+
+#include "DHT.h"
+#include "TestReport.h"
+
+#define DHTPIN 2
+
+DHT dht( DHTPIN, DHT22 );
+TestReport report;
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+    dht.begin();
+
+    // the first read runs a transaction, which fails without a sensor
+    report.check("failed read", isnan( dht.readHumidity() ), 1);
+
+    // reads right after it are cached: they must report the failure too,
+    // not 0 from the cleared data
+    report.check("cached humidity", isnan( dht.readHumidity() ), 1);
+    report.check("cached temperature", isnan( dht.readTemperature() ), 1);
+
+    // after the interval a new transaction runs (and fails again)
+    delay( DHT_MIN_INTERVAL );
+    report.check("next read", isnan( dht.readTemperature() ), 1);
+
+    report.end();
+}
+
+void loop() {
+}
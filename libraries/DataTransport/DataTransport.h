@@ -0,0 +1,49 @@
+// Manylabs DataTransport Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library defines the interface of a link that uploads values to the
+// server (WifiSender, GprsSender), so a sketch can use several of them and
+// pick one for each upload (see TransportRouter.h).
+#ifndef _MANYLABS_DATA_TRANSPORT_H_
+#define _MANYLABS_DATA_TRANSPORT_H_
+#include "Arduino.h"
+
+
+// a function that adds the values of an upload to the transport's sender
+typedef void (*UploadWriter)();
+
+
+// The DataTransport class is implemented by the senders. All operations run
+// without blocking: they are started, then advanced by poll().
+class DataTransport {
+public:
+
+	// start an upload; the transport calls writeValues when it is ready for
+	// the values (once, or twice for GprsSender: see sendBody()). returns
+	// false if an operation is running
+	virtual bool startUpload( UploadWriter writeValues ) = 0;
+
+	// advance the running operation; call this often from the main loop.
+	// returns true once when it has finished
+	virtual bool poll() = 0;
+
+	// true while an operation is running
+	virtual bool busy() = 0;
+
+	// the result of the last upload: 0 if it succeeded, 1 if the module
+	// didn't answer (a reset may help), 2 if the network or the server failed
+	virtual int lastErrorCode() = 0;
+
+	// the HTTP status of the last response (-1 if none arrived)
+	virtual int lastStatusCode() = 0;
+
+	// the Retry-After header of the last response in seconds (0 if none)
+	virtual unsigned long lastRetryAfter() = 0;
+
+	// start resetting the module (e.g. a reboot); poll() returns true once it
+	// is done. returns false if an operation is running
+	virtual bool startReset() = 0;
+};
+
+
+#endif // _MANYLABS_DATA_TRANSPORT_H_
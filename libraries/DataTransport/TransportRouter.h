@@ -0,0 +1,185 @@
+// Manylabs DataTransport Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library picks the link (DataTransport) each upload goes over, from
+// the recent results of each link and what it costs to use.
+#ifndef _MANYLABS_TRANSPORT_ROUTER_H_
+#define _MANYLABS_TRANSPORT_ROUTER_H_
+#include "Arduino.h"
+#include "DataTransport.h"
+#include "RetryPolicy.h"
+
+
+// number of links the router can hold
+#define TRANSPORT_MAX_LINKS 2
+
+
+// returned instead of a link index when there is none
+#define TRANSPORT_NONE 255
+
+
+// an average upload time (ms) that doubles the cost of a link
+#define TRANSPORT_LATENCY_UNIT 10000
+
+
+// The TransportRouter class uploads each batch over one link and leaves the
+// others idle. choose() picks the link with the lowest expected cost per
+// delivered upload: its cost weight, raised by its average upload time and
+// divided by its recent success rate. Links that are busy (e.g. a module
+// rebooting) or waiting to retry after a failure (see RetryPolicy) are
+// skipped, so the queued data goes over the links that work.
+//
+// A link that is never chosen gets no new results, so each time it is passed
+// over, its success rate moves back towards 100% (by 1/16 of the gap); a link
+// that recovers is tried again after a while.
+class TransportRouter {
+public:
+
+	// create a new TransportRouter object with no links
+	TransportRouter() {
+		_count = 0;
+		_uploading = TRANSPORT_NONE;
+		_startTime = 0;
+	}
+
+	// add a link: its transport, the function that adds the values of an
+	// upload to it, its retry policy and its cost weight (e.g. 1 for WiFi and
+	// 4 for GSM); returns the link index or TRANSPORT_NONE if full
+	byte add( DataTransport &transport, UploadWriter writeValues, RetryPolicy &retry, byte cost ) {
+		if (_count == TRANSPORT_MAX_LINKS)
+			return TRANSPORT_NONE;
+		Link &link = _links[ _count ];
+		link.transport = &transport;
+		link.writeValues = writeValues;
+		link.retry = &retry;
+		link.cost = cost;
+		link.rate = 256;
+		link.time8 = 0;
+		return _count++;
+	}
+
+	// the link for the next upload, or TRANSPORT_NONE if none may upload now
+	byte choose() {
+		byte best = TRANSPORT_NONE;
+		unsigned long bestScore = 0;
+		for (byte i = 0; i < _count; i++) {
+			Link &link = _links[ i ];
+			if (link.transport->busy() || link.retry->wait())
+				continue;
+			unsigned long score = ((unsigned long) link.cost * ((TRANSPORT_LATENCY_UNIT + (link.time8 >> 3)) >> 4) << 8) / (link.rate + 1);
+			if (best == TRANSPORT_NONE || score < bestScore) {
+				best = i;
+				bestScore = score;
+			}
+		}
+		if (best != TRANSPORT_NONE) {
+			for (byte i = 0; i < _count; i++) {
+				if (i != best)
+					_links[ i ].rate += (256 - _links[ i ].rate) >> 4;
+			}
+		}
+		return best;
+	}
+
+	// start an upload over a link; returns false if it couldn't start
+	bool startUpload( byte link ) {
+		Link &l = _links[ link ];
+		if (!l.retry->ready() || !l.transport->startUpload( l.writeValues ))
+			return false;
+		_uploading = link;
+		_startTime = millis();
+		return true;
+	}
+
+	// the link with an upload running (TRANSPORT_NONE if none)
+	inline byte uploading() const { return _uploading; }
+
+	// call when the link's transport has finished the upload; records the
+	// result and returns true if the values were delivered. an upload with no
+	// status (e.g. a GSM upload that timed out after SEND OK) may not have
+	// reached the server, and a 408, 429 or 5xx status means the server can't
+	// take the values now; these are retried. any other status, including
+	// the other 4xx ones, is the server's answer to the values themselves:
+	// sending them again would get the same answer and hold up the queue for
+	// good, so they count as delivered
+	bool finished( byte link ) {
+		Link &l = _links[ link ];
+		_uploading = TRANSPORT_NONE;
+		int errorCode = l.transport->lastErrorCode();
+		int statusCode = l.transport->lastStatusCode();
+		bool delivered = false;
+		if (errorCode || statusCode < 0) {
+			l.retry->failed( errorCode == 1 ? RETRY_MODULE : RETRY_TRANSIENT );
+		} else if (statusCode == 408 || statusCode == 429 || statusCode >= 500) {
+			l.retry->failed( RETRY_TRANSIENT, l.transport->lastRetryAfter() );
+		} else {
+			l.retry->succeeded();
+			delivered = true;
+		}
+
+		// each upload weighs 1/8 in the success rate and the average time
+		l.rate = l.rate - (l.rate >> 3) + (delivered ? 32 : 0);
+		if (delivered) {
+			unsigned long ms = millis() - _startTime;
+			l.time8 = l.time8 ? l.time8 - (l.time8 >> 3) + ms : ms << 3;
+		}
+		return delivered;
+	}
+
+	// returns true if the link's module should be reset (see
+	// RetryPolicy::resetDue())
+	inline bool resetDue( byte link ) const { return _links[ link ].retry->resetDue(); }
+
+	// start resetting the link's module; returns false if it is busy
+	bool startReset( byte link ) {
+		Link &l = _links[ link ];
+		if (!l.transport->startReset())
+			return false;
+		l.retry->resetStarted();
+		return true;
+	}
+
+	// ms until the first link that is waiting to retry may upload (0 if none
+	// is waiting)
+	unsigned long wait() const {
+		unsigned long wait = 0;
+		for (byte i = 0; i < _count; i++) {
+			unsigned long linkWait = _links[ i ].retry->wait();
+			if (linkWait && (wait == 0 || linkWait < wait))
+				wait = linkWait;
+		}
+		return wait;
+	}
+
+	// the recent success rate of a link (256 = all uploads delivered)
+	inline unsigned int successRate( byte link ) const { return _links[ link ].rate; }
+
+	// the average time of a link's delivered uploads in ms (0 before the first)
+	inline unsigned long averageTime( byte link ) const { return _links[ link ].time8 >> 3; }
+
+	// the transport of a link, for its last result
+	inline DataTransport &transport( byte link ) { return *_links[ link ].transport; }
+
+	// the number of links added
+	inline byte count() const { return _count; }
+
+private:
+
+	// a link
+	struct Link {
+		DataTransport *transport;
+		UploadWriter writeValues;
+		RetryPolicy *retry;
+		byte cost;
+		unsigned int rate; // the success rate times 256
+		unsigned long time8; // the average upload time times 8
+	};
+
+	Link _links[ TRANSPORT_MAX_LINKS ];
+	byte _count;
+	byte _uploading;
+	unsigned long _startTime; // millis() at the start of the running upload
+};
+
+
+#endif // _MANYLABS_TRANSPORT_ROUTER_H_
@@ -0,0 +1,147 @@
+// Manylabs TransportRouter example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example routes uploads over two fake links and checks that they go
+// over the cheaper one, over the other one while it fails, and back again
+// once it recovers.
+
+#include "RetryPolicy.h"
+#include "DataTransport.h"
+#include "TransportRouter.h"
+#include "TestReport.h"
+
+// a link whose uploads finish at once with a given result
+class FakeTransport : public DataTransport {
+public:
+    FakeTransport() { errorCode = 0; statusCode = 201; uploads = 0; resets = 0; }
+    bool startUpload( UploadWriter writeValues ) { writeValues(); uploads++; return true; }
+    bool poll() { return true; }
+    bool busy() { return false; }
+    int lastErrorCode() { return errorCode; }
+    int lastStatusCode() { return errorCode ? -1 : statusCode; }
+    unsigned long lastRetryAfter() { return 0; }
+    bool startReset() { resets++; return true; }
+    int errorCode;
+    int statusCode;
+    int uploads;
+    int resets;
+};
+
+FakeTransport wifi;
+FakeTransport gsm;
+
+// retry after 100 ms doubling up to 400 ms; open for 1 s after 4 failures;
+// reset after 2 module failures
+RetryPolicy wifiRetry( 100, 400, 4, 1000, 2 );
+RetryPolicy gsmRetry( 100, 400, 4, 1000, 2 );
+TransportRouter router;
+byte wifiLink;
+byte gsmLink;
+int written = 0;
+TestReport report;
+
+// the values of an upload (none here)
+void writeValues() {
+    written++;
+}
+
+// upload over the chosen link and return the link (TRANSPORT_NONE if none
+// may upload now)
+byte upload() {
+    byte link = router.choose();
+    if (link != TRANSPORT_NONE) {
+        router.startUpload( link );
+        router.finished( link );
+    }
+    return link;
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+    randomSeed(1);
+
+    wifiLink = router.add( wifi, writeValues, wifiRetry, 1 );
+    gsmLink = router.add( gsm, writeValues, gsmRetry, 4 );
+    report.check("links", router.count(), 2);
+
+    // uploads go over the cheaper link while it works
+    report.check("cheap link", upload(), wifiLink);
+    report.check("cheap again", upload(), wifiLink);
+    report.check("values written", written, 2);
+
+    // a failed link waits to retry, so the next upload goes over the other
+    wifi.errorCode = 2;
+    report.check("failing link", upload(), wifiLink);
+    report.check("failover", upload(), gsmLink);
+    report.check("gsm uploads", gsm.uploads, 1);
+
+    // a 5xx status fails too
+    wifi.errorCode = 0;
+    wifi.statusCode = 503;
+    delay(router.wait());
+    report.check("retry wifi", upload(), wifiLink);
+    report.check("server busy", router.transport( wifiLink ).lastStatusCode(), 503);
+    report.check("failover again", upload(), gsmLink);
+
+    // once both wait, nothing may upload until the first wait is up
+    gsm.errorCode = 2;
+    report.check("gsm fails", upload(), gsmLink);
+    report.check("none ready", upload(), TRANSPORT_NONE);
+    report.check("wait", router.wait() > 0, 1);
+
+    // after failing often, the cheap link costs more than the other one (its
+    // waits are skipped here) until it has been passed over a few times
+    gsm.errorCode = 0;
+    wifi.statusCode = 503;
+    gsmRetry.succeeded();
+    byte link = wifiLink;
+    for (int i = 0; i < 20 && link == wifiLink; i++) {
+        wifiRetry.succeeded();
+        link = upload();
+    }
+    report.check("costly link", link, gsmLink);
+    report.check("low rate", router.successRate( wifiLink ) < 128, 1);
+    wifi.statusCode = 201;
+    wifiRetry.succeeded();
+    for (int i = 0; i < 20 && link == gsmLink; i++) {
+        link = upload();
+    }
+    report.check("recovered", link, wifiLink);
+    report.check("stays", upload(), wifiLink);
+
+    // module failures in a row call for a reset of that link only
+    wifi.errorCode = 1;
+    upload();
+    delay(router.wait());
+    upload();
+    report.check("reset due", router.resetDue( wifiLink ), 1);
+    report.check("gsm reset due", router.resetDue( gsmLink ), 0);
+    router.startReset( wifiLink );
+    report.check("resets", wifi.resets, 1);
+    report.check("reset started", router.resetDue( wifiLink ), 0);
+
+    // an upload that ends without a status may not have arrived, so it is
+    // retried, like a 408; other 4xx statuses reject the values themselves,
+    // so sending them again wouldn't help
+    wifi.errorCode = 0;
+    wifi.statusCode = -1;
+    wifiRetry.succeeded();
+    report.check("no status started", router.startUpload( wifiLink ), 1);
+    report.check("no status", router.finished( wifiLink ), 0);
+    report.check("no status waits", wifiRetry.wait() > 0, 1);
+    wifi.statusCode = 408;
+    wifiRetry.succeeded();
+    router.startUpload( wifiLink );
+    report.check("request timeout", router.finished( wifiLink ), 0);
+    wifi.statusCode = 400;
+    wifiRetry.succeeded();
+    router.startUpload( wifiLink );
+    report.check("bad request", router.finished( wifiLink ), 1);
+
+    report.end();
+}
+
+void loop() {
+}
@@ -0,0 +1,83 @@
+// Manylabs DustSensor Library - concentration conversion
+// copyright Manylabs 2015; MIT license
+// --------
+// This file converts low pulse occupancy ratios into particle concentrations
+// using integer arithmetic only. Each sensor model has a piecewise-linear
+// curve stored in flash.
+#ifndef _MANYLABS_DUST_CONCENTRATION_H_
+#define _MANYLABS_DUST_CONCENTRATION_H_
+#include "Arduino.h"
+#include <avr/pgmspace.h>
+#include "DustSensor.h"
+
+
+// sensor models with a conversion curve
+#define DUST_MODEL_NONE 0
+#define DUST_MODEL_PPD42 1 // result in particles per 0.01 cubic foot
+#define DUST_MODEL_PPD60 2 // result in micrograms per cubic meter
+
+
+// one point of a conversion curve: a ratio (65535 = always low) and the
+// concentration at that ratio
+struct DustCurvePoint {
+	unsigned int ratio;
+	unsigned long concentration;
+};
+
+
+// PPD42: samples of the commonly used fit to the Shinyei datasheet curve,
+// c = 1.1 r^3 - 3.8 r^2 + 520 r + 0.62 with r in percent, spaced so linear
+// interpolation stays within 1% of the fit above r = 0.5%.
+const DustCurvePoint dustCurvePpd42[] PROGMEM = {
+	{ 0, 1 }, { 2294, 1821 }, { 3932, 3221 }, { 5243, 4481 }, { 6881, 6315 },
+	{ 8520, 8535 }, { 10158, 11244 }, { 11796, 14545 }, { 13435, 18540 },
+	{ 15401, 24398 }, { 17367, 31583 }, { 19660, 41881 }, { 21954, 54511 },
+	{ 24576, 72165 }, { 27525, 96634 }, { 30474, 126563 }, { 33751, 166952 },
+	{ 37355, 221007 }, { 41287, 292730 }, { 45874, 395081 }, { 50790, 529510 },
+	{ 56360, 716277 }, { 62258, 958218 }, { 65535, 1114001 }
+};
+
+// PPD60: linear placeholder of 10 ug/m3 per percent of low pulse occupancy.
+// The datasheet gives no closed-form curve, so calibrate against a reference
+// instrument and replace these points before relying on the values; until
+// then, use DUST_MODEL_NONE for PPD60 sensors rather than publish these.
+const DustCurvePoint dustCurvePpd60[] PROGMEM = {
+	{ 0, 0 }, { 65535, 1000 }
+};
+
+
+// interpolate a concentration from a curve stored in flash; ratios above the
+// last point are clamped to it
+inline unsigned long dustCurveLookup( const DustCurvePoint *curve, byte count, unsigned int ratio ) {
+	DustCurvePoint p0, p1;
+	memcpy_P( &p0, curve, sizeof( DustCurvePoint ) );
+	for (byte i = 1; i < count; i++) {
+		memcpy_P( &p1, curve + i, sizeof( DustCurvePoint ) );
+		if (ratio <= p1.ratio) {
+
+			// v0 + dv * dx / w, split so no intermediate exceeds 32 bits
+			unsigned long dv = p1.concentration - p0.concentration;
+			unsigned int w = p1.ratio - p0.ratio;
+			unsigned int dx = ratio - p0.ratio;
+			return p0.concentration + (dv / w) * dx + (dv % w) * dx / w;
+		}
+		p0 = p1;
+	}
+	return p0.concentration;
+}
+
+
+// convert a 16-bit fixed-point ratio into a concentration for the given model
+// (DUST_MODEL_...); returns 0 for DUST_MODEL_NONE
+inline unsigned long dustConcentration( byte model, unsigned int ratio ) {
+	switch (model) {
+	case DUST_MODEL_PPD42:
+		return dustCurveLookup( dustCurvePpd42, sizeof( dustCurvePpd42 ) / sizeof( DustCurvePoint ), ratio );
+	case DUST_MODEL_PPD60:
+		return dustCurveLookup( dustCurvePpd60, sizeof( dustCurvePpd60 ) / sizeof( DustCurvePoint ), ratio );
+	}
+	return 0;
+}
+
+
+#endif // _MANYLABS_DUST_CONCENTRATION_H_
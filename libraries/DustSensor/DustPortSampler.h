@@ -0,0 +1,222 @@
+// Manylabs DustSensor Library - polled port sampler
+// copyright Manylabs 2015; MIT license
+// --------
+// This file provides a timer-driven sampler for dust sensors on pins without
+// hardware interrupts. Including it claims the Timer2 compare interrupt (this
+// disables tone() and PWM on the Timer2 pins), so only include it if you use it.
+#ifndef _MANYLABS_DUST_PORT_SAMPLER_H_
+#define _MANYLABS_DUST_PORT_SAMPLER_H_
+#include "Arduino.h"
+
+
+// number of GPIO ports that can be sampled; each port holds up to 8 sensors
+#ifndef DUST_SAMPLER_MAX_PORTS
+#define DUST_SAMPLER_MAX_PORTS 2
+#endif
+
+// number of channels (sensors) the sampler can hold
+#define DUST_SAMPLER_MAX_CHANNELS (DUST_SAMPLER_MAX_PORTS * 8)
+
+// returned by addChannel() when a pin cannot be added
+#define DUST_SAMPLER_NO_CHANNEL 255
+
+// samples per second; Timer2 runs at F_CPU / 8 in CTC mode
+#define DUST_SAMPLER_RATE_HZ 10000
+
+
+// The DustPortSampler class reads whole input port bytes at a fixed rate and
+// counts, for every sensor pin on the port at once, how many samples were low.
+//
+// Counting uses vertical (bit-sliced) counters: plane i holds bit i of the
+// count for all 8 pins of a port, so one sample is added to every pin with a
+// ripple-carry over the planes using only byte-wide bitwise operations. The
+// 8 planes count up to 255 samples. Full blocks are retired to a second bank
+// and flushed into 32-bit per-channel totals one channel per tick, so the cost
+// of every tick is bounded: one port read and carry chain per port plus at
+// most one channel flush.
+class DustPortSampler {
+public:
+
+	// create a new DustPortSampler object
+	DustPortSampler() {
+		memset( this, 0, sizeof( DustPortSampler ) );
+	}
+
+	// add a sensor pin (pulled up); returns its channel number, or
+	// DUST_SAMPLER_NO_CHANNEL if its port cannot be added; call before begin()
+	byte addChannel( byte pin ) {
+		volatile uint8_t *input = portInputRegister( digitalPinToPort( pin ) );
+		byte bit = digitalPinToBitMask( pin );
+		byte port = 0;
+		while (port < _portCount && _input[ port ] != input)
+			port++;
+		if (port == DUST_SAMPLER_MAX_PORTS)
+			return DUST_SAMPLER_NO_CHANNEL;
+		if (port == _portCount) {
+			_input[ port ] = input;
+			_portCount++;
+		}
+		pinMode( pin, INPUT_PULLUP );
+		_mask[ port ] |= bit;
+		byte channel = port * 8;
+		while (bit >>= 1)
+			channel++;
+		return channel;
+	}
+
+	// start sampling
+	void begin() {
+		s_instance = this;
+		_running = true;
+		byte sreg = SREG;
+		cli();
+		TCCR2A = _BV( WGM21 ); // CTC mode
+		TCCR2B = _BV( CS21 ); // F_CPU / 8
+		OCR2A = F_CPU / 8 / DUST_SAMPLER_RATE_HZ - 1;
+		TCNT2 = 0;
+		TIFR2 = _BV( OCF2A );
+		TIMSK2 = _BV( OCIE2A );
+		SREG = sreg;
+	}
+
+	// close the current window; waits (at most a few milliseconds) until the
+	// sampler has flushed all counts of the window, then the results are
+	// available from lowSamples(), samples() and ratio()
+	void snapshot() {
+		if (!_running)
+			return;
+		_windowReady = false;
+		_closeRequested = true;
+		while (!_windowReady) {
+		}
+		asm volatile( "" ::: "memory" ); // read the results only after the handshake
+	}
+
+	// number of low samples of a channel in the last closed window
+	inline unsigned long lowSamples( byte channel ) const { return _windowLow[ channel ]; }
+
+	// number of samples in the last closed window
+	inline unsigned long samples() const { return _windowSamples; }
+
+	// fraction of the last closed window that a channel spent low
+	float ratio( byte channel ) const {
+		if (_windowSamples == 0)
+			return 0;
+		return _windowLow[ channel ] / (float) _windowSamples;
+	}
+
+	// timer interrupt handler
+	static inline void tick() {
+		s_instance->sample();
+	}
+
+private:
+
+	// take one sample of every port and do one step of flushing
+	inline void sample() {
+
+		// add the low pins of each port to the active bank's vertical counters
+		for (byte port = 0; port < _portCount; port++) {
+			byte carry = ~*_input[ port ] & _mask[ port ];
+			byte *plane = _planes[ _bank ][ port ];
+			while (carry) {
+				byte next = *plane & carry;
+				*plane++ ^= carry;
+				carry = next;
+			}
+		}
+		_bankSamples++;
+
+		// flush one channel of the retired bank into the totals
+		if (_flushing) {
+			flushStep();
+		}
+
+		// retire the active bank before its counters can overflow, or
+		// immediately if the window should close
+		if (!_flushing && (_bankSamples == 255 || _closeRequested)) {
+			_flushBank = _bank;
+			_flushSamples = _bankSamples;
+			_flushChannel = 0;
+			_flushing = true;
+			_bank ^= 1;
+			_bankSamples = 0;
+			if (_closeRequested) {
+				_closeRequested = false;
+				_closeAfterFlush = true;
+			}
+		}
+	}
+
+	// flush the next channel of the retired bank; when the last one is done,
+	// clear the bank and publish the window if one was requested
+	inline void flushStep() {
+		byte port = _flushChannel >> 3;
+		byte bit = 1 << (_flushChannel & 7);
+		byte *plane = _planes[ _flushBank ][ port ];
+		if (_mask[ port ] & bit) {
+			byte count = 0;
+			for (byte i = 0, value = 1; i < 8; i++, value <<= 1) {
+				if (plane[ i ] & bit)
+					count |= value;
+			}
+			_lowTotal[ _flushChannel ] += count;
+		}
+		_flushChannel++;
+		if ((_flushChannel & 7) == 0) {
+			memset( plane, 0, 8 );
+			if ((_flushChannel >> 3) == _portCount) {
+				_flushing = false;
+				_totalSamples += _flushSamples;
+				if (_closeAfterFlush) {
+					_closeAfterFlush = false;
+					memcpy( _windowLow, _lowTotal, sizeof( _lowTotal ) );
+					memset( _lowTotal, 0, sizeof( _lowTotal ) );
+					_windowSamples = _totalSamples;
+					_totalSamples = 0;
+					_windowReady = true;
+				}
+			}
+		}
+	}
+
+	// sampled ports
+	volatile uint8_t *_input[ DUST_SAMPLER_MAX_PORTS ];
+	byte _mask[ DUST_SAMPLER_MAX_PORTS ];
+	byte _portCount;
+	bool _running;
+
+	// two banks of vertical counters: [ bank ][ port ][ plane ]
+	byte _planes[ 2 ][ DUST_SAMPLER_MAX_PORTS ][ 8 ];
+	byte _bank;
+	byte _bankSamples;
+
+	// flushing of the retired bank
+	bool _flushing;
+	byte _flushBank;
+	byte _flushSamples;
+	byte _flushChannel;
+
+	// totals of the current window (written by the interrupt handler only)
+	unsigned long _lowTotal[ DUST_SAMPLER_MAX_CHANNELS ];
+	unsigned long _totalSamples;
+
+	// window handshake between the main loop and the interrupt handler
+	volatile bool _closeRequested;
+	bool _closeAfterFlush;
+	volatile bool _windowReady;
+
+	// results of the last closed window
+	unsigned long _windowLow[ DUST_SAMPLER_MAX_CHANNELS ];
+	unsigned long _windowSamples;
+
+	static DustPortSampler *s_instance;
+};
+
+DustPortSampler *DustPortSampler::s_instance = NULL;
+
+
+ISR( TIMER2_COMPA_vect ) { DustPortSampler::tick(); }
+
+
+#endif // _MANYLABS_DUST_PORT_SAMPLER_H_
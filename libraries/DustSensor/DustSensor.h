@@ -7,44 +7,464 @@
 #include "Arduino.h"
 
 
+// Define DUST_SENSOR_PULSE_STATS before including this header to also collect
+// per-window pulse counts and pulse width distributions (see DustPulseStats).
+
+// number of edges buffered between the interrupt handler and pollEdges();
+// must be a power of two
+#ifndef DUST_EDGE_RING_SIZE
+#define DUST_EDGE_RING_SIZE 16
+#endif
+
+// number of log-scale pulse width buckets: bucket 0 holds pulses shorter than
+// 1024 microseconds, each following bucket doubles the width, and the last
+// bucket holds everything longer
+#define DUST_HISTOGRAM_BUCKETS 8
+
+// Pulse statistics for one window. A pulse is counted in the window in which
+// it ends, with its full width.
+struct DustPulseStats {
+	unsigned int count; // number of complete low pulses
+	unsigned long minWidth; // shortest pulse in microseconds (0 if none)
+	unsigned long maxWidth; // longest pulse in microseconds
+	unsigned int histogram[ DUST_HISTOGRAM_BUCKETS ];
+	unsigned int dropped; // edges lost because the ring was full
+
+	void clear() {
+		memset( this, 0, sizeof( DustPulseStats ) );
+	}
+};
+
+
+// low time as a fraction of the window length in 16-bit fixed point
+// (65535 = always low), computed with integer arithmetic only
+inline unsigned int dustRatioQ16( unsigned long lowTime, unsigned long windowLength ) {
+	if (lowTime >= windowLength)
+		return windowLength ? 65535 : 0;
+
+	// scale both down until (lowTime << 16) fits in 32 bits
+	while (windowLength > 0xFFFF) {
+		windowLength >>= 1;
+		lowTime >>= 1;
+	}
+	return ((lowTime << 16) - lowTime) / windowLength;
+}
+
+
 // The DustSensor class provides a simple interface pulse-based dust sensors.
+//
+// The interrupt handler accumulates low-pulse time into one of two buffers.
+// Closing a window flips the buffers in a few instructions with interrupts
+// disabled; a pulse in progress at that moment is split at the close
+// timestamp so each window only counts the low time that fell inside it.
 class DustSensor {
 public:
 
 	// create a new DustSensor object
 	DustSensor() {
 		_pin = 0;
-		_dustPulseDuration = 0;
+		_lowTime[ 0 ] = 0;
+		_lowTime[ 1 ] = 0;
+		_active = 0;
+		_low = false;
 		_dustPulseStart = 0;
+		_windowStart = 0;
+		_windowLength = 0;
+		_lastLowTime = 0;
+#ifdef DUST_SENSOR_PULSE_STATS
+		_edgeHead = 0;
+		_edgeTail = 0;
+		_edgeOverruns = 0;
+		_microShift = 0;
+		_statsLow = false;
+		_statsPulseStart = 0;
+		_stats.clear();
+		_lastStats.clear();
+#endif
 	}
 
 	// initialize the given pin (assumed to be a hardware interrupt pin)
 	void init( byte pin ) {
 		pinMode( pin, INPUT_PULLUP );
 		_pin = pin;
+		byte sreg = SREG;
+		cli();
+		restart( micros(), digitalRead( pin ) == LOW );
+		SREG = sreg;
+	}
+
+	// discard all timing and start a new window at the given timestamp with the
+	// given pin state; must be called with interrupts disabled
+	void restart( unsigned long now, bool low ) {
+		_lowTime[ 0 ] = 0;
+		_lowTime[ 1 ] = 0;
+		_windowStart = now;
+		_dustPulseStart = now;
+		_low = low;
+#ifdef DUST_SENSOR_PULSE_STATS
+		_edgeTail = _edgeHead;
+		_statsLow = low;
+		_statsPulseStart = now;
+		_stats.clear();
+#endif
 	}
 
 	inline byte pin() const { return _pin; }
 
+	// interrupt handler: call on every change of the sensor pin
 	void change() {
-		if (digitalRead( _pin ) == HIGH) {
-			_dustPulseDuration += micros() - _dustPulseStart; // compute duration
+		edge( digitalRead( _pin ) == HIGH, micros() );
+	}
+
+	// record an edge; high is the new pin state and now is the edge timestamp
+	inline void edge( bool high, unsigned long now ) {
+		if (high) {
+			if (_low) {
+				// a hardware timestamp can precede a window boundary that was set
+				// while its interrupt was pending; that part was already counted
+				if ((long) (now - _dustPulseStart) > 0)
+					_lowTime[ _active ] += now - _dustPulseStart; // compute duration
+				_low = false;
+			}
 		} else {
-			_dustPulseStart = micros(); // start timing when pin is low
+			_dustPulseStart = now; // start timing when pin is low
+			_low = true;
+		}
+#ifdef DUST_SENSOR_PULSE_STATS
+		byte next = (_edgeHead + 1) & (DUST_EDGE_RING_SIZE - 1);
+		if (next == _edgeTail) {
+			_edgeOverruns++;
+		} else {
+			_edgeStamp[ _edgeHead ] = now;
+			_edgeHigh[ _edgeHead ] = high;
+			_edgeHead = next;
+		}
+#endif
+	}
+
+	// close the current window at the given timestamp and start a new one;
+	// must be called with interrupts disabled; follow with collectWindow()
+	inline void closeWindow( unsigned long now ) {
+		byte closed = _active;
+		if (_low) { // split a pulse in progress at the window boundary
+			_lowTime[ closed ] += now - _dustPulseStart;
+			_dustPulseStart = now;
 		}
+		_active = closed ^ 1;
+		_windowLength = now - _windowStart;
+		_windowStart = now;
+	}
+
+	// take the low time from the window closed by closeWindow(); the interrupt
+	// handler no longer writes to that buffer, so interrupts can be enabled
+	void collectWindow() {
+		byte closed = _active ^ 1;
+		_lastLowTime = _lowTime[ closed ];
+		_lowTime[ closed ] = 0;
+#ifdef DUST_SENSOR_PULSE_STATS
+		reduceEdges( true );
+		byte sreg = SREG;
+		cli();
+		_stats.dropped = _edgeOverruns;
+		_edgeOverruns = 0;
+		SREG = sreg;
+		_lastStats = _stats;
+		_stats.clear();
+#endif
+	}
+
+	// close the current window now; the results are available from
+	// lowTime(), windowLength() and ratio()
+	void snapshot() {
+		byte sreg = SREG;
+		cli();
+		closeWindow( micros() );
+		SREG = sreg;
+		collectWindow();
 	}
 
+	// time the pin spent low during the last closed window, in the units of
+	// the edge timestamps (microseconds unless noted otherwise)
+	inline unsigned long lowTime() const { return _lastLowTime; }
+
+	// length of the last closed window, in the units of the edge timestamps
+	inline unsigned long windowLength() const { return _windowLength; }
+
+	// fraction of the last closed window that the pin spent low
+	float ratio() const {
+		if (_windowLength == 0)
+			return 0;
+		return _lastLowTime / (float) _windowLength;
+	}
+
+	// fraction of the last closed window that the pin spent low in 16-bit
+	// fixed point (65535 = always low)
+	inline unsigned int ratioQ16() const { return dustRatioQ16( _lastLowTime, _windowLength ); }
+
+	// close the current window and return the fraction of it spent low
+	float pulseRatio() {
+		snapshot();
+		return ratio();
+	}
+
+	// close the current window and return the low time as a fraction of the
+	// given window length
 	float pulseRatio( unsigned long elapsedMsecs ) {
-		float ratio = _dustPulseDuration / (float) (elapsedMsecs * 1000); // * 1000 to convert to microseconds
-		_dustPulseDuration = 0;
-		return ratio;
+		snapshot();
+		return _lastLowTime / (float) (elapsedMsecs * 1000); // * 1000 to convert to microseconds
+	}
+
+#ifdef DUST_SENSOR_PULSE_STATS
+	// move buffered edges into the current window's statistics; call this from
+	// the main loop often enough that the edge ring does not fill up
+	inline void pollEdges() {
+		reduceEdges( false );
 	}
 
+	// pulse statistics of the last closed window
+	inline const DustPulseStats &pulseStats() const { return _lastStats; }
+
+	// timestamps are in units of 2^shift microseconds (for hardware timers)
+	void setTimestampShift( byte shift ) { _microShift = shift; }
+#endif
+
 private:
 
 	byte _pin;
-	volatile unsigned long _dustPulseDuration;
+
+	// low time accumulators; the interrupt handler adds to _lowTime[ _active ]
+	volatile unsigned long _lowTime[ 2 ];
+	volatile byte _active;
+	volatile bool _low;
 	volatile unsigned long _dustPulseStart;
+
+	// window bookkeeping (only touched by the main loop)
+	unsigned long _windowStart;
+	unsigned long _windowLength;
+	unsigned long _lastLowTime;
+
+#ifdef DUST_SENSOR_PULSE_STATS
+	// reduce buffered edges into _stats; if windowOnly is true, stop at the
+	// first edge after the start of the current window
+	void reduceEdges( bool windowOnly ) {
+		while (_edgeTail != _edgeHead) {
+			byte tail = _edgeTail;
+			unsigned long stamp = _edgeStamp[ tail ];
+			if (windowOnly && (long) (stamp - _windowStart) > 0)
+				break;
+			if (_edgeHigh[ tail ]) {
+				if (_statsLow)
+					addPulse( (stamp - _statsPulseStart) >> _microShift );
+				_statsLow = false;
+			} else {
+				_statsPulseStart = stamp;
+				_statsLow = true;
+			}
+			_edgeTail = (tail + 1) & (DUST_EDGE_RING_SIZE - 1); // frees the slot for the interrupt handler
+		}
+	}
+
+	// add a complete pulse of the given width (in microseconds) to _stats
+	void addPulse( unsigned long width ) {
+		if (_stats.count == 0 || width < _stats.minWidth)
+			_stats.minWidth = width;
+		if (width > _stats.maxWidth)
+			_stats.maxWidth = width;
+		_stats.count++;
+		byte bucket = 0;
+		for (unsigned long w = width >> 10; w && bucket < DUST_HISTOGRAM_BUCKETS - 1; w >>= 1)
+			bucket++;
+		_stats.histogram[ bucket ]++;
+	}
+
+	// single-producer (interrupt handler) / single-consumer (main loop) ring of
+	// edge timestamps; the producer only writes _edgeHead, the consumer only
+	// writes _edgeTail
+	volatile unsigned long _edgeStamp[ DUST_EDGE_RING_SIZE ];
+	volatile bool _edgeHigh[ DUST_EDGE_RING_SIZE ];
+	volatile byte _edgeHead;
+	volatile byte _edgeTail;
+	volatile unsigned int _edgeOverruns;
+
+	// edge state as seen by the main loop
+	byte _microShift;
+	bool _statsLow;
+	unsigned long _statsPulseStart;
+	DustPulseStats _stats;
+	DustPulseStats _lastStats;
+#endif
+};
+
+
+// Compile-time description of the external interrupt pins: the input register,
+// the bit mask within it and the attachInterrupt() number. Only pins with a
+// hardware interrupt are defined, so using any other pin fails to compile.
+template <byte PIN> struct DustPin;
+
+// marks an unused slot in a DustSensorArray
+#define DUST_NO_PIN 255
+
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+template <> struct DustPin<2> { static inline volatile uint8_t &input() { return PINE; } enum { mask = _BV( 4 ), interrupt = 0 }; };
+template <> struct DustPin<3> { static inline volatile uint8_t &input() { return PINE; } enum { mask = _BV( 5 ), interrupt = 1 }; };
+template <> struct DustPin<21> { static inline volatile uint8_t &input() { return PIND; } enum { mask = _BV( 0 ), interrupt = 2 }; };
+template <> struct DustPin<20> { static inline volatile uint8_t &input() { return PIND; } enum { mask = _BV( 1 ), interrupt = 3 }; };
+template <> struct DustPin<19> { static inline volatile uint8_t &input() { return PIND; } enum { mask = _BV( 2 ), interrupt = 4 }; };
+template <> struct DustPin<18> { static inline volatile uint8_t &input() { return PIND; } enum { mask = _BV( 3 ), interrupt = 5 }; };
+#else // uno and other ATmega328 boards
+template <> struct DustPin<2> { static inline volatile uint8_t &input() { return PIND; } enum { mask = _BV( 2 ), interrupt = 0 }; };
+template <> struct DustPin<3> { static inline volatile uint8_t &input() { return PIND; } enum { mask = _BV( 3 ), interrupt = 1 }; };
+#endif
+
+// the bit for a pin's interrupt number in a mask of used interrupts
+template <byte PIN> struct DustInterruptBit { enum { value = 1 << DustPin<PIN>::interrupt }; };
+template <> struct DustInterruptBit<DUST_NO_PIN> { enum { value = 0 }; };
+
+
+// A DustSensor bound to a pin at compile time. The interrupt handler reads the
+// input register directly instead of going through digitalRead() and takes a
+// single timestamp per edge.
+template <byte PIN>
+class DustSensorPin : public DustSensor {
+public:
+
+	// initialize the pin
+	void init() {
+		DustSensor::init( PIN );
+	}
+
+	// initialize the pin and attach the interrupt handler for it
+	void attach() {
+		init();
+		s_instance = this;
+		attachInterrupt( DustPin<PIN>::interrupt, isr, CHANGE );
+	}
+
+	// interrupt handler: call on every change of the sensor pin
+	inline void change() {
+		bool high = (DustPin<PIN>::input() & DustPin<PIN>::mask) != 0;
+		edge( high, micros() );
+	}
+
+	// the number to pass to attachInterrupt() for this pin
+	static inline byte interrupt() { return DustPin<PIN>::interrupt; }
+
+private:
+
+	// interrupt trampoline generated for this pin; see attach()
+	static void isr() { s_instance->change(); }
+
+	static DustSensorPin<PIN> *s_instance;
+};
+
+template <byte PIN> DustSensorPin<PIN> *DustSensorPin<PIN>::s_instance = NULL;
+
+
+// placeholder for an unused slot in a DustSensorArray
+template <> class DustSensorPin<DUST_NO_PIN> {
+public:
+	void attach() {}
+};
+
+
+// fails to compile (negative array size) if cond is false
+#define DUST_STATIC_ASSERT( cond, name ) typedef char name[ (cond) ? 1 : -1 ]
+
+
+// A fixed set of dust sensors on external interrupt pins, e.g.
+// DustSensorArray< 2, 3, 18, 19, 20, 21 >. One interrupt handler is generated
+// per pin at compile time; the pins must have hardware interrupts, be distinct
+// and fill the slots from the first one on.
+template <byte P0, byte P1 = DUST_NO_PIN, byte P2 = DUST_NO_PIN,
+	byte P3 = DUST_NO_PIN, byte P4 = DUST_NO_PIN, byte P5 = DUST_NO_PIN>
+class DustSensorArray {
+public:
+
+	enum {
+		count = (P0 != DUST_NO_PIN) + (P1 != DUST_NO_PIN) + (P2 != DUST_NO_PIN)
+			+ (P3 != DUST_NO_PIN) + (P4 != DUST_NO_PIN) + (P5 != DUST_NO_PIN)
+	};
+
+	DustSensorArray() {
+		_channels[ 0 ] = channel( _s0 );
+		_channels[ 1 ] = channel( _s1 );
+		_channels[ 2 ] = channel( _s2 );
+		_channels[ 3 ] = channel( _s3 );
+		_channels[ 4 ] = channel( _s4 );
+		_channels[ 5 ] = channel( _s5 );
+	}
+
+	// initialize the pins and attach the interrupt handlers
+	void begin() {
+		_s0.attach();
+		_s1.attach();
+		_s2.attach();
+		_s3.attach();
+		_s4.attach();
+		_s5.attach();
+	}
+
+	// access a sensor by index (0 to count - 1)
+	inline DustSensor &operator[]( byte index ) { return *_channels[ index ]; }
+
+	// close the window of every sensor at the same timestamp; read the results
+	// with lowTime(), windowLength() and ratio() on each sensor
+	void snapshotAll() {
+		byte sreg = SREG;
+		cli();
+		closeAll( micros() );
+		SREG = sreg;
+		collectAll();
+	}
+
+	// the two halves of snapshotAll(), for closing other sensors' windows in
+	// the same critical section: closeAll() must be called with interrupts
+	// disabled, collectAll() after enabling them again
+	void closeAll( unsigned long now ) {
+		for (byte i = 0; i < count; i++) {
+			_channels[ i ]->closeWindow( now );
+		}
+	}
+
+	void collectAll() {
+		for (byte i = 0; i < count; i++) {
+			_channels[ i ]->collectWindow();
+		}
+	}
+
+#ifdef DUST_SENSOR_PULSE_STATS
+	// move buffered edges of every sensor into its pulse statistics
+	void pollEdges() {
+		for (byte i = 0; i < count; i++) {
+			_channels[ i ]->pollEdges();
+		}
+	}
+#endif
+
+private:
+
+	// compile-time checks: pins are contiguous and no interrupt is used twice
+	enum {
+		usedSlots = (P0 != DUST_NO_PIN) | (P1 != DUST_NO_PIN) << 1 | (P2 != DUST_NO_PIN) << 2
+			| (P3 != DUST_NO_PIN) << 3 | (P4 != DUST_NO_PIN) << 4 | (P5 != DUST_NO_PIN) << 5,
+		interruptBits = DustInterruptBit<P0>::value | DustInterruptBit<P1>::value | DustInterruptBit<P2>::value
+			| DustInterruptBit<P3>::value | DustInterruptBit<P4>::value | DustInterruptBit<P5>::value,
+		interruptSum = DustInterruptBit<P0>::value + DustInterruptBit<P1>::value + DustInterruptBit<P2>::value
+			+ DustInterruptBit<P3>::value + DustInterruptBit<P4>::value + DustInterruptBit<P5>::value
+	};
+	DUST_STATIC_ASSERT( count > 0 && usedSlots == (1 << count) - 1, dust_pins_must_fill_leading_slots );
+	DUST_STATIC_ASSERT( interruptBits == interruptSum, dust_pins_must_be_distinct );
+
+	static DustSensor *channel( DustSensor &sensor ) { return &sensor; }
+	static DustSensor *channel( DustSensorPin<DUST_NO_PIN> & ) { return NULL; }
+
+	DustSensorPin<P0> _s0;
+	DustSensorPin<P1> _s1;
+	DustSensorPin<P2> _s2;
+	DustSensorPin<P3> _s3;
+	DustSensorPin<P4> _s4;
+	DustSensorPin<P5> _s5;
+	DustSensor *_channels[ 6 ];
 };
 
 
@@ -0,0 +1,147 @@
+// Manylabs DustSensor Library - input capture backend
+// copyright Manylabs 2015; MIT license
+// --------
+// This file provides a DustSensor that timestamps edges with the input capture
+// unit of one of the Mega's 16-bit timers instead of micros(). Including it
+// claims the capture and overflow interrupts of Timer4 and Timer5, so only
+// include it if you use it.
+#ifndef _MANYLABS_DUST_SENSOR_CAPTURE_H_
+#define _MANYLABS_DUST_SENSOR_CAPTURE_H_
+#include "Arduino.h"
+#include "DustSensor.h"
+
+#if !defined(__AVR_ATmega1280__) && !defined(__AVR_ATmega2560__)
+#error "DustSensorCapture requires the input capture pins of an Arduino Mega"
+#endif
+
+
+// Registers of a timer with a usable input capture pin. Timer4 captures on
+// ICP4 (digital pin 49) and Timer5 on ICP5 (digital pin 48).
+template <byte TIMER> struct DustCaptureTimer;
+
+#define DUST_CAPTURE_TIMER( n, icpPin ) \
+template <> struct DustCaptureTimer<n> { \
+	static inline volatile uint8_t &controlA() { return TCCR##n##A; } \
+	static inline volatile uint8_t &controlB() { return TCCR##n##B; } \
+	static inline volatile uint8_t &interruptMask() { return TIMSK##n; } \
+	static inline volatile uint8_t &interruptFlags() { return TIFR##n; } \
+	static inline volatile uint16_t &counter() { return TCNT##n; } \
+	static inline volatile uint16_t &capture() { return ICR##n; } \
+	enum { pin = icpPin, edgeSelect = _BV( ICES##n ), noiseCanceler = _BV( ICNC##n ), \
+		prescale8 = _BV( CS##n##1 ), captureInterrupt = _BV( ICIE##n ), \
+		overflowInterrupt = _BV( TOIE##n ), captureFlag = _BV( ICF##n ), overflowFlag = _BV( TOV##n ) }; \
+};
+
+DUST_CAPTURE_TIMER( 4, 49 )
+DUST_CAPTURE_TIMER( 5, 48 )
+
+
+// The DustSensorCapture class measures low pulse occupancy using hardware
+// timestamps. The timer runs at F_CPU / 8 (0.5 microseconds per tick at
+// 16 MHz) and is extended to 32 bits by counting overflows, so timestamps
+// wrap after about 35 minutes. lowTime() and windowLength() are in timer
+// ticks; ratio() is unaffected by the unit.
+//
+// Use snapshot(), close() and pulseRatio() on this class (not through a
+// DustSensor reference) so windows are closed on the timer clock rather than
+// micros().
+template <byte TIMER>
+class DustSensorCapture : public DustSensor {
+public:
+
+	typedef DustCaptureTimer<TIMER> Timer;
+
+	// timer ticks per microsecond
+	enum { ticksPerMicro = F_CPU / 8000000L };
+
+	// configure the timer and capture pin and start timing
+	void init() {
+		DustSensor::init( Timer::pin );
+#ifdef DUST_SENSOR_PULSE_STATS
+		setTimestampShift( ticksPerMicro == 2 ? 1 : 0 );
+#endif
+		s_instance = this;
+		byte sreg = SREG;
+		cli();
+		Timer::controlA() = 0; // normal mode
+		Timer::controlB() = Timer::noiseCanceler | Timer::prescale8;
+		Timer::counter() = 0;
+		s_overflows = 0;
+
+		// capture the next falling edge if the pin is high, otherwise the next
+		// rising edge
+		bool low = digitalRead( Timer::pin ) == LOW;
+		if (low)
+			Timer::controlB() |= Timer::edgeSelect;
+		Timer::interruptFlags() = Timer::captureFlag | Timer::overflowFlag;
+		Timer::interruptMask() = Timer::captureInterrupt | Timer::overflowInterrupt;
+		restart( now(), low );
+		SREG = sreg;
+	}
+
+	// the current timestamp in timer ticks; call with interrupts disabled
+	static inline unsigned long now() {
+		return extend( s_overflows, Timer::counter(), Timer::interruptFlags() & Timer::overflowFlag );
+	}
+
+	// combine a 16-bit timer value with the overflow count; overflowPending is
+	// true if the timer overflowed but the overflow interrupt has not run yet
+	static inline unsigned long extend( unsigned int overflows, unsigned int count, bool overflowPending ) {
+		if (overflowPending && count < 0x8000) // count was taken after the overflow
+			overflows++;
+		return ((unsigned long) overflows << 16) | count;
+	}
+
+	// close the current window now; the results are available from
+	// lowTime(), windowLength() and ratio()
+	void snapshot() {
+		byte sreg = SREG;
+		cli();
+		close();
+		SREG = sreg;
+		collectWindow();
+	}
+
+	// close the current window on the timer clock; call with interrupts
+	// disabled (e.g. next to DustSensorArray::closeAll()), then collectWindow()
+	inline void close() {
+		closeWindow( now() );
+	}
+
+	// close the current window and return the fraction of it spent low
+	float pulseRatio() {
+		snapshot();
+		return ratio();
+	}
+
+	// capture interrupt handler
+	static inline void captured() {
+		unsigned long stamp = extend( s_overflows, Timer::capture(), Timer::interruptFlags() & Timer::overflowFlag );
+		bool high = (Timer::controlB() & Timer::edgeSelect) != 0; // rising edge captured
+		Timer::controlB() ^= Timer::edgeSelect; // wait for the opposite edge next
+		Timer::interruptFlags() = Timer::captureFlag; // changing the edge can set the flag
+		s_instance->edge( high, stamp );
+	}
+
+	// overflow interrupt handler
+	static inline void overflowed() {
+		s_overflows++;
+	}
+
+private:
+
+	static DustSensorCapture<TIMER> *s_instance;
+	static volatile unsigned int s_overflows;
+};
+
+template <byte TIMER> DustSensorCapture<TIMER> *DustSensorCapture<TIMER>::s_instance = NULL;
+template <byte TIMER> volatile unsigned int DustSensorCapture<TIMER>::s_overflows = 0;
+
+
+ISR( TIMER4_CAPT_vect ) { DustSensorCapture<4>::captured(); }
+ISR( TIMER4_OVF_vect ) { DustSensorCapture<4>::overflowed(); }
+ISR( TIMER5_CAPT_vect ) { DustSensorCapture<5>::captured(); }
+ISR( TIMER5_OVF_vect ) { DustSensorCapture<5>::overflowed(); }
+
+
+#endif // _MANYLABS_DUST_SENSOR_CAPTURE_H_
@@ -0,0 +1,68 @@
+// Manylabs DustSensor example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example compares the cost of the dust sensor interrupt handlers. It
+// counts CPU cycles with Timer1 running at the full clock rate, calling
+// DustSensor::change() (digitalRead() lookup) and DustSensorPin<2>::change()
+// (direct input register read) with interrupts disabled.
+//
+// Leave pin 2 unconnected to time the rising-edge path (the pull-up holds the
+// pin high), or connect it to ground to time the falling-edge path.
+
+#include "DustSensor.h"
+
+#define ITERATIONS 1000
+
+DustSensor slowSensor;
+DustSensorPin<2> fastSensor;
+
+// the handlers as they would be attached with attachInterrupt()
+void noChange() {}
+void slowChange() { slowSensor.change(); }
+void fastChange() { fastSensor.change(); }
+
+// returns the average number of cycles taken by one call to handler()
+unsigned long averageCycles( void (*handler)() ) {
+    unsigned long total = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        cli();
+        unsigned int start = TCNT1;
+        handler();
+        unsigned int end = TCNT1;
+        sei();
+        total += (unsigned int) (end - start);
+    }
+    return total / ITERATIONS;
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    slowSensor.init(2);
+    fastSensor.init();
+
+    // Timer1: normal mode, no prescaler (one count per CPU cycle)
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+
+    Serial.println("Starting Tests");
+    Serial.println("==============");
+    Serial.print("pin 2 is ");
+    Serial.println(digitalRead(2) == HIGH ? "high (rising-edge path)" : "low (falling-edge path)");
+
+    unsigned long overhead = averageCycles(noChange);
+    unsigned long slow = averageCycles(slowChange) - overhead;
+    unsigned long fast = averageCycles(fastChange) - overhead;
+
+    Serial.print("DustSensor::change(): ");
+    Serial.print(slow);
+    Serial.println(" cycles");
+    Serial.print("DustSensorPin<2>::change(): ");
+    Serial.print(fast);
+    Serial.println(" cycles");
+    Serial.println("==============");
+    Serial.println("Tests Complete");
+}
+
+void loop() {
+}
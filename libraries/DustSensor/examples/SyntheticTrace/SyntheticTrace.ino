@@ -0,0 +1,99 @@
+// Manylabs DustSensor example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example checks the dust sensor timing logic against synthetic pulse
+// traces. The edges are fed to DustSensor::edge() directly, so no sensor needs
+// to be connected. The capture trace is built from raw 16-bit timer values
+// and overflow counts the way the Timer4/Timer5 capture interrupts see them.
+// The last check runs the Timer4 capture channel, so leave pin 49 unconnected.
+
+#include "DustSensor.h"
+#include "DustSensorCapture.h"
+#include "TestReport.h"
+
+DustSensor sensor;
+DustSensorCapture<4> capture;
+TestReport report;
+
+// close the sensor's window at the given timestamp (as snapshot() would)
+void closeAt( unsigned long now ) {
+    cli();
+    sensor.closeWindow(now);
+    sei();
+    sensor.collectWindow();
+}
+
+// timestamp in timer ticks as the capture interrupt computes it
+unsigned long tick( unsigned int overflows, unsigned int count, bool overflowPending ) {
+    return DustSensorCapture<4>::extend(overflows, count, overflowPending);
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+
+    // microsecond trace: the third pulse spans the window boundary at 10000
+    cli();
+    sensor.restart(0, false);
+    sei();
+    sensor.edge(false, 1000);
+    sensor.edge(true, 3000);
+    sensor.edge(false, 9000);
+    closeAt(10000);
+    report.check("window 1 low", sensor.lowTime(), 3000);
+    report.check("window 1 length", sensor.windowLength(), 10000);
+    sensor.edge(true, 12000);
+    sensor.edge(true, 13000); // repeated rising edge must not count
+    closeAt(20000);
+    report.check("window 2 low", sensor.lowTime(), 2000);
+    report.check("window 2 length", sensor.windowLength(), 10000);
+
+    // a trace that starts with the pin low and wraps micros()
+    cli();
+    sensor.restart(0xFFFFF000UL, true);
+    sei();
+    sensor.edge(true, 0x00000800UL);
+    closeAt(0x00001000UL);
+    report.check("wrapped low", sensor.lowTime(), 0x1800);
+    report.check("wrapped length", sensor.windowLength(), 0x2000);
+    Serial.println("==============");
+
+    // overflow extension of the 16-bit capture registers
+    report.check("capture before overflow", tick(3, 0xFFF0, true), 0x3FFF0UL);
+    report.check("capture after overflow", tick(3, 0x0004, true), 0x40004UL);
+    report.check("capture no overflow", tick(3, 0x0004, false), 0x30004UL);
+
+    // capture trace in ticks: low from 0x1FF00 to 0x20100 (pending overflow
+    // at the rising edge), then low across the window boundary
+    cli();
+    sensor.restart(tick(1, 0x0000, false), false);
+    sei();
+    sensor.edge(false, tick(1, 0xFF00, false));
+    sensor.edge(true, tick(1, 0x0100, true));
+    sensor.edge(false, tick(2, 0x8000, false));
+    closeAt(tick(2, 0xC000, false));
+    report.check("capture window low", sensor.lowTime(), 0x200 + 0x4000);
+    report.check("capture window length", sensor.windowLength(), 0x1C000UL);
+
+    // a capture channel closed like the sketch does it (close() in the same
+    // critical section as the other sensors, then collectWindow()) reports
+    // the low time of its window
+    capture.init();
+    cli();
+    unsigned long start = DustSensorCapture<4>::now() - 20000;
+    capture.restart(start, false);
+    capture.edge(false, start + 5000);
+    capture.edge(true, start + 15000);
+    capture.close();
+    sei();
+    capture.collectWindow();
+    report.check("capture close low", capture.lowTime(), 10000);
+    report.check("capture close length", capture.windowLength() >= 20000, 1);
+    report.check("capture close ratio", capture.ratioQ16() > 0, 1);
+
+    report.end();
+}
+
+void loop() {
+}
@@ -14,6 +14,10 @@
 #endif
 
 #include <ManylabsDataAuth.h>
+#include <HttpResponse.h>
+#include <ReplyMatcher.h>
+#include <LatencyTracker.h>
+#include <DataTransport.h>
 #include <avr/wdt.h> // Watchdog timer
 
 // These defines control what server the GprsSender will post to
@@ -42,10 +46,20 @@
 // Default timeout for replies from the SIM module
 #define DEFAULT_TIMEOUT_MS 2000
 
-// Default timeout for network operations. (Connecting to the server, waiting
-// for a server response)
+// Default timeout for network operations. (Attaching to GPRS, connecting to
+// the server, waiting for a server response)
 #define DEFAULT_NETWORK_TIMEOUT_MS 10000
 
+// Default timeout for shutting down the bearer (CIPSHUT)
+#define DEFAULT_SHUT_TIMEOUT_MS 10000
+
+// Bounds of the timeouts learned from the reply times (see LatencyTracker).
+// Until a reply has been seen, the defaults above are used
+#define MIN_TIMEOUT_MS 500
+#define MAX_TIMEOUT_MS 6000
+#define MIN_NETWORK_TIMEOUT_MS 3000
+#define MAX_NETWORK_TIMEOUT_MS 30000
+
 // Default timeout for network registration. (Connecting to the cell network)
 #define DEFAULT_NETWORK_REG_TIMEOUT_MS 60000
 
@@ -57,12 +71,32 @@
 #define authPrint(...) { if(m_manylabsDataAuth) m_manylabsDataAuth->print(__VA_ARGS__); }
 
 
+// A function that adds the values of a request body with GprsSender::add()
+typedef void (*GprsBodyWriter)();
+
 // Commonly Used Flash Strings
 #define PGMSTR(x) (__FlashStringHelper*)(x)
 const char flash_ok[] PROGMEM = "OK";
 const char flash_r_arrow[] PROGMEM = "->";
 const char flash_l_arrow[] PROGMEM = "<-";
 const char flash_timeout[] PROGMEM = "<timeout>";
+const char flash_closed[] PROGMEM = "CLOSED";
+
+// Replies that fail a command (see startCommand). "+PDP: DEACT" means the
+// network has dropped the bearer; "CLOSED" while sending means the server has
+// dropped the connection
+const char flash_error[] PROGMEM = "ERROR";
+const char flash_cme_error[] PROGMEM = "+CME ERROR";
+const char flash_pdp_deact[] PROGMEM = "+PDP: DEACT";
+const char flash_connect_fail[] PROGMEM = "CONNECT FAIL";
+const char flash_send_fail[] PROGMEM = "SEND FAIL";
+PGM_P const flash_errors[] PROGMEM = {
+    flash_error, flash_cme_error, flash_pdp_deact, NULL };
+PGM_P const flash_connect_errors[] PROGMEM = {
+    flash_connect_fail, flash_error, flash_cme_error, flash_pdp_deact, NULL };
+PGM_P const flash_send_errors[] PROGMEM = {
+    flash_send_fail, flash_closed, flash_error, flash_cme_error,
+    flash_pdp_deact, NULL };
 
 //============================================
 // GPRS SENDER CLASS DEFINITION
@@ -70,7 +104,7 @@ const char flash_timeout[] PROGMEM = "<timeout>";
 
 
 // The GprsSender class can be used to send HTTP POST messages via GRPS.
-class GprsSender {
+class GprsSender : public DataTransport {
 public:
 
     // create a new GPRS object using the given serial object
@@ -91,6 +125,16 @@ public:
     // add a ManyLabsDataAuth object to generate an authentication header
     void addManylabsDataAuth( ManylabsDataAuth *dataAuth );
 
+    // let init move the link to the SIM module from baud to fastBaud (e.g.
+    // 57600) and save that on the module (IPR). serial is the port given to
+    // the constructor; init reopens it at the rate the module answers at. if
+    // the link doesn't work at fastBaud, init resets the module, which takes
+    // it back to baud, and stays there
+    void setBaudRate( HardwareSerial &serial, uint32_t baud, uint32_t fastBaud );
+
+    // the rate the link runs at (0 if setBaudRate() wasn't called)
+    uint32_t baudRate(){ return m_hwSerial ? m_hwBaud : 0; }
+
     // reboot the SIM module
     void reboot();
 
@@ -108,6 +152,17 @@ public:
     template <typename T> void add( const T *name, long value );
     template <typename T> void add( const T *name, unsigned long value );
 
+    // add a value that is a list of items, e.g. records=1,2.5;2,3.5 (values
+    // separated by ',', items by ';'); call startListItem() before the values
+    // of each item. like add(), these count or write depending on the mode
+    template <typename T> void startList( const T *name );
+    void startListItem();
+    template <typename T> void addListValue( const T *value );
+    void addListValue( double value, byte decimalPlaces = 2 );
+    void addListValue( int value );
+    void addListValue( long value );
+    void addListValue( unsigned long value );
+
     // before calling prepareToSend, calling add will count the bytes of the
     // data you provide (for the content-length header).
     // after calling prepareToSend, calling add will write the data you provide
@@ -121,10 +176,63 @@ public:
     // error with lastErrorCode
     bool send();
 
+    // start an asynchronous send. poll() opens the connection; once
+    // readyForData() is true, call sendBody(). returns false if an operation
+    // is running
+    bool startSend();
+
+    // returns true when the connection for startSend() is open and waiting
+    // for sendBody()
+    bool readyForData(){ return m_step == STEP_BODY; }
+
+    // write the request: addValues is called twice, first to count the values
+    // it adds for the content-length header and then to write them, so it
+    // must add the same values both times. poll() then finishes the send
+    void sendBody( GprsBodyWriter addValues );
+
+    // start rebooting the SIM module and waiting for network registration
+    // without blocking. returns false if an operation is running
+    bool startInit( const __FlashStringHelper *apn,
+        const __FlashStringHelper *apnUsername = 0,
+        const __FlashStringHelper *apnPassword = 0 );
+
+    // DataTransport: startUpload() starts a send and poll() writes it with
+    // sendBody( writeValues ) once the connection is open; startReset()
+    // repeats the last startInit() (false before the first)
+    bool startUpload( UploadWriter writeValues );
+    bool startReset();
+
+    // start waiting for network registration without blocking. returns false
+    // if an operation is running
+    bool startNetworkReg( uint32_t timeout = DEFAULT_NETWORK_REG_TIMEOUT_MS );
+
+    // advance the running operation; call this often from the main loop.
+    // returns true once when an operation has finished; lastErrorCode() then
+    // holds its result
+    bool poll();
+
+    // returns true while an operation is running
+    bool busy(){ return m_step != STEP_IDLE; }
+
+    // the signal strength read at the start of the last send (see
+    // signalStrength())
+    int lastSignalStrength(){ return m_signalStrength; }
+
+    // the reply times learned for plain commands, for bringing up the bearer
+    // (CGATT, CIICR), for the server (connect, send, response) and for
+    // shutting down the bearer; the timeouts of those commands follow them
+    const LatencyTracker &commandLatency(){ return m_commandLatency; }
+    const LatencyTracker &bearerLatency(){ return m_bearerLatency; }
+    const LatencyTracker &serverLatency(){ return m_serverLatency; }
+    const LatencyTracker &shutLatency(){ return m_shutLatency; }
+
 
     // retrieve the last HTTP status code (assuming the post was successful)
     int lastStatusCode(){ return m_lastStatusCode; }
 
+    // the Retry-After header of the last response in seconds (0 if none)
+    unsigned long lastRetryAfter(){ return m_response.retryAfter(); }
+
     // returns an error code for the last failure to send
     // 0 No Error: There was no error. The send was successful
     // 1 GPRS Error: The error was related to the SIM module. If you receive
@@ -183,49 +291,102 @@ private:
       size_t write( uint8_t u_Data ){ return 0x01; }
     };
 
+    // Steps of the asynchronous operations. Each step issues one command (or
+    // waits) when it is entered, and poll() moves on when the reply arrives.
+    enum Step {
+        STEP_IDLE,
+
+        // reboot (specific to the Adafruit FONA) and module setup
+        STEP_RESET_HIGH, STEP_RESET_LOW, STEP_BOOT_WAIT, STEP_AT,
+        STEP_AT_RETRY_WAIT, STEP_ECHO_OFF, STEP_SHOW_ERRORS,
+
+        // baud rate (see setBaudRate)
+        STEP_BAUD_SET, STEP_BAUD_CHECK, STEP_BAUD_SAVE,
+
+        // network registration
+        STEP_REG_QUERY, STEP_REG_WAIT,
+
+        // signal strength
+        STEP_SIGNAL,
+
+        // send: the bearer (GPRS attach, PDP context and IP address) is set up
+        // only as far as CIPSTATUS shows it is missing, and is kept up after
+        // the send; only a GPRS error shuts it down (STEP_CLOSE)
+        STEP_STATUS, STEP_RESET_CONTEXT, STEP_ATTACH, STEP_APN, STEP_BRING_UP,
+        STEP_LOCAL_IP, STEP_CONNECT, STEP_CONNECTED, STEP_PROMPT, STEP_BODY,
+        STEP_SEND_OK, STEP_RESPONSE, STEP_CLOSE_SOCKET, STEP_CLOSE
+    };
+
+    // Results of pollReply()
+    enum Reply {
+        REPLY_NONE, // still waiting
+        REPLY_OK, // the expected reply arrived (or a wait has passed)
+        REPLY_ERROR, // an error reply arrived
+        REPLY_TIMEOUT, // nothing matched before the timeout
+        REPLY_LINE // some other line arrived; it is in m_simBuf
+    };
+
     // send a command to the SIM module
     template <typename T> void sendCommand( const T *command );
 
-    // wait for a reply from the SIM module
-    // returns false on timeout
-    bool waitForReply( const __FlashStringHelper *Reply,
-        uint32_t timeout = DEFAULT_TIMEOUT_MS );
+    // start waiting for a reply from the SIM module after sending command
+    // (if not NULL). lines starting with reply complete the command; lines
+    // starting with one of errors (a flash table such as flash_errors, see
+    // ReplyMatcher) fail it. a NULL reply only waits for the timeout. if
+    // prompt is true, the prompt "> " completes the command
+    void startCommand( const __FlashStringHelper *command,
+        const __FlashStringHelper *reply,
+        uint32_t timeout = DEFAULT_TIMEOUT_MS,
+        const PGM_P *errors = flash_errors, bool prompt = false );
 
-    // wait for the prompt "> " from the SIM module
-    // returns false on timeout
-    bool waitForPrompt( uint32_t timeout = DEFAULT_TIMEOUT_MS );
+    // the same with the timeout learned by latency; the time the reply takes
+    // (or a timeout) is added to it
+    void startCommand( const __FlashStringHelper *command,
+        const __FlashStringHelper *reply, LatencyTracker &latency,
+        const PGM_P *errors = flash_errors, bool prompt = false );
 
-    // send a command and then wait for the reply
-    // returns false on timeout
-    bool sendCommandWaitForReply( const __FlashStringHelper *command,
-        const __FlashStringHelper *reply,
-        uint32_t timeout = DEFAULT_TIMEOUT_MS );
+    // read what the SIM module has sent so far without blocking and check it
+    // against the command started by startCommand
+    Reply pollReply();
+
+    // returns true if the string in m_simBuf starts with the given flash string
+    bool replyStartsWith( const __FlashStringHelper *prefix );
 
-    // Reads a line formatted <CR><LF>reply<CR><LF> from the SIM module
-    // returns the number of bytes read or -1 on timeout
-    int readLine( uint32_t timeout = DEFAULT_TIMEOUT_MS );
+    // enter a step of the running operation and issue its command
+    void enterStep( Step step );
 
-    // attempts to parse the HTTP status code from the server response
-    int readStatusCode( uint32_t timeout = DEFAULT_TIMEOUT_MS );
+    // handle a reply in the current step
+    void handleReply( Reply reply );
+
+    // fail the running send and close the connection
+    void failSend( int errorCode );
+
+    // end the running operation
+    void finish();
+
+    // finish the module setup after a reboot
+    void setupFinished();
+
+    // reopen the serial port at the given rate (see setBaudRate)
+    void openSerial( uint32_t baud );
+
+    // write the headers for the counted values and switch add() to writing
+    void startBody();
+
+    // send the values added since startBody()
+    void finishSend();
+
+    // run the current operation until it finishes; returns true on success
+    bool runToEnd();
 
     // send raw serial data to the SIM module without first flushing the input
     // and without adding '\r' as sendCommand does
     template <typename T> void sendRaw( const T *raw );
     template <typename T> void sendRaw( T raw );
 
-    // start the GPRS connection
-    bool startConnection();
-
     // write the default headers
     void writeDefaultHeaders( int contentLength );
 
-    // tell the SIM module to send the data
-    bool sendData();
-
-    // close the GPRS connection - Sometimes this takes a bit longer, so it
-    // defaults to a double timeout
-    bool closeConnection( uint32_t timeout = DEFAULT_TIMEOUT_MS * 2 );
-
     // read from the serial stream until it's empty. All read data will be sent
     // to the debug stream unless printFlushed is false
     void flushInput( bool printFlushed = true );
@@ -237,6 +398,13 @@ private:
     // clears the dataLength value in preparation for adding a new set of values
     void clearDataLength();
 
+    // count or write a list value or separator
+    template <typename V> void addRaw( V value );
+    void addRaw( double value, byte decimalPlaces );
+
+    // write the separator before a list value
+    void listSeparator();
+
     // the length (in bytes) of the data to be sent
     size_t m_dataLength;
 
@@ -268,17 +436,63 @@ private:
     // the last HTTP status code
     int m_lastStatusCode;
 
+    // parser for the server's response
+    HttpResponseParser m_response;
+
     // the reason for the last failure to send
     int m_lastErrorCode;
 
+    // the last signal strength
+    int m_signalStrength;
+
     // the pin we should toggle to reset the module (specific to the Adafruit
     // FONA)
     int m_resetPin;
 
+    // the serial port and rates for setBaudRate (m_hwSerial is NULL without
+    // it); m_hwBaud is the rate the port is open at
+    HardwareSerial *m_hwSerial;
+    uint32_t m_baud;
+    uint32_t m_fastBaud;
+    uint32_t m_hwBaud;
+    bool m_baudProbed; // the other rate has been tried since the reboot
+    bool m_baudFailed; // the link didn't work at m_fastBaud
+
     // when this is true, we're counting the bytes the user adds for the
     // content-length header. When it's false, we're printing the data they add
     // directly to the stream for the SIM module
     bool m_dataCountMode;
+
+    // items in the current list, and values in its current item
+    unsigned int m_listItemCount;
+    byte m_listValueCount;
+
+    // the command being waited for (see startCommand)
+    const __FlashStringHelper *m_reply;
+    ReplyMatcher m_errorMatcher;
+    bool m_lineFailed; // the current line has matched m_errorMatcher
+    bool m_waitForPrompt;
+    uint32_t m_replyTimestamp;
+    uint32_t m_commandTimestamp;
+    LatencyTracker *m_latency; // of the command being waited for, or NULL
+
+    // the reply times learned for each kind of command
+    LatencyTracker m_commandLatency;
+    LatencyTracker m_bearerLatency;
+    LatencyTracker m_serverLatency;
+    LatencyTracker m_shutLatency;
+
+    // the running operation
+    Step m_step;
+    uint8_t m_stepTries;
+    uint32_t m_operationTimestamp; // deadline of the whole operation
+    bool m_registerAfterReboot;
+    bool m_sending;
+    bool m_sendFailed;
+    bool m_requestSent;
+    int m_regStatus;
+    bool m_finished;
+    UploadWriter m_uploadWriter; // (see startUpload)
 };
 
 
@@ -290,42 +504,72 @@ private:
 // diagStream is for displaying diagnostics
 // reset pin is specific to the Adafruit FONA and is used for rebooting
 GprsSender::GprsSender( int resetPin, Stream &serialStream, Stream &diagStream )
-    : m_serialStream( &serialStream ), m_diagStream( &diagStream ) {
+    : m_serialStream( &serialStream ), m_diagStream( &diagStream ),
+    m_commandLatency( DEFAULT_TIMEOUT_MS, MIN_TIMEOUT_MS, MAX_TIMEOUT_MS ),
+    m_bearerLatency( DEFAULT_NETWORK_TIMEOUT_MS, MIN_NETWORK_TIMEOUT_MS, MAX_NETWORK_TIMEOUT_MS ),
+    m_serverLatency( DEFAULT_NETWORK_TIMEOUT_MS, MIN_NETWORK_TIMEOUT_MS, MAX_NETWORK_TIMEOUT_MS ),
+    m_shutLatency( DEFAULT_SHUT_TIMEOUT_MS, MIN_NETWORK_TIMEOUT_MS, MAX_NETWORK_TIMEOUT_MS ) {
 
     m_simBufPos = 0;
 
     m_dataLength = 0;
 
     m_lastStatusCode = -1;
+    m_lastErrorCode = 0;
+    m_signalStrength = -1;
     m_resetPin = resetPin;
 
     m_useDiagStream = true;
 
     m_dataCountMode = true;
+    m_listItemCount = 0;
+    m_listValueCount = 0;
 
     m_manylabsDataAuth = NULL;
 
     m_nullStream = NullStream();
+
+    m_latency = NULL;
+    m_hwSerial = NULL;
+    m_apn = NULL;
+    m_step = STEP_IDLE;
+    m_finished = false;
+    m_uploadWriter = NULL;
 }
 
 // Same as above but without diagnostics
 GprsSender::GprsSender( int resetPin, Stream &serialStream )
-    : m_serialStream( &serialStream ), m_diagStream( NULL ) {
+    : m_serialStream( &serialStream ), m_diagStream( NULL ),
+    m_commandLatency( DEFAULT_TIMEOUT_MS, MIN_TIMEOUT_MS, MAX_TIMEOUT_MS ),
+    m_bearerLatency( DEFAULT_NETWORK_TIMEOUT_MS, MIN_NETWORK_TIMEOUT_MS, MAX_NETWORK_TIMEOUT_MS ),
+    m_serverLatency( DEFAULT_NETWORK_TIMEOUT_MS, MIN_NETWORK_TIMEOUT_MS, MAX_NETWORK_TIMEOUT_MS ),
+    m_shutLatency( DEFAULT_SHUT_TIMEOUT_MS, MIN_NETWORK_TIMEOUT_MS, MAX_NETWORK_TIMEOUT_MS ) {
 
     m_simBufPos = 0;
 
     m_dataLength = 0;
 
     m_lastStatusCode = -1;
+    m_lastErrorCode = 0;
+    m_signalStrength = -1;
     m_resetPin = resetPin;
 
     m_useDiagStream = true;
 
     m_dataCountMode = true;
+    m_listItemCount = 0;
+    m_listValueCount = 0;
 
     m_manylabsDataAuth = NULL;
 
     m_nullStream = NullStream();
+
+    m_latency = NULL;
+    m_hwSerial = NULL;
+    m_apn = NULL;
+    m_step = STEP_IDLE;
+    m_finished = false;
+    m_uploadWriter = NULL;
 }
 
 // set network info, reboots the module (specific to the Adafruit FONA),
@@ -335,61 +579,54 @@ bool GprsSender::init( const __FlashStringHelper *apn,
     const __FlashStringHelper *apnUsername,
     const __FlashStringHelper *apnPassword ) {
 
+    return startInit(apn, apnUsername, apnPassword) && runToEnd();
+}
+
+// start rebooting the SIM module and waiting for network registration
+// without blocking. returns false if an operation is running
+bool GprsSender::startInit( const __FlashStringHelper *apn,
+    const __FlashStringHelper *apnUsername,
+    const __FlashStringHelper *apnPassword ) {
+
+    if(busy()){
+        return false;
+    }
+
     m_dataLength = 0;
 
     m_apn = apn;
     m_apnUsername = apnUsername;
     m_apnPassword = apnPassword;
 
-    reboot();
-
-    // Wait to attach to the network.
-    return waitForNetworkReg();
+    m_registerAfterReboot = true;
+    m_operationTimestamp = millis() + DEFAULT_NETWORK_REG_TIMEOUT_MS;
+    enterStep(STEP_RESET_HIGH);
+    return true;
 }
 
 void GprsSender::addManylabsDataAuth( ManylabsDataAuth *dataAuth ){
     m_manylabsDataAuth = dataAuth;
 }
 
-// reboot the SIM module
-void GprsSender::reboot() {
-
-    // This first part is specific to the Adafruit FONA:
-
-    // Toggle the reset pin low for 100 ms
-    pinMode(m_resetPin, OUTPUT);
-    digitalWrite(m_resetPin, HIGH);
-    delayAndWdtReset(10);
-    digitalWrite(m_resetPin, LOW);
-    delayAndWdtReset(100);
-    digitalWrite(m_resetPin, HIGH);
+// let init move the link to the SIM module from baud to fastBaud. init
+// looks for the module at fastBaud first, since it keeps the rate once saved
+void GprsSender::setBaudRate( HardwareSerial &serial, uint32_t baud,
+    uint32_t fastBaud ) {
 
-    // Give it some time to reboot
-    delayAndWdtReset(5000);
-
-    flushInput(false); // Don't print garbage
+    m_hwSerial = &serial;
+    m_baud = baud;
+    m_fastBaud = fastBaud;
+    m_baudFailed = false;
+    openSerial(fastBaud);
+}
 
-    // Check a few times for an OK response from the SIM module
-    for(int i=0; i<3; i++){
-        if(sendCommandWaitForReply(F("AT"), PGMSTR(flash_ok))){
-            break;
-        }
-        delayAndWdtReset(100);
+// reboot the SIM module
+void GprsSender::reboot() {
+    if(!busy()){
+        m_registerAfterReboot = false;
+        enterStep(STEP_RESET_HIGH);
+        runToEnd();
     }
-
-    flushInput(false); // Don't print garbage
-
-    // End FONA specific part
-
-    // Clear data length
-    clearDataLength();
-    m_dataCountMode = true;
-
-    // Disable echoing commands
-    sendCommandWaitForReply(F("ATE0"), PGMSTR(flash_ok));
-
-    // Show error codes
-    sendCommandWaitForReply(F("AT+CMEE=1"), PGMSTR(flash_ok));
 }
 
 /**
@@ -621,100 +858,102 @@ void GprsSender::clearDataLength() {
 }
 
 
-/**
- * Functions for managing the connection and sending data
- */
+// start a value that is a list of items (see startListItem)
+template <typename T>
+void GprsSender::startList( const T *name ) {
+    if (m_dataLength){
+        addRaw( '&' );
+    }
+    add( name );
+    addRaw( '=' );
+    m_listItemCount = 0;
+    m_listValueCount = 0;
+}
 
-// start the GPRS connection
-bool GprsSender::startConnection() {
 
-    // Attach to GPRS service (CGATT) - Max response time of 10 sec
-    if( !sendCommandWaitForReply(F("AT+CGATT=1"), PGMSTR(flash_ok), 10000) ){
-        diagStreamPrintLn(F("CGATT Fail - Retrying"));
-
-        // If the SIM module hasn't finished registering with the network, this
-        // will fail on the first try. Protect against that here.
-        if( !sendCommandWaitForReply(F("AT+CGATT=1"), PGMSTR(flash_ok), 10000) ){
-            diagStreamPrintLn(F("CGATT Fail"));
-            m_lastErrorCode = 1;
-            return false;
-        }
+// start the next item of the current list
+void GprsSender::startListItem() {
+    if (m_listItemCount++){
+        addRaw( ';' );
     }
+    m_listValueCount = 0;
+}
 
-    // Set credentials (CSTT) - This we need to include the credentials here so
-    // we handle this a bit differently than some other commands
-    flushInput();
-    diagStreamPrint(PGMSTR(flash_r_arrow));
-    sendRaw(F("AT+CSTT=\""));
-    sendRaw(m_apn);
-    sendRaw(F("\""));
-    if(m_apnUsername){
-        sendRaw(F(",\""));
-        sendRaw(m_apnUsername);
-        sendRaw(F("\""));
-    }
-    if(m_apnPassword){
-        sendRaw(F(",\""));
-        sendRaw(m_apnPassword);
-        sendRaw(F("\""));
-    }
-    sendRaw(F("\r"));
-    diagStreamPrintLn();
-    if( !waitForReply(PGMSTR(flash_ok)) ){
-        diagStreamPrintLn(F("CSTT Fail"));
-        m_lastErrorCode = 1;
-        return false;
-    }
 
-    // Start wireless connection (CIICR)
-    // Every once in a while this takes quite a bit of time.
-    if( !sendCommandWaitForReply(F("AT+CIICR"), PGMSTR(flash_ok), DEFAULT_NETWORK_TIMEOUT_MS) ){
-        diagStreamPrintLn(F("CIICR Fail"));
-        m_lastErrorCode = 1;
-        return false;
-    }
+// add a value to the current list item
+template <typename T>
+void GprsSender::addListValue( const T *value ) {
+    listSeparator();
+    add( value );
+}
 
-    // Reset PDP context (CIPSHUT). Otherwise we can sometimes get stuck in the
-    // "PDP DEACT" state
-    if( !closeConnection() ){
-        diagStreamPrintLn(F("CIPSHUT Fail"));
-        m_lastErrorCode = 1;
-        return false;
-    }
 
-    // Open the connection to the server (CIPSTART)
-    flushInput();
-    diagStreamPrint(PGMSTR(flash_r_arrow));
-    sendRaw(F("AT+CIPSTART=\"TCP\",\""));
-    sendRaw(F(GPRS_POST_HOST)); // Server
-    sendRaw(F("\",\""));
-    sendRaw(F(GPRS_POST_PORT)); // Port
-    sendRaw(F("\"\r"));
-    diagStreamPrintLn();
-    if( !waitForReply(PGMSTR(flash_ok)) ){
-        diagStreamPrintLn(F("CIPSTART Fail"));
-        m_lastErrorCode = 1;
-        return false;
-    }
+// add a value to the current list item
+void GprsSender::addListValue( double value, byte decimalPlaces ) {
+    listSeparator();
+    addRaw( value, decimalPlaces );
+}
 
-    // We'll get CONNECT OK once the TCP connection is established. This is
-    // dependent on the cell network and the server itself.
-    if( !waitForReply(F("CONNECT OK"), DEFAULT_NETWORK_TIMEOUT_MS) ){
-        diagStreamPrintLn(F("TCP Fail"));
-        m_lastErrorCode = 2;
-        return false;
+
+// add a value to the current list item
+void GprsSender::addListValue( int value ) {
+    addListValue( (long) value );
+}
+
+
+// add a value to the current list item
+void GprsSender::addListValue( long value ) {
+    listSeparator();
+    addRaw( value );
+}
+
+
+// add a value to the current list item
+void GprsSender::addListValue( unsigned long value ) {
+    listSeparator();
+    addRaw( value );
+}
+
+
+// write the separator before a list value
+void GprsSender::listSeparator() {
+    if (m_listValueCount++){
+        addRaw( ',' );
     }
+}
 
-    sendCommand(F("AT+CIPSEND"));
-    if(!waitForPrompt()){
-        diagStreamPrintLn(F("CIPSEND Fail"));
-        m_lastErrorCode = 1;
-        return false;
+
+// count or write a list value or separator
+template <typename V>
+void GprsSender::addRaw( V value ) {
+    if(m_dataCountMode == false){
+        m_serialStream->print( value );
+        diagStreamPrint( value );
+        m_dataLength = 1;
+    }else{
+        m_dataLength += m_nullStream.print( value );
+        authPrint( value );
     }
+}
 
-    return true;
+
+// count or write a list value
+void GprsSender::addRaw( double value, byte decimalPlaces ) {
+    if(m_dataCountMode == false){
+        m_serialStream->print( value, decimalPlaces );
+        diagStreamPrint( value, decimalPlaces );
+        m_dataLength = 1;
+    }else{
+        m_dataLength += m_nullStream.print( value, decimalPlaces );
+        authPrint( value, decimalPlaces );
+    }
 }
 
+
+/**
+ * Functions for managing the connection and sending data
+ */
+
 // write the default headers
 void GprsSender::writeDefaultHeaders( int contentLength ) {
     flushInput();
@@ -736,35 +975,6 @@ void GprsSender::writeDefaultHeaders( int contentLength ) {
     sendRaw(F("\r\n"));
 }
 
-// tell the SIM module to send the data
-bool GprsSender::sendData() {
-
-    flushInput();
-
-    // Send Ctrl-Z: ((char)26)
-    sendRaw((char)26);
-    diagStreamPrintLn();
-
-    // We'll get "SEND OK" if the data was sent and received by the server.
-    // If this was UDP, "SEND OK" would only mean the data was sent. Since it's
-    // TCP, that response means the server received it.
-    return waitForReply(F("SEND OK"), DEFAULT_NETWORK_TIMEOUT_MS);
-}
-
-// close the GPRS connection - Sometimes this takes a bit longer, so it
-// defaults to a double timeout. This will retry up to CLOSE_RETRY_COUNT times.
-bool GprsSender::closeConnection( uint32_t timeout ) {
-
-    // Close the connection (CIPSHUT). Retry up to retry count
-    for(int i = 0; i < CLOSE_RETRY_COUNT; ++i){
-        wdt_reset();
-        if(sendCommandWaitForReply(F("AT+CIPSHUT"), F("SHUT OK"), timeout)){
-            return true;
-        }
-    }
-    return false;
-}
-
 // before calling prepareToSend, calling add will count the bytes of the
 // data you provide (for the content-length header).
 // after calling prepareToSend, calling add will write the data you provide
@@ -772,56 +982,108 @@ bool GprsSender::closeConnection( uint32_t timeout ) {
 // returns false on error. you can check the reason for the
 // error with lastErrorCode
 bool GprsSender::prepareToSend() {
-    bool connectionOpened = startConnection();
-
-    if(connectionOpened){
-
-        writeDefaultHeaders(m_dataLength);
-
-        // Write auth header if we've been given a ManylabsDataAuth object
-        if(m_manylabsDataAuth){
-            if(m_serialStream){
-                m_manylabsDataAuth->writeAuthHeader(*m_serialStream);
-            }
-            if(m_diagStream && m_useDiagStream){
-                m_manylabsDataAuth->writeAuthHeader(*m_diagStream);
-            }
+    if(!startSend()){
+        return false;
+    }
+    while(!readyForData()){
+        if(poll()){
+            return false;
         }
+    }
+    startBody();
+    return true;
+}
 
-        // Blank line before data
-        sendRaw(F("\r\n"));
+// post to the server with the values specified since the call to
+// prepareToSend. returns false on error. you can check the reason for the
+// error with lastErrorCode
+bool GprsSender::send() {
+    if(!readyForData()){
+        return false;
+    }
+    finishSend();
+    return runToEnd();
+}
 
-        // Set the count mode to false. This means calling add will send the
-        // data directly to the SIM module
-        m_dataCountMode = false;
+// start an asynchronous send. poll() opens the connection; once
+// readyForData() is true, call sendBody(). returns false if an operation
+// is running
+bool GprsSender::startSend() {
+    if(busy()){
+        return false;
+    }
+    m_sending = true;
+    m_sendFailed = false;
+    m_requestSent = false;
+    m_lastStatusCode = -1;
+    m_response.reset();
+    m_uploadWriter = NULL;
+    enterStep(STEP_SIGNAL);
+    return true;
+}
 
-    }else{
+// start a send that poll() writes with writeValues
+bool GprsSender::startUpload( UploadWriter writeValues ) {
+    if(!startSend()){
+        return false;
+    }
+    m_uploadWriter = writeValues;
+    return true;
+}
 
-        // If we fail to open the connection, then we shouldn't progress to send
-        // So we need to set m_dataCountMode = true
+// repeat the last startInit()
+bool GprsSender::startReset() {
+    if(m_apn == NULL){
+        return false;
+    }
+    return startInit(m_apn, m_apnUsername, m_apnPassword);
+}
 
-        // Set the count mode to true. This means calling add will count the
-        // bytes for the content-length header
-        m_dataCountMode = true;
+// write the request: addValues is called twice, first to count the values
+// it adds for the content-length header and then to write them
+void GprsSender::sendBody( GprsBodyWriter addValues ) {
+    if(!readyForData()){
+        return;
+    }
+    if(m_manylabsDataAuth){
+        m_manylabsDataAuth->reset();
+    }
+    clearDataLength();
+    m_dataCountMode = true;
+    addValues();
+    startBody();
+    addValues();
+    finishSend();
+}
 
-        // startConnection sets it's own values for m_lastErrorCode, so don't
-        // set that here.
+// write the headers for the counted values and switch add() to writing
+void GprsSender::startBody() {
+    writeDefaultHeaders(m_dataLength);
 
-        closeConnection();
+    // Write auth header if we've been given a ManylabsDataAuth object
+    if(m_manylabsDataAuth){
+        if(m_serialStream){
+            m_manylabsDataAuth->writeAuthHeader(*m_serialStream);
+        }
+        if(m_diagStream && m_useDiagStream){
+            m_manylabsDataAuth->writeAuthHeader(*m_diagStream);
+        }
+        m_manylabsDataAuth->reset(); // Reset the auth object for the next round
     }
 
-    m_manylabsDataAuth->reset(); // Reset the auth object for the next round
+    // Blank line before data
+    sendRaw(F("\r\n"));
+
+    // Set the count mode to false. This means calling add will send the
+    // data directly to the SIM module
+    m_dataCountMode = false;
 
     // Clear the data length. Otherwise the first argument will have an &
     clearDataLength();
-
-    return connectionOpened;
 }
 
-// post to the server with the values specified since the call to
-// prepareToSend. returns false on error. you can check the reason for the
-// error with lastErrorCode
-bool GprsSender::send() {
+// send the values added since startBody()
+void GprsSender::finishSend() {
 
     // Blank line after printing data
     diagStreamPrintLn();
@@ -833,26 +1095,674 @@ bool GprsSender::send() {
     // for the content-length header
     m_dataCountMode = true;
 
-    if( !sendData() ){
-        closeConnection();
-        m_lastErrorCode = 2;
+    m_requestSent = true;
+    enterStep(STEP_SEND_OK);
+}
+
+// continually checks, up to the timeout, for successful network
+// registration. depending on network conditions, this can take a while.
+//
+// returns true on success, or false on timeout.
+bool GprsSender::waitForNetworkReg(uint32_t timeout) {
+    return startNetworkReg(timeout) && runToEnd();
+}
+
+// start waiting for network registration without blocking. returns false
+// if an operation is running
+bool GprsSender::startNetworkReg(uint32_t timeout) {
+    if(busy()){
         return false;
     }
+    m_operationTimestamp = millis() + timeout;
+    enterStep(STEP_REG_QUERY);
+    return true;
+}
 
-    // Check for a response
-    // The timeout here depends on a lot: Network connection, server, etc.
-    m_lastStatusCode = readStatusCode(DEFAULT_NETWORK_TIMEOUT_MS);
-    diagStreamPrint(F("status code: "));
-    diagStreamPrintLn(m_lastStatusCode);
+// returns signal strength (RSSI). according to the SIM module information,
+// the values essentially go from 0-31 with higher being better. the value
+// 99 is reserved for "not known" or "not detectable". reproduced here:
+//
+// 0:    -115 dBm or less
+// 1:    -111 dBm
+// 2-30: -110 ... -54 dBm
+// 31:   -52 dBm or greater
+// 99:   not known or not detectable
+int GprsSender::signalStrength( uint32_t timeout ) {
+    if(busy()){
+        return m_signalStrength;
+    }
+    m_sending = false;
+    enterStep(STEP_SIGNAL);
+    m_replyTimestamp = millis() + timeout;
+    runToEnd();
+    return m_signalStrength;
+}
 
-    // This last shut often needs a longer timeout for some reason
-    if( !closeConnection(10000) ){
-        m_lastErrorCode = 1;
-        return false;
+// advance the running operation; call this often from the main loop.
+// returns true once when an operation has finished; lastErrorCode() then
+// holds its result
+bool GprsSender::poll() {
+    if(m_uploadWriter && readyForData()){
+        sendBody(m_uploadWriter);
+    }
+    if(m_step != STEP_IDLE){
+        Reply reply = pollReply();
+        if(m_latency && reply != REPLY_NONE && reply != REPLY_LINE){
+
+            // (an error can arrive much sooner than the reply, so it isn't
+            // added)
+            if(reply == REPLY_OK){
+                m_latency->add(millis() - m_commandTimestamp);
+            }else if(reply == REPLY_TIMEOUT){
+                m_latency->addTimeout();
+            }
+            m_latency = NULL;
+        }
+        if(reply != REPLY_NONE){
+            handleReply(reply);
+        }
     }
+    if(m_step == STEP_IDLE && m_finished){
+        m_finished = false;
+        return true;
+    }
+    return false;
+}
 
-    m_lastErrorCode = 0;
-    return true;
+// run the current operation until it finishes; returns true on success
+bool GprsSender::runToEnd() {
+    while(!poll()){
+    }
+    return m_lastErrorCode == 0;
+}
+
+// enter a step of the running operation and issue its command
+void GprsSender::enterStep( Step step ) {
+    if(step != m_step){
+        m_stepTries = 0;
+    }
+    m_step = step;
+
+    switch(step){
+
+    // This first part is specific to the Adafruit FONA:
+    // Toggle the reset pin low for 100 ms, then give it some time to reboot
+    case STEP_RESET_HIGH:
+        m_baudProbed = false;
+        pinMode(m_resetPin, OUTPUT);
+        digitalWrite(m_resetPin, HIGH);
+        startCommand(NULL, NULL, 10);
+        break;
+    case STEP_RESET_LOW:
+        digitalWrite(m_resetPin, LOW);
+        startCommand(NULL, NULL, 100);
+        break;
+    case STEP_BOOT_WAIT:
+        digitalWrite(m_resetPin, HIGH);
+        startCommand(NULL, NULL, 5000);
+        break;
+
+    // Check a few times for an OK response from the SIM module
+    case STEP_AT:
+        flushInput(false); // Don't print garbage
+        startCommand(F("AT"), PGMSTR(flash_ok));
+        break;
+    // Disable echoing commands
+    case STEP_ECHO_OFF:
+        flushInput(false); // Don't print garbage
+        startCommand(F("ATE0"), PGMSTR(flash_ok));
+        break;
+
+    // Show error codes
+    case STEP_SHOW_ERRORS:
+        startCommand(F("AT+CMEE=1"), PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // Set the fast rate (IPR). The OK comes at the old rate; the module
+    // switches after it
+    case STEP_BAUD_SET:
+        flushInput();
+        diagStreamPrint(PGMSTR(flash_r_arrow));
+        sendRaw(F("AT+IPR="));
+        sendRaw(m_fastBaud);
+        sendRaw(F("\r"));
+        diagStreamPrintLn();
+        startCommand(NULL, PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // Check the link at the new rate
+    case STEP_BAUD_CHECK:
+        flushInput(false); // Don't print garbage
+        startCommand(F("AT"), PGMSTR(flash_ok));
+        break;
+
+    // Save the rate, so the module comes up at it after a reset (AT&W)
+    case STEP_BAUD_SAVE:
+        startCommand(F("AT&W"), PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // The reply to CREG is "<CR><LF>+CREG: <n>,<stat><CR><LF>"; see
+    // handleReply for the status values
+    case STEP_REG_QUERY:
+        m_regStatus = -1;
+        startCommand(F("AT+CREG?"), PGMSTR(flash_ok), m_commandLatency);
+        break;
+    case STEP_REG_WAIT:
+        startCommand(NULL, NULL, DEFAULT_TIMEOUT_MS);
+        break;
+
+    // The response will be something like: +CSQ: <rssi>,<ber>
+    case STEP_SIGNAL:
+        m_signalStrength = -1;
+        startCommand(F("AT+CSQ"), PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // Find out how much of the bearer is up (CIPSTATUS). The reply is OK
+    // followed by "STATE: <state>"; see handleReply
+    case STEP_STATUS:
+        startCommand(F("AT+CIPSTATUS"), F("STATE: "), m_commandLatency);
+        break;
+
+    // Reset PDP context (CIPSHUT). Otherwise we can sometimes get stuck in the
+    // "PDP DEACT" state
+    case STEP_RESET_CONTEXT:
+        wdt_reset();
+        startCommand(F("AT+CIPSHUT"), F("SHUT OK"), m_shutLatency);
+        break;
+
+    // Attach to GPRS service (CGATT) - Max response time of 10 sec
+    case STEP_ATTACH:
+        startCommand(F("AT+CGATT=1"), PGMSTR(flash_ok), m_bearerLatency);
+        break;
+
+    // Set credentials (CSTT) - This we need to include the credentials here so
+    // we handle this a bit differently than some other commands
+    case STEP_APN:
+        flushInput();
+        diagStreamPrint(PGMSTR(flash_r_arrow));
+        sendRaw(F("AT+CSTT=\""));
+        sendRaw(m_apn);
+        sendRaw(F("\""));
+        if(m_apnUsername){
+            sendRaw(F(",\""));
+            sendRaw(m_apnUsername);
+            sendRaw(F("\""));
+        }
+        if(m_apnPassword){
+            sendRaw(F(",\""));
+            sendRaw(m_apnPassword);
+            sendRaw(F("\""));
+        }
+        sendRaw(F("\r"));
+        diagStreamPrintLn();
+        startCommand(NULL, PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // Start wireless connection (CIICR)
+    // Every once in a while this takes quite a bit of time.
+    case STEP_BRING_UP:
+        startCommand(F("AT+CIICR"), PGMSTR(flash_ok), m_bearerLatency);
+        break;
+
+    // Get the local IP address (CIFSR); the module needs this before the first
+    // connection of a new context. The reply is just the address (no OK)
+    case STEP_LOCAL_IP:
+        startCommand(F("AT+CIFSR"), PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // Open the connection to the server (CIPSTART)
+    case STEP_CONNECT:
+        flushInput();
+        diagStreamPrint(PGMSTR(flash_r_arrow));
+        sendRaw(F("AT+CIPSTART=\"TCP\",\""));
+        sendRaw(F(GPRS_POST_HOST)); // Server
+        sendRaw(F("\",\""));
+        sendRaw(F(GPRS_POST_PORT)); // Port
+        sendRaw(F("\"\r"));
+        diagStreamPrintLn();
+        startCommand(NULL, PGMSTR(flash_ok), m_commandLatency);
+        break;
+
+    // We'll get CONNECT OK once the TCP connection is established. This is
+    // dependent on the cell network and the server itself.
+    case STEP_CONNECTED:
+        startCommand(NULL, F("CONNECT OK"), m_serverLatency, flash_connect_errors);
+        break;
+
+    // The prompt "> " means the module is ready for the request
+    case STEP_PROMPT:
+        startCommand(F("AT+CIPSEND"), NULL, m_commandLatency, flash_errors, true);
+        break;
+
+    // Wait for the caller to write the request (see sendBody)
+    case STEP_BODY:
+        break;
+
+    // Send Ctrl-Z: ((char)26). We'll get "SEND OK" if the data was sent and
+    // received by the server. If this was UDP, "SEND OK" would only mean the
+    // data was sent. Since it's TCP, that response means the server received
+    // it.
+    case STEP_SEND_OK:
+        flushInput();
+        sendRaw((char)26);
+        diagStreamPrintLn();
+        startCommand(NULL, F("SEND OK"), m_serverLatency, flash_send_errors);
+        break;
+
+    // The response will be something like:
+    // HTTP/1.1 <Status Code> <Text Description><CR><LF>other stuff
+    // pollReply passes it to m_response and finishes the step as soon as the
+    // status line and headers are in. The timeout here depends on a lot:
+    // Network connection, server, etc.
+    case STEP_RESPONSE:
+        m_response.reset();
+        startCommand(NULL, PGMSTR(flash_closed), m_serverLatency);
+        break;
+
+    // Close just the TCP connection (CIPCLOSE), keeping the bearer
+    case STEP_CLOSE_SOCKET:
+        startCommand(F("AT+CIPCLOSE"), F("CLOSE OK"), m_commandLatency);
+        break;
+
+    // Shut down the bearer (CIPSHUT)
+    case STEP_CLOSE:
+        wdt_reset();
+        startCommand(F("AT+CIPSHUT"), F("SHUT OK"), m_shutLatency);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// handle a reply in the current step
+void GprsSender::handleReply( Reply reply ) {
+    bool ok = reply == REPLY_OK;
+
+    switch(m_step){
+    case STEP_RESET_HIGH:
+        enterStep(STEP_RESET_LOW);
+        break;
+    case STEP_RESET_LOW:
+        enterStep(STEP_BOOT_WAIT);
+        break;
+    case STEP_BOOT_WAIT:
+        enterStep(STEP_AT);
+        break;
+    case STEP_AT:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(!ok && m_hwSerial && m_stepTries == 2 && !m_baudProbed){
+
+            // No reply at this rate; the module may be at the other one
+            m_baudProbed = true;
+            openSerial(m_hwBaud == m_fastBaud ? m_baud : m_fastBaud);
+            m_stepTries = 0;
+        }
+        if(!ok && ++m_stepTries < 3){
+            m_step = STEP_AT_RETRY_WAIT;
+            startCommand(NULL, NULL, 100);
+            break;
+        }
+        enterStep(STEP_ECHO_OFF);
+        break;
+    case STEP_AT_RETRY_WAIT:
+        m_step = STEP_AT;
+        flushInput(false);
+        startCommand(F("AT"), PGMSTR(flash_ok));
+        break;
+    case STEP_ECHO_OFF:
+        if(reply != REPLY_LINE){
+            enterStep(STEP_SHOW_ERRORS);
+        }
+        break;
+    case STEP_SHOW_ERRORS:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(m_hwSerial && !m_baudFailed){
+            enterStep(STEP_BAUD_SET);
+        }else{
+            setupFinished();
+        }
+        break;
+
+    // At the fast rate already, the module may only have matched it
+    // (autobaud), so the rate is set and saved anyway
+    case STEP_BAUD_SET:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(!ok){
+            diagStreamPrintLn(F("IPR Fail"));
+            m_baudFailed = true;
+            setupFinished();
+        }else if(m_hwBaud == m_fastBaud){
+            enterStep(STEP_BAUD_SAVE);
+        }else{
+            openSerial(m_fastBaud);
+            enterStep(STEP_BAUD_CHECK);
+        }
+        break;
+    case STEP_BAUD_CHECK:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_BAUD_SAVE);
+        }else if(++m_stepTries < 3){
+            flushInput(false);
+            startCommand(F("AT"), PGMSTR(flash_ok));
+        }else{
+
+            // The new rate isn't saved yet, so a reset takes the module back
+            diagStreamPrintLn(F("No reply at new baud rate"));
+            m_baudFailed = true;
+            openSerial(m_baud);
+            enterStep(STEP_RESET_HIGH);
+        }
+        break;
+    case STEP_BAUD_SAVE:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(!ok){
+            diagStreamPrintLn(F("AT&W Fail")); // (STEP_AT finds the rate)
+        }
+        setupFinished();
+        break;
+
+    // Status values from the manual:
+    // 0 = Not registered, MT is not currently searching an operator to register
+    //     to
+    // 1 = Registered, home network
+    // 2 = Not registered, but MT is currently trying to attach...
+    // 3 = Registration denied
+    // 4 = Unknown
+    // 5 = Registered, roaming
+    // 1 and 5 are considered success for our purposes
+    case STEP_REG_QUERY:
+        if(reply == REPLY_LINE){
+            if(replyStartsWith(F("+CREG: "))){
+                char *comma = strchr(m_simBuf, ',');
+                if(comma){
+                    m_regStatus = atoi(comma + 1);
+                }
+            }
+            break;
+        }
+        if(m_regStatus == 1 || m_regStatus == 5){
+            diagStreamPrint(F("status: "));
+            diagStreamPrintLn(m_regStatus);
+            m_lastErrorCode = 0;
+            finish();
+        }else if(timedOut(m_operationTimestamp)){
+            diagStreamPrint(F("status: "));
+            diagStreamPrintLn(m_regStatus);
+            diagStreamPrint(PGMSTR(flash_l_arrow));
+            diagStreamPrintLn(PGMSTR(flash_timeout));
+            m_lastErrorCode = 1;
+            finish();
+        }else{
+            enterStep(STEP_REG_WAIT);
+        }
+        break;
+    case STEP_REG_WAIT:
+        enterStep(STEP_REG_QUERY);
+        break;
+
+    case STEP_SIGNAL:
+        if(reply == REPLY_LINE){
+            if(replyStartsWith(F("+CSQ: "))){
+                m_signalStrength = atoi(m_simBuf + 6);
+            }
+            break;
+        }
+        diagStreamPrint(F("rssi: "));
+        diagStreamPrintLn(m_signalStrength);
+        if(m_sending){
+            enterStep(STEP_STATUS);
+        }else{
+            finish();
+        }
+        break;
+
+    // Pick up the bearer where it is: with an IP address, only the TCP
+    // connection is needed; a state we can't build on starts over
+    case STEP_STATUS:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(!ok){
+            diagStreamPrintLn(F("CIPSTATUS Fail"));
+            failSend(1);
+        }else if(replyStartsWith(F("STATE: IP STATUS"))
+            || replyStartsWith(F("STATE: TCP CLOSED"))
+            || replyStartsWith(F("STATE: IP CLOSE"))){
+            enterStep(STEP_CONNECT);
+        }else if(replyStartsWith(F("STATE: CONNECT OK"))){
+            enterStep(STEP_CLOSE_SOCKET); // left open; start a new request
+        }else if(replyStartsWith(F("STATE: IP GPRSACT"))){
+            enterStep(STEP_LOCAL_IP);
+        }else if(replyStartsWith(F("STATE: IP START"))){
+            enterStep(STEP_BRING_UP);
+        }else if(replyStartsWith(F("STATE: IP INITIAL"))){
+            enterStep(STEP_ATTACH);
+        }else{
+            enterStep(STEP_RESET_CONTEXT);
+        }
+        break;
+    case STEP_RESET_CONTEXT:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_ATTACH);
+        }else if(++m_stepTries < CLOSE_RETRY_COUNT){
+            wdt_reset();
+            startCommand(F("AT+CIPSHUT"), F("SHUT OK"), m_shutLatency);
+        }else{
+            diagStreamPrintLn(F("CIPSHUT Fail"));
+            failSend(1);
+        }
+        break;
+
+    case STEP_ATTACH:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_APN);
+        }else if(++m_stepTries < 2){
+
+            // If the SIM module hasn't finished registering with the network,
+            // this will fail on the first try. Protect against that here.
+            diagStreamPrintLn(F("CGATT Fail - Retrying"));
+            startCommand(F("AT+CGATT=1"), PGMSTR(flash_ok), m_bearerLatency);
+        }else{
+            diagStreamPrintLn(F("CGATT Fail"));
+            failSend(1);
+        }
+        break;
+    case STEP_APN:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_BRING_UP);
+        }else{
+            diagStreamPrintLn(F("CSTT Fail"));
+            failSend(1);
+        }
+        break;
+    case STEP_BRING_UP:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_LOCAL_IP);
+        }else{
+            diagStreamPrintLn(F("CIICR Fail"));
+            failSend(1);
+        }
+        break;
+    case STEP_LOCAL_IP:
+        if(reply == REPLY_LINE){
+            enterStep(STEP_CONNECT); // the address
+        }else{
+            diagStreamPrintLn(F("CIFSR Fail"));
+            failSend(1);
+        }
+        break;
+    case STEP_CONNECT:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_CONNECTED);
+        }else{
+            diagStreamPrintLn(F("CIPSTART Fail"));
+            failSend(1);
+        }
+        break;
+    case STEP_CONNECTED:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_PROMPT);
+        }else{
+            diagStreamPrintLn(F("TCP Fail"));
+            failSend(2);
+        }
+        break;
+    case STEP_PROMPT:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_BODY);
+        }else{
+            diagStreamPrintLn(F("CIPSEND Fail"));
+            failSend(1);
+        }
+        break;
+    case STEP_SEND_OK:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok){
+            enterStep(STEP_RESPONSE);
+        }else{
+            failSend(2);
+        }
+        break;
+    case STEP_RESPONSE:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        m_lastStatusCode = m_response.statusCode();
+        diagStreamPrint(F("status code: "));
+        diagStreamPrintLn(m_lastStatusCode);
+        if(ok && !m_response.headersComplete()){
+            m_lastErrorCode = 0; // the server closed the connection
+            finish();
+        }else{
+
+            // Don't wait for the body or for the server to close (the request
+            // asks it to); close the socket now
+            enterStep(STEP_CLOSE_SOCKET);
+        }
+        break;
+    case STEP_CLOSE_SOCKET:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(reply == REPLY_TIMEOUT){
+            diagStreamPrintLn(F("CIPCLOSE Fail"));
+            if(m_requestSent){
+                enterStep(STEP_CLOSE);
+            }else{
+                failSend(1);
+            }
+        }else if(m_requestSent || m_sendFailed){
+
+            // (an error reply means it was closed already)
+            if(!m_sendFailed){
+                m_lastErrorCode = 0;
+            }
+            finish();
+        }else{
+            enterStep(STEP_CONNECT);
+        }
+        break;
+    case STEP_CLOSE:
+        if(reply == REPLY_LINE){
+            break;
+        }
+        if(ok || ++m_stepTries >= CLOSE_RETRY_COUNT){
+
+            // A failure to close after a successful send is a GPRS error. If
+            // the send already failed, keep its error code.
+            if(!m_sendFailed){
+                m_lastErrorCode = ok ? 0 : 1;
+            }
+            finish();
+        }else{
+            wdt_reset();
+            startCommand(F("AT+CIPSHUT"), F("SHUT OK"), m_shutLatency);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// fail the running send and close the connection; a server or network error
+// keeps the bearer, a GPRS error shuts it down
+void GprsSender::failSend( int errorCode ) {
+    m_lastErrorCode = errorCode;
+    m_sendFailed = true;
+
+    // Set the count mode to true. This means calling add will count the bytes
+    // for the content-length header
+    m_dataCountMode = true;
+    clearDataLength();
+    if(m_manylabsDataAuth){
+        m_manylabsDataAuth->reset(); // Reset the auth object for the next round
+    }
+    enterStep(errorCode == 2 ? STEP_CLOSE_SOCKET : STEP_CLOSE);
+}
+
+// end the running operation
+void GprsSender::finish() {
+    m_step = STEP_IDLE;
+    m_sending = false;
+    m_finished = true;
+}
+
+// finish the module setup after a reboot
+void GprsSender::setupFinished() {
+
+    // Clear data length
+    clearDataLength();
+    m_dataCountMode = true;
+    if(m_registerAfterReboot){
+        enterStep(STEP_REG_QUERY);
+    }else{
+        m_lastErrorCode = 0;
+        finish();
+    }
+}
+
+// reopen the serial port at the given rate (see setBaudRate)
+void GprsSender::openSerial( uint32_t baud ) {
+    m_hwSerial->flush(); // wait for the last command to go out
+    m_hwSerial->begin(baud);
+    m_hwBaud = baud;
+    diagStreamPrint(F("baud: "));
+    diagStreamPrintLn(baud);
 }
 
 /**
@@ -875,6 +1785,7 @@ void GprsSender::flushInput(bool printFlushed){
     if(printed && printFlushed){
         diagStreamPrintLn();
     }
+    m_simBufPos = 0;
 }
 
 // return true if the current millis value has passed the given value that
@@ -911,153 +1822,106 @@ void GprsSender::sendRaw( T raw ) {
     diagStreamPrint(raw);
 }
 
-// wait for a reply from the SIM module
-// returns false on timeout
-bool GprsSender::waitForReply( const __FlashStringHelper *reply,
-    uint32_t timeout ) {
+// start waiting for a reply from the SIM module after sending command
+// (if not NULL)
+void GprsSender::startCommand( const __FlashStringHelper *command,
+    const __FlashStringHelper *reply, uint32_t timeout,
+    const PGM_P *errors, bool prompt ) {
 
-    // While read until timeout
-    diagStreamPrint(PGMSTR(flash_l_arrow));
-    bool found = false;
-    while(readLine(timeout) >= 0){
-
-        // Does the buffer match the reply?
-        if( strncmp_P(m_simBuf,
-            (const char*)reply, strlen_P((const char*)reply)) == 0 ){
-          found = true;
-          break;
-        }
+    if(command){
+        sendCommand(command);
     }
-    diagStreamPrintLn();
-    return found;
+    m_reply = reply;
+    m_errorMatcher.begin(errors, true);
+    m_lineFailed = false;
+    m_waitForPrompt = prompt;
+    m_commandTimestamp = millis();
+    m_replyTimestamp = m_commandTimestamp + timeout;
+    m_latency = NULL;
 }
 
-// wait for the prompt "> " from the SIM module
-// returns false on timeout
-bool GprsSender::waitForPrompt( uint32_t timeout ) {
+// the same with the timeout learned by latency
+void GprsSender::startCommand( const __FlashStringHelper *command,
+    const __FlashStringHelper *reply, LatencyTracker &latency,
+    const PGM_P *errors, bool prompt ) {
 
-    // The prompt is a bit different than other replies.
-    // It comes as "<CR><LF>> ". (That last part is the ">" character followed
-    // by a space).
-    diagStreamPrint(PGMSTR(flash_l_arrow));
-    uint32_t timestamp = millis() + timeout;
-    m_simBufPos = 0;
-    bool replyStarted = false;
-    bool foundBracket = false;
-    while(!timedOut(timestamp)){
-        while(m_serialStream->available()){
-            wdt_reset();
-            char c = m_serialStream->read();
-            if(c > 31 && c < 128){
-                diagStreamPrint(c);
-            }else{
-                diagStreamPrint(c, HEX);
-            }
-
-            if(replyStarted && (m_simBufPos < SIM_BUF_LEN)){
-                m_simBuf[m_simBufPos] = c;
-                m_simBufPos++;
-                if(foundBracket && c == ' '){
-
-                    // This is the end of the prompt
-                    m_simBuf[m_simBufPos] = 0;
-                    diagStreamPrintLn();
-                    return true;
-                }else if(c == '>'){
-                    foundBracket = true;
-                }
-            }else if(c == '\n' && m_simBufPos == 0){
-                replyStarted = true;
-            }
-        }
-    }
-    diagStreamPrintLn(PGMSTR(flash_timeout));
-    m_simBuf[m_simBufPos] = 0;
-    return false;
+    startCommand(command, reply, latency.timeout(), errors, prompt);
+    m_latency = &latency;
 }
 
-// continually checks, up to the timeout, for successful network
-// registration. depending on network conditions, this can take a while.
-//
-// returns true on success, or false on timeout.
-bool GprsSender::waitForNetworkReg(uint32_t timeout) {
-
-    // The reply to CREG is "<CR><LF>+CREG: <n>,<stat><CR><LF>"
-    // Where stat is the status which corresponds to the following (from the
-    // manual):
-    // 0 = Not registered, MT is not currently searching an operator to register
-    //     to
-    // 1 = Registered, home network
-    // 2 = Not registered, but MT is currently trying to attach...
-    // 3 = Registration denied
-    // 4 = Unknown
-    // 5 = Registered, roaming
+// read what the SIM module has sent so far without blocking and check it
+// against the command started by startCommand
+GprsSender::Reply GprsSender::pollReply() {
+    bool waiting = m_reply || m_waitForPrompt;
+    while(m_serialStream->available()){
+        wdt_reset();
+        char c = m_serialStream->read();
+        if(!waiting){
+            continue; // only waiting for time to pass; discard
+        }
+        if(c > 31 && c < 128){
+            diagStreamPrint(c);
+        }else{
+            diagStreamPrint(c, HEX);
+        }
+        if(m_step == STEP_RESPONSE && m_response.parse(c)){
+            diagStreamPrintLn();
+            return REPLY_OK; // the status line and headers are in
+        }
 
-    // 1 and 5 are considered success for our purposes
+        // An error is reported at the end of its line (the modem sends the
+        // rest at once), so the rest isn't taken for the next reply
+        if(m_errorMatcher.match(c) >= 0){
+            m_lineFailed = true;
+        }
 
-    uint32_t timestamp = millis() + timeout;
-    int statusCode = -1;
-    bool success = false;
-    while(!success && !timedOut(timestamp)){
-        sendCommand(F("AT+CREG?"));
-        delayAndWdtReset(DEFAULT_TIMEOUT_MS);
-        if(m_serialStream->find("+CREG: ")){
-            if(m_serialStream->find(",")){
-                statusCode = m_serialStream->parseInt();
-                if(statusCode == 1 || statusCode == 5){
-                    success = true;
-                }
+        // The replies come as <CR><LF>reply<CR><LF>
+        if(c == '\n'){
+            if(m_simBufPos == 0){
+                continue; // the start of a reply
+            }
+            m_simBuf[m_simBufPos] = 0;
+            m_simBufPos = 0;
+            diagStreamPrintLn();
+            bool failed = m_lineFailed;
+            m_lineFailed = false;
+            if(m_reply && replyStartsWith(m_reply)){
+                return REPLY_OK;
             }
+            return failed ? REPLY_ERROR : REPLY_LINE;
+        }else if(c != '\r' && m_simBufPos < SIM_BUF_LEN - 1){
+            m_simBuf[m_simBufPos] = c;
+            m_simBufPos++;
+        }
+
+        // The prompt is a bit different than other replies.
+        // It comes as "<CR><LF>> ". (That last part is the ">" character
+        // followed by a space).
+        if(m_waitForPrompt && m_simBufPos == 2
+            && m_simBuf[0] == '>' && m_simBuf[1] == ' '){
+            m_simBuf[m_simBufPos] = 0;
+            m_simBufPos = 0;
+            diagStreamPrintLn();
+            return REPLY_OK;
         }
     }
-    flushInput(false); // Flush the reset of the response
-    diagStreamPrint(F("status: "));
-    diagStreamPrintLn(statusCode);
-    if(!success){
+    if(timedOut(m_replyTimestamp)){
+        if(!waiting){
+            return REPLY_OK;
+        }
         diagStreamPrint(PGMSTR(flash_l_arrow));
         diagStreamPrintLn(PGMSTR(flash_timeout));
+        m_simBuf[m_simBufPos] = 0;
+        m_simBufPos = 0;
+        return REPLY_TIMEOUT;
     }
-    return success;
+    return REPLY_NONE;
 }
 
-// returns signal strength (RSSI). according to the SIM module information,
-// the values essentially go from 0-31 with higher being better. the value
-// 99 is reserved for "not known" or "not detectable". reproduced here:
-//
-// 0:    -115 dBm or less
-// 1:    -111 dBm
-// 2-30: -110 ... -54 dBm
-// 31:   -52 dBm or greater
-// 99:   not known or not detectable
-int GprsSender::signalStrength( uint32_t timeout ) {
-
-    // The response will be something like: +CSQ: <rssi>,<ber>
-    // We're looking for the rssi value
-    int signalStrength = -1;
-    sendCommand(F("AT+CSQ"));
-
-    uint32_t timestamp = millis() + timeout;
-    while( !timedOut(timestamp) ){
-        if(m_serialStream->find("+CSQ: ")){
-            signalStrength = m_serialStream->parseInt();
-        }
-    }
-
-    flushInput(false); // Flush the reset of the response
-
-    diagStreamPrint(F("rssi: "));
-    diagStreamPrintLn(signalStrength);
-
-    return signalStrength;
-}
-
-// send a command and then wait for the reply
-// returns false on timeout
-bool GprsSender::sendCommandWaitForReply(const __FlashStringHelper *command,
-    const __FlashStringHelper *reply, uint32_t timeout ) {
-
-    sendCommand(command);
-    return waitForReply(reply, timeout);
+// returns true if the string in m_simBuf starts with the given flash string
+bool GprsSender::replyStartsWith( const __FlashStringHelper *prefix ) {
+    return strncmp_P(m_simBuf,
+        (const char*)prefix, strlen_P((const char*)prefix)) == 0;
 }
 
 // delay and reset the watchdog timer as we go
@@ -1079,64 +1943,4 @@ void GprsSender::delayAndWdtReset(uint32_t ms) {
     delay(ms);
 }
 
-// Reads a line formatted <CR><LF>reply<CR><LF> from the SIM module
-// returns the number of bytes read or -1 on timeout
-int GprsSender::readLine(uint32_t timeout) {
-    uint32_t timestamp = millis() + timeout;
-    m_simBufPos = 0;
-    bool replyStarted = false;
-    while(!timedOut(timestamp)){
-        while(m_serialStream->available()){
-            wdt_reset();
-            char c = m_serialStream->read();
-            if(c > 31 && c < 128){
-                diagStreamPrint(c);
-            }else{
-                diagStreamPrint(c, HEX);
-            }
-
-            // The replies come as <CR><LF>reply<CR><LF>
-            if(replyStarted && (m_simBufPos < SIM_BUF_LEN)){
-                if(c == '\n'){
-                    m_simBuf[m_simBufPos] = 0;
-                    return m_simBufPos;
-                }else if(c != '\r'){
-                    m_simBuf[m_simBufPos] = c;
-                    m_simBufPos++;
-                }
-            }else if(c == '\n' && m_simBufPos == 0){
-                replyStarted = true;
-            }
-        }
-    }
-    diagStreamPrintLn(PGMSTR(flash_timeout));
-    m_simBuf[m_simBufPos] = 0;
-    return -1;
-}
-
-// attempts to parse the HTTP status code from the server response
-int GprsSender::readStatusCode(uint32_t timeout) {
-
-    // The response will be something like:
-    // HTTP/1.1 <Status Code> <Text Description><CR><LF>other stuff
-    // We're just going to look for a number that's greater than 100 and less
-    // than 600
-    int statusCode = -1;
-
-    uint32_t timestamp = millis() + timeout;
-    while( !timedOut(timestamp) ){
-        if(m_serialStream->find("HTTP/1.1 ")){
-            statusCode = m_serialStream->parseInt();
-        }
-    }
-
-    flushInput(false); // Flush the reset of the response
-
-    if(statusCode < 100 || statusCode > 600){
-        return -1;
-    }
-
-    return statusCode;
-}
-
 #endif // _MANYLABS_GPRS_SENDER_H_
@@ -0,0 +1,139 @@
+// Manylabs HttpResponse Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library provides an incremental parser for HTTP/1.x responses, so a
+// sender can act on the status as soon as the response head has arrived
+// instead of waiting for the server to close the connection.
+#ifndef _MANYLABS_HTTP_RESPONSE_H_
+#define _MANYLABS_HTTP_RESPONSE_H_
+#include "Arduino.h"
+
+
+// longest response line kept; the rest of a longer line is ignored (the
+// headers we look at are much shorter)
+#define HTTP_RESPONSE_LINE_LEN 32
+
+
+// The HttpResponseParser class reads a response one byte at a time, as the
+// bytes arrive from the module. Anything before the status line (such as
+// modem messages) is skipped. parse() returns true once the status line and
+// headers are complete; the bytes after that are counted as body, so
+// complete() tells when a body of Content-Length bytes has been received.
+class HttpResponseParser {
+public:
+
+	// create a new HttpResponseParser object, ready for a response
+	HttpResponseParser() {
+		reset();
+	}
+
+	// get ready for the next response
+	void reset() {
+		_part = PART_STATUS;
+		_lineLen = 0;
+		_statusCode = -1;
+		_contentLength = -1;
+		_bodyLeft = -1;
+		_keepAlive = false;
+		_retryAfter = 0;
+	}
+
+	// pass the next byte of the response; returns true once, when the status
+	// line and headers are complete
+	bool parse( char c ) {
+		if (_part == PART_BODY) {
+			if (_bodyLeft > 0)
+				_bodyLeft--;
+			return false;
+		}
+		if (c != '\n') {
+			if (c != '\r' && _lineLen < HTTP_RESPONSE_LINE_LEN - 1)
+				_line[ _lineLen++ ] = c;
+			return false;
+		}
+		_line[ _lineLen ] = 0;
+		byte length = _lineLen;
+		_lineLen = 0;
+
+		// the status line, e.g. "HTTP/1.1 201 CREATED"
+		if (_part == PART_STATUS) {
+			if (length >= 12 && strncmp_P( _line, PSTR( "HTTP/1." ), 7 ) == 0) {
+				_statusCode = atoi( _line + 9 );
+				_keepAlive = _line[ 7 ] != '0'; // the default since HTTP/1.1
+				_part = PART_HEADERS;
+			}
+			return false;
+		}
+
+		// a blank line ends the headers; an interim (1xx) response is followed
+		// by the real one
+		if (length == 0) {
+			if (_statusCode < 200) {
+				reset();
+				return false;
+			}
+			_part = PART_BODY;
+			_bodyLeft = (_statusCode == 204 || _statusCode == 304) ? 0 : _contentLength;
+			return true;
+		}
+		const char *value;
+		if ((value = headerValue( PSTR( "Content-Length:" ) )) != NULL) {
+			_contentLength = atol( value );
+		} else if ((value = headerValue( PSTR( "Connection:" ) )) != NULL) {
+			if (strncasecmp_P( value, PSTR( "close" ), 5 ) == 0)
+				_keepAlive = false;
+			else if (strncasecmp_P( value, PSTR( "keep-alive" ), 10 ) == 0)
+				_keepAlive = true;
+		} else if ((value = headerValue( PSTR( "Retry-After:" ) )) != NULL) {
+			_retryAfter = strtoul( value, NULL, 10 ); // 0 for the HTTP-date form
+		}
+		return false;
+	}
+
+	// true once the status line and headers have been received
+	inline bool headersComplete() const { return _part == PART_BODY; }
+
+	// true once the body has been received as well; never true for a body
+	// without Content-Length, which ends when the connection closes
+	inline bool complete() const { return _part == PART_BODY && _bodyLeft == 0; }
+
+	// the status code (-1 until the status line has been received)
+	inline int statusCode() const { return _statusCode; }
+
+	// the Content-Length header (-1 if there is none)
+	inline long contentLength() const { return _contentLength; }
+
+	// false if the server will close the connection after this response
+	inline bool keepAlive() const { return _keepAlive; }
+
+	// the Retry-After header in seconds (0 if there is none)
+	inline unsigned long retryAfter() const { return _retryAfter; }
+
+private:
+
+	// if the current line is the given header (a flash string ending in ':',
+	// matched in any case), returns its value without leading spaces
+	const char *headerValue( PGM_P name ) const {
+		size_t length = strlen_P( name );
+		if (strncasecmp_P( _line, name, length ))
+			return NULL;
+		const char *value = _line + length;
+		while (*value == ' ')
+			value++;
+		return value;
+	}
+
+	enum { PART_STATUS, PART_HEADERS, PART_BODY };
+
+	byte _part;
+	char _line[ HTTP_RESPONSE_LINE_LEN ];
+	byte _lineLen;
+	int _statusCode;
+	long _contentLength;
+	long _bodyLeft;
+	bool _keepAlive;
+	unsigned long _retryAfter;
+};
+
+
+#endif // _MANYLABS_HTTP_RESPONSE_H_
@@ -0,0 +1,61 @@
+// Manylabs HttpResponse example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example feeds canned responses to the parser and checks what it finds.
+
+#include "HttpResponse.h"
+#include "TestReport.h"
+
+HttpResponseParser parser;
+TestReport report;
+
+// feed a response; returns the number of bytes used when the head was
+// complete (or -1 if it never was)
+int feed( const char *response ) {
+    parser.reset();
+    int done = -1;
+    for (int i = 0; response[i]; i++) {
+        if (parser.parse(response[i])) {
+            done = i + 1;
+        }
+    }
+    return done;
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+
+    // the head is complete at the blank line, before the body
+    const char *created = "HTTP/1.1 201 CREATED\r\nContent-Length: 2\r\nContent-Type: text/plain\r\n\r\nok";
+    report.check("created head", feed(created), strlen(created) - 2);
+    report.check("created status", parser.statusCode(), 201);
+    report.check("created length", parser.contentLength(), 2);
+    report.check("created keep-alive", parser.keepAlive(), 1);
+    report.check("created complete", parser.complete(), 1);
+
+    // modem output before the status line is skipped; header names match in
+    // any case
+    feed("\r\nSEND OK\r\nHTTP/1.1 503 Service Unavailable\r\nconnection: close\r\nRETRY-AFTER: 120\r\n\r\n");
+    report.check("busy status", parser.statusCode(), 503);
+    report.check("busy keep-alive", parser.keepAlive(), 0);
+    report.check("busy retry", parser.retryAfter(), 120);
+    report.check("busy complete", parser.complete(), 0);
+
+    // an interim response is followed by the real one
+    feed("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.0 200 OK\r\n\r\n");
+    report.check("continue status", parser.statusCode(), 200);
+    report.check("continue keep-alive", parser.keepAlive(), 0);
+    report.check("continue length", parser.contentLength(), -1);
+
+    // a response cut off in the headers
+    report.check("partial head", feed("HTTP/1.1 201 CREATED\r\nContent-Le"), -1);
+    report.check("partial status", parser.statusCode(), 201);
+    report.check("partial headers", parser.headersComplete(), 0);
+
+    report.end();
+}
+
+void loop() {
+}
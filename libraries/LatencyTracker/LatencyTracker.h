@@ -0,0 +1,89 @@
+// Manylabs LatencyTracker Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library learns how long a class of commands takes to get a reply and
+// derives the timeout for the next command from it, the way TCP sets its
+// retransmission timeout (RFC 6298).
+#ifndef _MANYLABS_LATENCY_TRACKER_H_
+#define _MANYLABS_LATENCY_TRACKER_H_
+#include "Arduino.h"
+
+
+// The LatencyTracker class keeps a moving average of the reply times (each
+// new one weighs 1/8) and of their deviation from it (each new one weighs
+// 1/4). The timeout is the average plus four deviations, within the given
+// bounds; until the first reply it is the initial timeout. Each timeout
+// doubles it until the next reply, so a slower link is picked up quickly.
+class LatencyTracker {
+public:
+
+	// create a new LatencyTracker object; all times are in ms
+	LatencyTracker( unsigned long initialTimeout, unsigned long minTimeout, unsigned long maxTimeout ) {
+		_initialTimeout = initialTimeout;
+		_minTimeout = minTimeout;
+		_maxTimeout = maxTimeout;
+		_average8 = 0;
+		_deviation4 = 0;
+		_samples = 0;
+		_backoff = 0;
+	}
+
+	// add the time a reply took
+	void add( unsigned long ms ) {
+		if (ms > _maxTimeout)
+			ms = _maxTimeout;
+		if (_samples == 0) {
+			_average8 = ms << 3;
+			_deviation4 = ms << 1; // half of it
+		} else {
+			long delta = (long) ms - (long) (_average8 >> 3);
+			if (delta < 0)
+				delta = -delta;
+			_average8 = _average8 - (_average8 >> 3) + ms;
+			_deviation4 = _deviation4 - (_deviation4 >> 2) + delta;
+		}
+		if (_samples < 65535)
+			_samples++;
+		_backoff = 0;
+	}
+
+	// note that no reply arrived before timeout()
+	void addTimeout() {
+		if (_backoff < 8)
+			_backoff++;
+	}
+
+	// the time to wait for the next reply
+	unsigned long timeout() const {
+		unsigned long ms = _initialTimeout;
+		if (_samples)
+			ms = (_average8 >> 3) + _deviation4;
+		if (ms < _minTimeout)
+			ms = _minTimeout;
+		ms <<= _backoff;
+		if (ms > _maxTimeout)
+			ms = _maxTimeout;
+		return ms;
+	}
+
+	// the average reply time in ms (0 before the first reply)
+	inline unsigned long average() const { return _average8 >> 3; }
+
+	// the average deviation from it in ms
+	inline unsigned long deviation() const { return _deviation4 >> 2; }
+
+	// the number of replies added (up to 65535)
+	inline unsigned int samples() const { return _samples; }
+
+private:
+	unsigned long _initialTimeout;
+	unsigned long _minTimeout;
+	unsigned long _maxTimeout;
+	unsigned long _average8; // the average times 8
+	unsigned long _deviation4; // the deviation times 4
+	unsigned int _samples;
+	byte _backoff; // timeouts since the last reply
+};
+
+
+#endif // _MANYLABS_LATENCY_TRACKER_H_
@@ -0,0 +1,51 @@
+// Manylabs LatencyTracker example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example adds some reply times and timeouts and checks the timeouts
+// the tracker derives from them.
+
+#include "LatencyTracker.h"
+#include "TestReport.h"
+
+LatencyTracker latency( 2000, 500, 6000 );
+TestReport report;
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+
+    // the initial timeout until the first reply
+    report.check("initial", latency.timeout(), 2000);
+
+    // the first reply sets the average and half of it as the deviation
+    latency.add( 400 );
+    report.check("first average", latency.average(), 400);
+    report.check("first deviation", latency.deviation(), 200);
+    report.check("first timeout", latency.timeout(), 1200);
+
+    // steady replies bring the timeout down to the floor
+    for (int i = 0; i < 40; i++) {
+        latency.add( 100 );
+    }
+    report.check("steady average", latency.average(), 101); // (rounding keeps it just above)
+    report.check("steady timeout", latency.timeout(), 500);
+
+    // each timeout doubles it, up to the ceiling
+    latency.addTimeout();
+    report.check("one timeout", latency.timeout(), 1000);
+    latency.addTimeout();
+    latency.addTimeout();
+    latency.addTimeout();
+    report.check("four timeouts", latency.timeout(), 6000);
+
+    // a slow reply ends the backoff and raises the average
+    latency.add( 1000 );
+    report.check("slow average", latency.average(), 214);
+    report.check("slow timeout", latency.timeout(), 1123);
+
+    report.end();
+}
+
+void loop() {
+}
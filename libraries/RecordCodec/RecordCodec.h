@@ -0,0 +1,294 @@
+// Manylabs RecordCodec Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library packs rows of fixed-point values (e.g. samples) into a compact
+// binary payload and unpacks them again. It builds for the Arduino and for a
+// host (e.g. the server or tools/decode_records.cpp), so both sides share the
+// format; tools/record_codec_test.cpp tests it there.
+//
+// A payload is a schema id byte, the number of fields per record (a varint)
+// and then the records. Each field of a record is the difference from the same
+// field of the previous record (of 0 for the first one), zigzag-encoded so
+// small negative differences stay small, as a varint: 7 bits per byte, low
+// bits first, with the top bit set on all bytes but the last. Slowly changing
+// values (times a fixed period apart, temperatures, ratios) mostly take one
+// or two bytes. The schema id tells the reader what the fields are and how
+// they are scaled; the payload itself doesn't.
+//
+// For an HTTP form value, the payload is written as base64url without padding
+// (A-Z a-z 0-9 - _), which needs no escaping.
+#ifndef _MANYLABS_RECORD_CODEC_H_
+#define _MANYLABS_RECORD_CODEC_H_
+#ifdef ARDUINO
+#include "Arduino.h"
+#else
+#include <stdint.h>
+typedef uint8_t byte;
+#endif
+
+
+// most fields per record
+#define RECORD_MAX_FIELDS 24
+
+
+// bytes a field can take at most (a 32-bit varint)
+#define RECORD_MAX_FIELD_SIZE 5
+
+
+// chars of the base64 text of a payload of n bytes, with the terminating 0
+#define RECORD_BASE64_SIZE( n ) (((n) * 4 + 2) / 3 + 1)
+
+
+// The RecordEncoder class writes a payload into a byte buffer. Start it with
+// start(), then add each record with startRecord(), one add() per field and
+// endRecord(). A record that doesn't fit is left out, and so are all records
+// after it, so the payload always holds whole records.
+class RecordEncoder {
+public:
+
+	// create a new RecordEncoder object writing to the given buffer
+	RecordEncoder( byte *buffer, unsigned int size ) {
+		_buffer = buffer;
+		_size = size;
+		start( 0, 0 );
+	}
+
+	// start a new payload; returns false if fieldCount is 0 or too large or
+	// the buffer too small
+	bool start( byte schema, byte fieldCount ) {
+		_length = 0;
+		_fieldCount = fieldCount;
+		_full = fieldCount == 0 || fieldCount > RECORD_MAX_FIELDS || _size < 2;
+		_records = 0;
+		if (_full)
+			return false;
+		for (byte i = 0; i < fieldCount; i++)
+			_previous[ i ] = 0;
+		_buffer[ _length++ ] = schema;
+		writeVarint( fieldCount );
+		_recordStart = _length;
+		_field = 0;
+		return true;
+	}
+
+	// start a record
+	void startRecord() {
+		_recordStart = _length;
+		_field = 0;
+	}
+
+	// add the next field of the record
+	void add( int32_t value ) {
+		if (_full || _field >= _fieldCount)
+			return;
+		uint32_t delta = (uint32_t) value - (uint32_t) _previous[ _field ];
+		_previous[ _field++ ] = value;
+		int32_t signedDelta = (int32_t) delta;
+		writeVarint( ((uint32_t) signedDelta << 1) ^ (uint32_t) (signedDelta >> 31) );
+	}
+
+	// finish the record; returns false (and drops it) if it didn't fit or
+	// didn't have all fields
+	bool endRecord() {
+		if (_full || _field != _fieldCount) {
+			_full = true;
+			_length = _recordStart;
+			return false;
+		}
+		_records++;
+		return true;
+	}
+
+	// the payload so far
+	inline const byte *data() const { return _buffer; }
+
+	// bytes of the payload so far
+	inline unsigned int length() const { return _length; }
+
+	// records in the payload
+	inline unsigned int records() const { return _records; }
+
+	// true once a record has been dropped; later records are dropped too
+	inline bool full() const { return _full; }
+
+	// write data as base64url text with a terminating 0 (RECORD_BASE64_SIZE(
+	// length ) chars); returns its length
+	static unsigned int toBase64( const byte *data, unsigned int length, char *text ) {
+		static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+		unsigned int pos = 0;
+		for (unsigned int i = 0; i < length; i += 3) {
+			uint32_t bits = (uint32_t) data[ i ] << 16;
+			if (i + 1 < length)
+				bits |= (uint32_t) data[ i + 1 ] << 8;
+			if (i + 2 < length)
+				bits |= data[ i + 2 ];
+			text[ pos++ ] = digits[ (bits >> 18) & 63 ];
+			text[ pos++ ] = digits[ (bits >> 12) & 63 ];
+			if (i + 1 < length)
+				text[ pos++ ] = digits[ (bits >> 6) & 63 ];
+			if (i + 2 < length)
+				text[ pos++ ] = digits[ bits & 63 ];
+		}
+		text[ pos ] = 0;
+		return pos;
+	}
+
+private:
+
+	// write a varint; marks the payload full if it doesn't fit
+	void writeVarint( uint32_t value ) {
+		do {
+			if (_length >= _size) {
+				_full = true;
+				return;
+			}
+			byte b = value & 0x7F;
+			value >>= 7;
+			_buffer[ _length++ ] = value ? b | 0x80 : b;
+		} while (value);
+	}
+
+	byte *_buffer;
+	unsigned int _size;
+	unsigned int _length;
+	unsigned int _recordStart; // length at the start of the current record
+	unsigned int _records;
+	byte _fieldCount;
+	byte _field; // fields of the current record added so far
+	bool _full;
+	int32_t _previous[ RECORD_MAX_FIELDS ]; // the fields of the last record
+};
+
+
+// The RecordDecoder class reads the records back from a payload. Call
+// start() to read the schema and field count, then next() for each record.
+class RecordDecoder {
+public:
+
+	// create a new RecordDecoder object reading the given payload
+	RecordDecoder( const byte *data, unsigned int length ) {
+		_data = data;
+		_length = length;
+		_pos = 0;
+		_schema = 0;
+		_fieldCount = 0;
+		_error = false;
+	}
+
+	// read the schema id and the field count; returns false if the payload is
+	// malformed (records of 0 fields take no bytes, so a payload with a field
+	// count of 0 must end after it)
+	bool start() {
+		_pos = 0;
+		_fieldCount = 0;
+		_error = true;
+		if (_length == 0)
+			return false;
+		_schema = _data[ _pos++ ];
+		uint32_t fieldCount = 0;
+		if (!readVarint( fieldCount ) || fieldCount > RECORD_MAX_FIELDS || (fieldCount == 0 && _pos < _length))
+			return false;
+		_error = false;
+		_fieldCount = fieldCount;
+		for (byte i = 0; i < _fieldCount; i++)
+			_previous[ i ] = 0;
+		return true;
+	}
+
+	// read the next record into values (fieldCount() of them); returns false
+	// at the end of the payload or if it is malformed (see error())
+	bool next( int32_t *values ) {
+		if (_error || _pos >= _length || _fieldCount == 0)
+			return false;
+		for (byte i = 0; i < _fieldCount; i++) {
+			uint32_t zigzag = 0;
+			if (!readVarint( zigzag )) {
+				_error = true;
+				return false;
+			}
+			uint32_t delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+			_previous[ i ] = (int32_t) ((uint32_t) _previous[ i ] + delta);
+			values[ i ] = _previous[ i ];
+		}
+		return true;
+	}
+
+	// the schema id of the payload
+	inline byte schema() const { return _schema; }
+
+	// fields per record
+	inline byte fieldCount() const { return _fieldCount; }
+
+	// true if the payload was malformed (cut short or too many fields)
+	inline bool error() const { return _error; }
+
+	// read base64url text (with or without padding) into data; returns the
+	// number of bytes or -1 if the text is invalid or longer than size
+	static int fromBase64( const char *text, byte *data, unsigned int size ) {
+		unsigned int length = 0;
+		uint32_t bits = 0;
+		byte count = 0;
+		for (; *text && *text != '='; text++) {
+			char c = *text;
+			int digit;
+			if (c >= 'A' && c <= 'Z')
+				digit = c - 'A';
+			else if (c >= 'a' && c <= 'z')
+				digit = c - 'a' + 26;
+			else if (c >= '0' && c <= '9')
+				digit = c - '0' + 52;
+			else if (c == '-' || c == '+')
+				digit = 62;
+			else if (c == '_' || c == '/')
+				digit = 63;
+			else
+				return -1;
+			bits = (bits << 6) | digit;
+			if (++count == 4) {
+				if (length + 3 > size)
+					return -1;
+				data[ length++ ] = bits >> 16;
+				data[ length++ ] = bits >> 8;
+				data[ length++ ] = bits;
+				bits = 0;
+				count = 0;
+			}
+		}
+		if (count == 1 || length + (count ? count - 1 : 0) > size)
+			return -1;
+		if (count == 2) {
+			data[ length++ ] = bits >> 4;
+		} else if (count == 3) {
+			data[ length++ ] = bits >> 10;
+			data[ length++ ] = bits >> 2;
+		}
+		return length;
+	}
+
+private:
+
+	// read a varint; returns false if the payload ends in it or it is too long
+	bool readVarint( uint32_t &value ) {
+		value = 0;
+		for (byte shift = 0; shift < 35; shift += 7) {
+			if (_pos >= _length)
+				return false;
+			byte b = _data[ _pos++ ];
+			value |= (uint32_t) (b & 0x7F) << shift;
+			if ((b & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	const byte *_data;
+	unsigned int _length;
+	unsigned int _pos;
+	byte _schema;
+	byte _fieldCount;
+	bool _error;
+	int32_t _previous[ RECORD_MAX_FIELDS ]; // the fields of the last record
+};
+
+
+#endif // _MANYLABS_RECORD_CODEC_H_
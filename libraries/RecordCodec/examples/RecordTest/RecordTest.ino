@@ -0,0 +1,108 @@
+// Manylabs RecordCodec example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example packs some sample rows, writes them as base64 and reads them
+// back, checking that every value survives and how small the payload is.
+
+#include "RecordCodec.h"
+#include "TestReport.h"
+
+#define FIELD_COUNT 7
+#define ROW_COUNT 6
+
+// time, missed, temperature (tenths), humidity (tenths), three dust ratios
+// (65535 = 1), like the DustSystem sketch's samples
+const long rows[ ROW_COUNT ][ FIELD_COUNT ] = {
+    { 3600, 0, 215, 452, 812, 65535, 0 },
+    { 3660, 0, 214, 455, 790, 64012, 3 },
+    { 3720, 0, 212, 455, 1210, 65535, 0 },
+    { 3840, 1, -32768, -32768, 1003, 60111, 0 }, // a missed window, no reading
+    { 3900, 0, -12, 980, 0, 0, 0 },
+    { 3960, 255, 2147483647L, -2147483647L - 1, 65535, 1, 65535 },
+};
+
+byte payload[ 2 + ROW_COUNT * FIELD_COUNT * RECORD_MAX_FIELD_SIZE ];
+char text[ RECORD_BASE64_SIZE( sizeof( payload ) ) ];
+byte decoded[ sizeof( payload ) ];
+unsigned int packedLength = 0;
+TestReport report;
+
+// pack the first count rows into the first size bytes of payload; returns
+// the records packed
+int pack( unsigned int size, int count ) {
+    RecordEncoder encoder( payload, size );
+    encoder.start( 1, FIELD_COUNT );
+    for (int r = 0; r < count; r++) {
+        encoder.startRecord();
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            encoder.add( rows[ r ][ f ] );
+        }
+        encoder.endRecord();
+    }
+    packedLength = encoder.length();
+    return encoder.records();
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+
+    // the typical rows take about two bytes per field
+    report.check("typical records", pack( sizeof( payload ), 3 ), 3);
+    report.check("small", packedLength <= 2 + 3 * FIELD_COUNT * 2, 1);
+
+    // all rows survive base64 and decoding, including the extremes
+    report.check("records", pack( sizeof( payload ), ROW_COUNT ), ROW_COUNT);
+    unsigned int length = RecordEncoder::toBase64( payload, packedLength, text );
+    report.check("text length", length, (packedLength * 4 + 2) / 3);
+    Serial.println(text);
+    int decodedLength = RecordDecoder::fromBase64( text, decoded, sizeof( decoded ) );
+    report.check("decoded length", decodedLength, packedLength);
+    RecordDecoder decoder( decoded, decodedLength );
+    report.check("decoder start", decoder.start(), 1);
+    report.check("schema", decoder.schema(), 1);
+    report.check("fields", decoder.fieldCount(), FIELD_COUNT);
+    int32_t values[ RECORD_MAX_FIELDS ];
+    int r = 0;
+    int wrong = 0;
+    while (decoder.next( values )) {
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            if (r >= ROW_COUNT || values[ f ] != rows[ r ][ f ]) {
+                wrong++;
+            }
+        }
+        r++;
+    }
+    report.check("rows read", r, ROW_COUNT);
+    report.check("wrong values", wrong, 0);
+    report.check("decode error", decoder.error(), 0);
+
+    // a record that doesn't fit is dropped with all after it
+    report.check("cut", pack( 2 + FIELD_COUNT * 2, ROW_COUNT ), 1);
+
+    // a payload cut short in a record is an error
+    RecordDecoder shortDecoder( decoded, decodedLength - 1 );
+    shortDecoder.start();
+    r = 0;
+    while (shortDecoder.next( values )) {
+        r++;
+    }
+    report.check("short rows", r, ROW_COUNT - 1);
+    report.check("short error", shortDecoder.error(), 1);
+
+    // base64 of each length of the last group
+    byte bytes[] = { 0xFB, 0xFF, 0x00, 0x7E };
+    for (unsigned int n = 0; n <= sizeof( bytes ); n++) {
+        RecordEncoder::toBase64( bytes, n, text );
+        byte back[ 4 ];
+        int backLength = RecordDecoder::fromBase64( text, back, sizeof( back ) );
+        report.check("base64", backLength == (int) n && memcmp( back, bytes, n ) == 0, 1);
+    }
+    report.check("invalid", RecordDecoder::fromBase64( "ab*d", decoded, sizeof( decoded ) ), -1);
+
+    report.end();
+}
+
+void loop() {
+}
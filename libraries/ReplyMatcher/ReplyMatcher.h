@@ -0,0 +1,90 @@
+// Manylabs ReplyMatcher Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library watches the bytes received from a module for any of a set of
+// reply patterns, so a command can fail on an error reply as soon as it
+// arrives instead of when its timeout expires.
+#ifndef _MANYLABS_REPLY_MATCHER_H_
+#define _MANYLABS_REPLY_MATCHER_H_
+#include "Arduino.h"
+
+
+// number of received chars kept; longer patterns never match (and longer
+// strings passed to endsWith() are compared by their last chars)
+#define REPLY_MATCHER_WINDOW 16
+
+
+// The ReplyMatcher class is fed the received bytes one at a time. The
+// patterns are a table in flash of flash strings, ending with NULL, e.g.:
+//
+//   const char replyError[] PROGMEM = "ERROR";
+//   const char replyFail[] PROGMEM = "SEND FAIL";
+//   PGM_P const sendErrors[] PROGMEM = { replyError, replyFail, NULL };
+//
+// match() returns the index of a pattern on the byte that completes it. Only
+// the last chars are kept, so each byte costs one flash read per pattern
+// (plus a compare when the pattern's last char arrives).
+class ReplyMatcher {
+public:
+
+	// create a new ReplyMatcher object with no patterns
+	ReplyMatcher() {
+		begin( NULL );
+	}
+
+	// start watching for the given patterns (may be NULL); with lineStart, a
+	// pattern only matches at the start of a line
+	void begin( const PGM_P *patterns, bool lineStart = false ) {
+		_patterns = patterns;
+		_lineStart = lineStart;
+		_windowLen = 0;
+		_linePos = 0;
+	}
+
+	// pass the next received byte; returns the index of the pattern it
+	// completes, or -1
+	int8_t match( char c ) {
+		if (_windowLen == REPLY_MATCHER_WINDOW)
+			memmove( _window, _window + 1, --_windowLen );
+		_window[ _windowLen++ ] = c;
+		if (c == '\r' || c == '\n') {
+			_linePos = 0;
+			return -1;
+		}
+		if (_linePos < 255)
+			_linePos++;
+		if (_patterns == NULL)
+			return -1;
+		for (int8_t i = 0; ; i++) {
+			PGM_P pattern = (PGM_P) pgm_read_word( _patterns + i );
+			if (pattern == NULL)
+				return -1;
+			byte length = strlen_P( pattern );
+			if (length == 0 || length > _windowLen || (_lineStart && length != _linePos))
+				continue;
+			if ((char) pgm_read_byte( pattern + length - 1 ) == c
+				&& memcmp_P( _window + _windowLen - length, pattern, length ) == 0)
+				return i;
+		}
+	}
+
+	// returns true if the received chars end with the given string (in RAM)
+	bool endsWith( const char *s ) const {
+		size_t length = strlen( s );
+		if (length > REPLY_MATCHER_WINDOW) {
+			s += length - REPLY_MATCHER_WINDOW;
+			length = REPLY_MATCHER_WINDOW;
+		}
+		return length <= _windowLen && memcmp( _window + _windowLen - length, s, length ) == 0;
+	}
+
+private:
+	const PGM_P *_patterns;
+	bool _lineStart;
+	char _window[ REPLY_MATCHER_WINDOW ];
+	byte _windowLen;
+	byte _linePos; // chars since the start of the line (up to 255)
+};
+
+
+#endif // _MANYLABS_REPLY_MATCHER_H_
@@ -0,0 +1,54 @@
+// Manylabs ReplyMatcher example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example feeds canned module output to the matcher and checks where
+// each pattern is found.
+
+#include "ReplyMatcher.h"
+#include "TestReport.h"
+
+const char replyError[] PROGMEM = "ERROR";
+const char replySendFail[] PROGMEM = "SEND FAIL";
+const char replyClosed[] PROGMEM = "CLOSED";
+PGM_P const sendErrors[] PROGMEM = { replyError, replySendFail, replyClosed, NULL };
+
+ReplyMatcher matcher;
+TestReport report;
+
+// feed some output; returns the index of the first pattern found times 100
+// plus the number of bytes used to find it (or -1 if none was found)
+int feed( const char *output, bool lineStart ) {
+    matcher.begin(sendErrors, lineStart);
+    for (int i = 0; output[i]; i++) {
+        int8_t index = matcher.match(output[i]);
+        if (index >= 0) {
+            return index * 100 + i + 1;
+        }
+    }
+    return -1;
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+
+    // found on the byte that completes it, before the end of the line
+    report.check("send fail", feed("\r\nSEND FAIL\r\n", false), 100 + 11);
+    report.check("closed", feed("\r\nSEND OK\r\nCLOSED\r\n", false), 200 + 17);
+
+    // at the start of a line only
+    report.check("anywhere", feed("\r\n+CME ERROR: 3\r\n", false), 0 + 12);
+    report.check("line start", feed("\r\n+CME ERROR: 3\r\n", true), -1);
+    report.check("next line", feed("CONNECT FAIL\r\nERROR\r\n", true), 0 + 19);
+
+    // the received chars are kept for the expected reply
+    feed("\r\nAssociated!", false);
+    report.check("ends with", matcher.endsWith("Associated!"), 1);
+    report.check("not ends with", matcher.endsWith("Associated"), 0);
+
+    report.end();
+}
+
+void loop() {
+}
@@ -0,0 +1,134 @@
+// Manylabs RetryPolicy Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library decides when an upload that failed is tried again: it backs
+// off exponentially with random jitter, stops trying for a while after
+// repeated failures (a circuit breaker) and tells when a module reset is due.
+#ifndef _MANYLABS_RETRY_POLICY_H_
+#define _MANYLABS_RETRY_POLICY_H_
+#include "Arduino.h"
+
+
+// kinds of failure passed to failed()
+#define RETRY_TRANSIENT 0 // the server or the network failed; the module works
+#define RETRY_MODULE 1 // the module didn't answer; a reset may help
+
+
+// circuit states returned by state()
+#define RETRY_CLOSED 0 // sends go ahead once the backoff delay is up
+#define RETRY_OPEN 1 // too many failures: no sends until the open time is up
+#define RETRY_HALF_OPEN 2 // one trial send decides whether it closes again
+
+
+// The RetryPolicy class is told the result of each send and answers whether
+// the next one may start. After a failure it waits minDelay, doubled after
+// each further failure up to maxDelay; each wait is cut to a random time
+// between half and all of it, so devices that failed together don't retry
+// together. After openAfter failures in a row the circuit opens and no send
+// starts for openTime (also jittered); then a single trial send closes it
+// again or reopens it.
+//
+// Only module failures in a row count towards a reset (resetDue()): a
+// transient failure shows the module still works, and a reset (e.g. a GSM
+// reboot and network registration) costs far more than waiting.
+class RetryPolicy {
+public:
+
+	// create a new RetryPolicy object; all times are in ms
+	RetryPolicy( unsigned long minDelay, unsigned long maxDelay, byte openAfter,
+		unsigned long openTime, byte resetAfter ) {
+		_minDelay = minDelay;
+		_maxDelay = maxDelay;
+		_openAfter = openAfter;
+		_openTime = openTime;
+		_resetAfter = resetAfter;
+		_failTime = 0;
+		succeeded();
+	}
+
+	// returns true if a send may start now
+	bool ready() {
+		if (wait())
+			return false;
+		if (_state == RETRY_OPEN)
+			_state = RETRY_HALF_OPEN;
+		return true;
+	}
+
+	// ms until a send may start (0 if it may start now)
+	unsigned long wait() const {
+		unsigned long elapsed = millis() - _failTime;
+		return elapsed < _delay ? _delay - elapsed : 0;
+	}
+
+	// note that a send succeeded
+	void succeeded() {
+		_state = RETRY_CLOSED;
+		_failures = 0;
+		_moduleFailures = 0;
+		_delay = 0;
+	}
+
+	// note that a send failed; retryAfter is the time (in seconds) the server
+	// asked to wait, if any (Retry-After); it is kept to within openTime
+	void failed( byte kind, unsigned long retryAfter = 0 ) {
+		if (_failures < 255)
+			_failures++;
+		if (kind == RETRY_MODULE) {
+			if (_moduleFailures < 255)
+				_moduleFailures++;
+		} else {
+			_moduleFailures = 0;
+		}
+		if (_state == RETRY_HALF_OPEN || _failures >= _openAfter) {
+			_state = RETRY_OPEN;
+			_delay = jitter( _openTime );
+		} else {
+			byte shift = _failures - 1;
+			unsigned long ms = shift < 16 ? _minDelay << shift : _maxDelay;
+			_delay = jitter( ms < _maxDelay ? ms : _maxDelay );
+		}
+		if (retryAfter) {
+			unsigned long ms = retryAfter < _openTime / 1000 ? retryAfter * 1000 : _openTime;
+			if (ms > _delay)
+				_delay = ms;
+		}
+		_failTime = millis();
+	}
+
+	// returns true once enough module failures in a row call for a reset
+	inline bool resetDue() const { return _moduleFailures >= _resetAfter; }
+
+	// note that the module is being reset
+	inline void resetStarted() { _moduleFailures = 0; }
+
+	// the state of the circuit (RETRY_CLOSED etc.)
+	inline byte state() const { return _state; }
+
+	// the number of failures since the last success (up to 255)
+	inline byte failures() const { return _failures; }
+
+	// the wait after the last failure in ms
+	inline unsigned long lastDelay() const { return _delay; }
+
+private:
+
+	// a random time between half and all of ms
+	static unsigned long jitter( unsigned long ms ) {
+		return ms - random( ms / 2 + 1 );
+	}
+
+	unsigned long _minDelay;
+	unsigned long _maxDelay;
+	byte _openAfter;
+	unsigned long _openTime;
+	byte _resetAfter;
+	byte _state;
+	byte _failures;
+	byte _moduleFailures;
+	unsigned long _failTime; // millis() at the last failure
+	unsigned long _delay;
+};
+
+
+#endif // _MANYLABS_RETRY_POLICY_H_
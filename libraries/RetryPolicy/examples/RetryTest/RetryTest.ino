@@ -0,0 +1,78 @@
+// Manylabs RetryPolicy example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example reports some failures and successes to a policy and checks
+// the waits, the circuit and the reset it derives from them.
+
+#include "RetryPolicy.h"
+#include "TestReport.h"
+
+// retry after 100 ms doubling up to 400 ms; open for 1 s after 4 failures;
+// reset after 2 module failures
+RetryPolicy retry( 100, 400, 4, 1000, 2 );
+TestReport report;
+
+// check that the last wait was between half and all of ms
+void checkDelay( const char *name, unsigned long ms ) {
+    unsigned long value = retry.lastDelay();
+    report.check(name, value >= ms / 2 && value <= ms, 1);
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+    randomSeed(1);
+
+    // ready until the first failure
+    report.check("initial ready", retry.ready(), 1);
+
+    // each failure doubles the wait, up to the longest
+    retry.failed( RETRY_TRANSIENT );
+    checkDelay("first delay", 100);
+    report.check("first ready", retry.ready(), 0);
+    retry.failed( RETRY_TRANSIENT );
+    checkDelay("second delay", 200);
+    retry.failed( RETRY_TRANSIENT );
+    checkDelay("third delay", 400);
+    report.check("closed", retry.state(), RETRY_CLOSED);
+
+    // the server's Retry-After is kept
+    retry.succeeded();
+    retry.failed( RETRY_TRANSIENT, 1 );
+    report.check("retry after", retry.lastDelay(), 1000);
+
+    // too many failures open the circuit; after the open time one trial
+    // is let through, and its failure opens it again
+    retry.succeeded();
+    for (int i = 0; i < 4; i++) {
+        retry.failed( RETRY_TRANSIENT );
+    }
+    report.check("open", retry.state(), RETRY_OPEN);
+    checkDelay("open delay", 1000);
+    delay(retry.wait());
+    report.check("trial ready", retry.ready(), 1);
+    report.check("half open", retry.state(), RETRY_HALF_OPEN);
+    retry.failed( RETRY_TRANSIENT );
+    report.check("reopened", retry.state(), RETRY_OPEN);
+    delay(retry.wait());
+    retry.ready();
+    retry.succeeded();
+    report.check("closed again", retry.state(), RETRY_CLOSED);
+
+    // module failures in a row call for a reset; a transient one in between
+    // shows the module works
+    retry.failed( RETRY_MODULE );
+    retry.failed( RETRY_TRANSIENT );
+    retry.failed( RETRY_MODULE );
+    report.check("no reset", retry.resetDue(), 0);
+    retry.failed( RETRY_MODULE );
+    report.check("reset", retry.resetDue(), 1);
+    retry.resetStarted();
+    report.check("reset started", retry.resetDue(), 0);
+
+    report.end();
+}
+
+void loop() {
+}
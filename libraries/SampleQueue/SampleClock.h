@@ -0,0 +1,59 @@
+// Manylabs SampleQueue Library - sample clock
+// copyright Manylabs 2015; MIT license
+// --------
+// This file provides a seconds clock for timing queued records. It keeps
+// counting across resets, so records queued before a reset stay on the same
+// time line as the ones after it.
+#ifndef _MANYLABS_SAMPLE_CLOCK_H_
+#define _MANYLABS_SAMPLE_CLOCK_H_
+#include "Arduino.h"
+
+
+// marks a valid clock in RAM
+#define SAMPLE_CLOCK_MAGIC 0x4353
+
+
+// The SampleClock class counts seconds since the first startup: the seconds
+// since this startup (e.g. Timebase::seconds()) plus a base set by begin().
+//
+// Like SampleQueue, the object has no constructor: declare it with
+// SAMPLE_QUEUE_NOINIT and call begin() from setup(). A watchdog or external
+// reset keeps the RAM, so the clock goes on from the last time it gave out.
+// After a power-up that time is lost; the clock goes on from the time of the
+// newest record that survived in EEPROM instead, so records are never timed
+// after the present, but the time the power was off isn't counted.
+class SampleClock {
+public:
+
+	// start the clock after a reset; newest is the time of the newest queued
+	// record (0 if there are none)
+	void begin( unsigned long newest ) {
+		if (_magic != SAMPLE_CLOCK_MAGIC || _check != ~_last)
+			_last = 0;
+		if (_last < newest)
+			_last = newest;
+		_magic = SAMPLE_CLOCK_MAGIC;
+		_base = _last;
+		_check = ~_last;
+	}
+
+	// the time on the clock (seconds) for the given seconds since startup
+	unsigned long seconds( unsigned long sinceStartup ) {
+		unsigned long time = _base + sinceStartup;
+		if (time > _last) {
+			_last = time;
+			_check = ~_last;
+		}
+		return time;
+	}
+
+private:
+
+	unsigned int _magic;
+	unsigned long _base; // the time at this startup
+	unsigned long _last; // the latest time given out
+	unsigned long _check; // ~_last while _last is valid
+};
+
+
+#endif // _MANYLABS_SAMPLE_CLOCK_H_
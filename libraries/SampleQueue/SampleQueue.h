@@ -0,0 +1,252 @@
+// Manylabs SampleQueue Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library provides a store-and-forward queue of fixed-size binary
+// records. Records wait in RAM that survives watchdog resets and spill to
+// EEPROM when the RAM is full, so readings taken while the network is down
+// can be uploaded oldest-first once it is back.
+#ifndef _MANYLABS_SAMPLE_QUEUE_H_
+#define _MANYLABS_SAMPLE_QUEUE_H_
+#include "Arduino.h"
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+
+// marks a valid queue header in RAM
+#define SAMPLE_QUEUE_MAGIC 0x5153
+
+// marks an EEPROM slot that holds a record
+#define SAMPLE_QUEUE_SLOT_USED 0xA5
+
+// put the queue object in this section so it isn't cleared on reset, e.g.
+// SampleQueue< Record, 16 > queue SAMPLE_QUEUE_NOINIT;
+#define SAMPLE_QUEUE_NOINIT __attribute__ (( section( ".noinit" ) ))
+
+
+// The SampleQueue class holds up to N records of type T in RAM plus any
+// number of EEPROM slots. T must be a plain struct.
+//
+// The object has no constructor: declare it with SAMPLE_QUEUE_NOINIT and call
+// begin() from setup(). begin() keeps the RAM records if the header (with its
+// checksum) survived the reset, as it does after a watchdog or external
+// reset; after a power-up it starts with an empty RAM queue.
+//
+// When the RAM is full, the oldest RAM record moves to the next EEPROM slot,
+// so the EEPROM always holds the oldest records. Each slot stores a sequence
+// number and a checksum, so the EEPROM records are recovered even after a
+// power loss. When the EEPROM is full as well, its oldest record is dropped
+// and counted. A spill or an EEPROM pop writes one slot (about 3.4 ms per
+// changed byte), so they only cost time while the queue is backed up.
+//
+// Every record gets the next sequence number when it is pushed; the queue
+// always holds a contiguous run of them, oldest first.
+template <typename T, byte N> class SampleQueue {
+public:
+
+	// prepare the queue; the EEPROM spill area is slotCount slots of slotSize()
+	// bytes starting at address eepromStart (no slots: drop when RAM is full)
+	void begin( unsigned int eepromStart = 0, unsigned int slotCount = 0 ) {
+		if (_header.magic != SAMPLE_QUEUE_MAGIC || _header.check != headerCheck() || _header.ramFirst >= N
+			|| _header.ramCount > N || _header.eepromStart != eepromStart || _header.slotCount != slotCount) {
+			_header.magic = SAMPLE_QUEUE_MAGIC;
+			_header.ramFirst = 0;
+			_header.ramCount = 0;
+			_header.eepromStart = eepromStart;
+			_header.slotCount = slotCount;
+			_header.dropped = 0;
+			recoverSlots();
+			seal();
+		}
+	}
+
+	// add a record at the end; returns false if the oldest record had to be
+	// dropped to make room
+	bool push( const T &record ) {
+		bool kept = true;
+		if (_header.ramCount == N) {
+			if (_header.eepromCount == _header.slotCount) {
+				removeOldest();
+				_header.dropped++;
+				kept = false;
+			}
+			if (_header.ramCount == N) {
+				spill();
+			}
+		}
+		_records[ (_header.ramFirst + _header.ramCount) % N ] = record;
+		_header.ramCount++;
+		_header.nextSeq++;
+		seal();
+		return kept;
+	}
+
+	// copy a record (index 0 is the oldest); returns false if there is no such
+	// record or its EEPROM slot fails the checksum
+	bool read( unsigned int index, T &record ) const {
+		if (index < _header.eepromCount) {
+			Slot slot;
+			unsigned int pos = (_header.eepromFirst + index) % _header.slotCount;
+			eeprom_read_block( &slot, slotAddress( pos ), sizeof( Slot ) );
+			if (slot.used != SAMPLE_QUEUE_SLOT_USED || slot.check != slotCheck( slot ))
+				return false;
+			record = slot.record;
+			return true;
+		}
+		index -= _header.eepromCount;
+		if (index >= _header.ramCount)
+			return false;
+		record = _records[ (_header.ramFirst + index) % N ];
+		return true;
+	}
+
+	// remove the oldest count records
+	void pop( unsigned int count = 1 ) {
+		while (count-- && this->count()) {
+			removeOldest();
+		}
+		seal();
+	}
+
+	// remove all records
+	void clear() {
+		pop( count() );
+	}
+
+	// number of records in the queue
+	inline unsigned int count() const { return _header.eepromCount + _header.ramCount; }
+
+	// number of records in the EEPROM
+	inline unsigned int spilled() const { return _header.eepromCount; }
+
+	// sequence number of the oldest record
+	inline unsigned long firstSeq() const { return _header.nextSeq - count(); }
+
+	// number of records dropped because the queue was full (since power-up)
+	inline unsigned long dropped() const { return _header.dropped; }
+
+	// bytes of EEPROM per spill slot
+	static inline unsigned int slotSize() { return sizeof( Slot ); }
+
+private:
+
+	// a record in EEPROM
+	struct Slot {
+		byte used;
+		unsigned long seq;
+		T record;
+		byte check;
+	};
+
+	// remove the oldest record (in EEPROM if there are any there); the header is
+	// updated before the slot is cleared, so a reset in between leaves a stale
+	// used slot, which recoverSlots() at worst repeats, never loses records for
+	void removeOldest() {
+		if (_header.eepromCount) {
+			unsigned int pos = _header.eepromFirst;
+			_header.eepromFirst = (pos + 1) % _header.slotCount;
+			_header.eepromCount--;
+			seal();
+			eeprom_update_byte( (uint8_t *) slotAddress( pos ), 0 );
+		} else {
+			_header.ramFirst = (_header.ramFirst + 1) % N;
+			_header.ramCount--;
+		}
+	}
+
+	// move the oldest RAM record to the next EEPROM slot
+	void spill() {
+		Slot slot;
+		slot.used = SAMPLE_QUEUE_SLOT_USED;
+		slot.seq = _header.nextSeq - _header.ramCount;
+		slot.record = _records[ _header.ramFirst ];
+		slot.check = slotCheck( slot );
+		unsigned int pos = (_header.eepromFirst + _header.eepromCount) % _header.slotCount;
+		eeprom_update_block( &slot, slotAddress( pos ), sizeof( Slot ) );
+		_header.eepromCount++;
+		_header.ramFirst = (_header.ramFirst + 1) % N;
+		_header.ramCount--;
+	}
+
+	// find the records left in EEPROM: the longest run of used slots with
+	// consecutive sequence numbers (the newest of equal ones). A reset while
+	// popping can leave a stale slot before a gap, so the run starting at the
+	// lowest sequence number isn't always the queue.
+	void recoverSlots() {
+		Slot slot;
+		unsigned long firstSeq = 0;
+		_header.eepromFirst = 0;
+		_header.eepromCount = 0;
+		_header.nextSeq = 0;
+		for (unsigned int pos = 0; pos < _header.slotCount; pos++) {
+			if (!readSlot( pos, slot ))
+				continue;
+			unsigned long seq = slot.seq;
+			// only count runs from their first slot
+			if (readSlot( (pos + _header.slotCount - 1) % _header.slotCount, slot ) && slot.seq == seq - 1)
+				continue;
+			unsigned int count = 1;
+			while (count < _header.slotCount && readSlot( (pos + count) % _header.slotCount, slot ) && slot.seq == seq + count)
+				count++;
+			if (count > _header.eepromCount || (count == _header.eepromCount && seq > firstSeq)) {
+				firstSeq = seq;
+				_header.eepromFirst = pos;
+				_header.eepromCount = count;
+				_header.nextSeq = seq + count;
+			}
+		}
+	}
+
+	// read a slot; returns false if it isn't used or its checksum is wrong
+	bool readSlot( unsigned int pos, Slot &slot ) const {
+		eeprom_read_block( &slot, slotAddress( pos ), sizeof( Slot ) );
+		return slot.used == SAMPLE_QUEUE_SLOT_USED && slot.check == slotCheck( slot );
+	}
+
+	// EEPROM address of a slot
+	inline void *slotAddress( unsigned int pos ) const {
+		return (void *) (_header.eepromStart + pos * sizeof( Slot ));
+	}
+
+	// checksum of a slot's sequence number and record
+	static byte slotCheck( const Slot &slot ) {
+		return crc( (const byte *) &slot.seq, sizeof( slot.seq ) + sizeof( T ), sizeof( T ) );
+	}
+
+	// checksum of the header fields before the check byte
+	byte headerCheck() const {
+		return crc( (const byte *) &_header, offsetof( Header, check ), N );
+	}
+
+	// update the header checksum after a change
+	inline void seal() {
+		_header.check = headerCheck();
+	}
+
+	// CRC-8 of a block, seeded so a different record layout doesn't match
+	static byte crc( const byte *data, unsigned int length, byte seed ) {
+		byte crc = seed;
+		while (length--)
+			crc = _crc_ibutton_update( crc, *data++ );
+		return crc;
+	}
+
+	// queue state; kept valid by seal() after every change
+	struct Header {
+		unsigned int magic;
+		unsigned int eepromStart;
+		unsigned int slotCount;
+		unsigned int eepromFirst;
+		unsigned int eepromCount;
+		byte ramFirst;
+		byte ramCount;
+		unsigned long nextSeq;
+		unsigned long dropped;
+		byte check;
+	};
+
+	Header _header;
+	T _records[ N ];
+};
+
+
+#endif // _MANYLABS_SAMPLE_QUEUE_H_
@@ -0,0 +1,138 @@
+// Manylabs SampleQueue example
+// copyright Manylabs 2015; MIT license
+// --------
+// This example checks the queue's ordering, EEPROM spill and recovery. A
+// watchdog reset is simulated by calling begin() again and a power loss by
+// scrambling the queue's RAM first. It overwrites the start of the EEPROM.
+// It also checks that the SampleClock goes on across both.
+
+#include <avr/eeprom.h>
+#include "SampleQueue.h"
+#include "SampleClock.h"
+#include "TestReport.h"
+
+struct Record {
+    unsigned long value;
+};
+
+#define SLOTS 6
+SampleQueue<Record, 4> queue SAMPLE_QUEUE_NOINIT;
+SampleClock sampleClock SAMPLE_QUEUE_NOINIT;
+TestReport report;
+
+// push records with values first..last
+void pushRange( unsigned long first, unsigned long last ) {
+    for (unsigned long value = first; value <= last; value++) {
+        Record record = { value };
+        queue.push(record);
+    }
+}
+
+// value of a queued record (0 if it can't be read)
+unsigned long valueAt( unsigned int index ) {
+    Record record = { 0 };
+    queue.read(index, record);
+    return record.value;
+}
+
+// lose the RAM contents as a power loss would
+void powerLoss() {
+    memset(&queue, 0x55, sizeof(queue));
+    queue.begin(0, SLOTS);
+}
+
+void setup() {
+
+    Serial.begin(9600);
+    report.begin();
+
+    // start with an empty EEPROM area
+    for (unsigned int i = 0; i < SLOTS * queue.slotSize(); i++) {
+        eeprom_update_byte((uint8_t *) i, 0);
+    }
+    powerLoss();
+    report.check("empty count", queue.count(), 0);
+
+    // fill the RAM, then spill the oldest records to EEPROM
+    pushRange(1, 4);
+    report.check("ram count", queue.count(), 4);
+    report.check("ram spilled", queue.spilled(), 0);
+    pushRange(5, 10);
+    report.check("full count", queue.count(), 10);
+    report.check("full spilled", queue.spilled(), 6);
+    report.check("full first", valueAt(0), 1);
+    report.check("full last", valueAt(9), 10);
+    report.check("full dropped", queue.dropped(), 0);
+
+    // one more drops the oldest
+    pushRange(11, 11);
+    report.check("overflow count", queue.count(), 10);
+    report.check("overflow dropped", queue.dropped(), 1);
+    report.check("overflow first", valueAt(0), 2);
+    report.check("overflow seq", queue.firstSeq(), 1);
+
+    // a watchdog reset keeps everything
+    queue.begin(0, SLOTS);
+    report.check("reset count", queue.count(), 10);
+    report.check("reset first", valueAt(0), 2);
+    report.check("reset last", valueAt(9), 11);
+    report.check("reset dropped", queue.dropped(), 1);
+
+    // a power loss keeps the EEPROM records
+    powerLoss();
+    report.check("power count", queue.count(), 6);
+    report.check("power first", valueAt(0), 2);
+    report.check("power last", valueAt(5), 7);
+    report.check("power seq", queue.firstSeq(), 1);
+
+    // popping goes through the EEPROM and on into RAM in order
+    queue.pop(3);
+    report.check("pop first", valueAt(0), 5);
+    pushRange(12, 16);
+    report.check("refill count", queue.count(), 8);
+    report.check("refill third", valueAt(3), 12);
+    queue.pop(4);
+    report.check("pop ram first", valueAt(0), 13);
+    report.check("pop spilled", queue.spilled(), 0);
+    report.check("pop seq", queue.firstSeq(), 8);
+    queue.clear();
+    report.check("clear count", queue.count(), 0);
+
+    // a reset while popping can leave a popped slot marked used; after a
+    // power loss the queue is still the run of slots that follows it
+    for (unsigned int i = 0; i < SLOTS * queue.slotSize(); i++) {
+        eeprom_update_byte((uint8_t *) i, 0);
+    }
+    powerLoss();
+    pushRange(1, 10);
+    byte stale[ 32 ];
+    eeprom_read_block(stale, (void *) 0, queue.slotSize());
+    queue.pop(2);
+    eeprom_update_block(stale, (void *) 0, queue.slotSize());
+    powerLoss();
+    report.check("stale count", queue.count(), 4);
+    report.check("stale first", valueAt(0), 3);
+    report.check("stale seq", queue.firstSeq(), 2);
+
+    // the clock starts at 0 after a power-up with nothing queued
+    memset(&sampleClock, 0x55, sizeof(sampleClock));
+    sampleClock.begin(0);
+    report.check("clock start", sampleClock.seconds(0), 0);
+    report.check("clock runs", sampleClock.seconds(100), 100);
+
+    // after a watchdog reset it goes on from the last time, so a record
+    // queued at 40 is still in the past
+    sampleClock.begin(40);
+    report.check("reset clock", sampleClock.seconds(0), 100);
+    report.check("reset runs", sampleClock.seconds(5), 105);
+
+    // after a power loss it goes on from the newest record left in EEPROM
+    memset(&sampleClock, 0x55, sizeof(sampleClock));
+    sampleClock.begin(60);
+    report.check("power clock", sampleClock.seconds(0), 60);
+
+    report.end();
+}
+
+void loop() {
+}
@@ -0,0 +1,160 @@
+// Manylabs TaskScheduler Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library provides a small cooperative scheduler for running several
+// periodic activities from loop() without any one of them blocking the rest.
+#ifndef _MANYLABS_TASK_SCHEDULER_H_
+#define _MANYLABS_TASK_SCHEDULER_H_
+#include "Arduino.h"
+#include "Timebase.h"
+
+
+// number of tasks the scheduler can hold
+#ifndef TASK_SCHEDULER_MAX_TASKS
+#define TASK_SCHEDULER_MAX_TASKS 8
+#endif
+
+// returned by add() when the task table is full
+#define TASK_NONE 255
+
+
+// a task function; it must do a bounded amount of work and return (yield)
+typedef void (*TaskFunction)();
+
+
+// The TaskScheduler class runs tasks from a fixed-size table. Each task has a
+// period and a deadline (the time it is next due) in milliseconds. There is
+// no timer tick: run() compares the deadlines with the 64-bit Timebase clock
+// and runs the due task with the earliest deadline.
+//
+// Deadlines are absolute: a periodic task's next deadline is its last one plus
+// the period, so runs stay exactly one period apart on average however late
+// each one starts. A task with period 0 runs once each time it is woken with
+// wake(). A periodic task that starts a whole period or more after its
+// deadline has overrun; the missed periods are counted and skipped so the task
+// keeps its phase, and the task can see them with missed().
+class TaskScheduler {
+public:
+
+	// create a new TaskScheduler object
+	TaskScheduler() {
+		_count = 0;
+		_runDeadline = 0;
+		_runMissed = 0;
+	}
+
+	// add a task that first runs after the given delay and then every period
+	// milliseconds (period 0: only when woken); returns the task id or TASK_NONE
+	byte add( TaskFunction function, unsigned long period, unsigned long delay = 0 ) {
+		if (_count == TASK_SCHEDULER_MAX_TASKS)
+			return TASK_NONE;
+		Task &task = _tasks[ _count ];
+		task.function = function;
+		task.period = period;
+		task.deadline = Timebase::now() + delay;
+		task.ready = period != 0;
+		task.overruns = 0;
+		task.maxRunTime = 0;
+		return _count++;
+	}
+
+	// make a task due now, or after the given delay in milliseconds
+	void wake( byte id, unsigned long delay = 0 ) {
+		_tasks[ id ].deadline = Timebase::now() + delay;
+		_tasks[ id ].ready = true;
+	}
+
+	// stop running a task until it is woken
+	inline void suspend( byte id ) { _tasks[ id ].ready = false; }
+
+	// change the period of a task; takes effect after its next run
+	inline void setPeriod( byte id, unsigned long period ) { _tasks[ id ].period = period; }
+
+	// run the due task with the earliest deadline; returns false if none was due
+	bool run() {
+		uint64_t now = Timebase::now();
+		byte next = TASK_NONE;
+		for (byte i = 0; i < _count; i++) {
+			const Task &task = _tasks[ i ];
+			if (task.ready && task.deadline <= now && (next == TASK_NONE || task.deadline < _tasks[ next ].deadline)) {
+				next = i;
+			}
+		}
+		if (next == TASK_NONE)
+			return false;
+
+		// compute the next deadline before running so the task can wake or
+		// suspend itself
+		Task &task = _tasks[ next ];
+		_runDeadline = task.deadline;
+		_runMissed = 0;
+		if (task.period) {
+			uint64_t lateness = now - task.deadline;
+			if (lateness >= task.period) // avoid the 64-bit division when on time
+				_runMissed = lateness / task.period;
+			task.overruns += _runMissed;
+			task.deadline += (_runMissed + 1) * task.period;
+		} else {
+			task.ready = false;
+		}
+		task.function();
+		unsigned long runTime = Timebase::now() - now;
+		if (runTime > task.maxRunTime)
+			task.maxRunTime = runTime;
+		return true;
+	}
+
+	// milliseconds until the next task is due (0 if one is due now, or
+	// 0xFFFFFFFF if no task is ready); the caller may idle for this long
+	unsigned long idleTime() const {
+		uint64_t now = Timebase::now();
+		unsigned long idle = 0xFFFFFFFF;
+		for (byte i = 0; i < _count; i++) {
+			const Task &task = _tasks[ i ];
+			if (task.ready) {
+				if (task.deadline <= now)
+					return 0;
+				if (task.deadline - now < idle)
+					idle = task.deadline - now;
+			}
+		}
+		return idle;
+	}
+
+	// the deadline the running task was due at (Timebase milliseconds); this
+	// is the nominal time of the run, whatever its actual start time
+	inline uint64_t deadline() const { return _runDeadline; }
+
+	// number of periods the running task missed and skipped just before this run
+	inline unsigned long missed() const { return _runMissed; }
+
+	// number of periods a task has missed because it started late
+	inline unsigned int overruns( byte id ) const { return _tasks[ id ].overruns; }
+
+	// longest time (milliseconds) a task has taken to run
+	inline unsigned long maxRunTime( byte id ) const { return _tasks[ id ].maxRunTime; }
+
+	// number of tasks added
+	inline byte count() const { return _count; }
+
+private:
+
+	struct Task {
+		TaskFunction function;
+		unsigned long period;
+		uint64_t deadline;
+		bool ready;
+		unsigned int overruns;
+		unsigned long maxRunTime;
+	};
+
+	Task _tasks[ TASK_SCHEDULER_MAX_TASKS ];
+	byte _count;
+
+	// the run in progress
+	uint64_t _runDeadline;
+	unsigned long _runMissed;
+};
+
+
+#endif // _MANYLABS_TASK_SCHEDULER_H_
@@ -0,0 +1,42 @@
+// Manylabs TaskScheduler Library - timebase
+// copyright Manylabs 2015; MIT license
+// --------
+// This file provides a 64-bit monotonic millisecond clock. millis() wraps
+// after about 49.7 days; the 64-bit clock doesn't wrap in practice.
+#ifndef _MANYLABS_TIMEBASE_H_
+#define _MANYLABS_TIMEBASE_H_
+#include "Arduino.h"
+
+
+// The Timebase class extends millis() to 64 bits by counting its wraps. It
+// notices a wrap when a reading is lower than the previous one, so now() must
+// be called at least once every 49 days (the TaskScheduler calls it on every
+// run). Call it from the main loop only, not from interrupt handlers.
+class Timebase {
+public:
+
+	// milliseconds since startup
+	static uint64_t now() {
+		unsigned long ms = millis();
+		if (ms < s_last)
+			s_wraps++;
+		s_last = ms;
+		return ((uint64_t) s_wraps << 32) | ms;
+	}
+
+	// whole seconds since startup
+	static unsigned long seconds() {
+		return now() / 1000;
+	}
+
+private:
+
+	static unsigned long s_last;
+	static unsigned long s_wraps;
+};
+
+unsigned long Timebase::s_last = 0;
+unsigned long Timebase::s_wraps = 0;
+
+
+#endif // _MANYLABS_TIMEBASE_H_
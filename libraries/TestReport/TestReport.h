@@ -0,0 +1,60 @@
+// Manylabs TestReport Library 0.1.0
+// copyright Manylabs 2015; MIT license
+// --------
+// This library prints the results of the self-checking examples of the other
+// libraries: each checked value, then the number of checks that failed.
+#ifndef _MANYLABS_TEST_REPORT_H_
+#define _MANYLABS_TEST_REPORT_H_
+#include "Arduino.h"
+
+
+// The TestReport class compares results with expected values and prints them
+// on Serial. Call begin() once Serial is started, check() for each result and
+// end() after the last one.
+class TestReport {
+public:
+
+	// create a new TestReport object with no failures
+	TestReport() {
+		_failures = 0;
+	}
+
+	// print the start of the report
+	void begin() {
+		Serial.println( "Starting Tests" );
+		Serial.println( "==============" );
+	}
+
+	// compare a result with the expected value (converted to the result's
+	// type) and print it; returns true if they match
+	template <typename V, typename E> bool check( const char *name, V value, E expected ) {
+		Serial.print( name );
+		Serial.print( ": " );
+		Serial.print( value );
+		if (value == (V) expected) {
+			Serial.println( " ok" );
+			return true;
+		}
+		Serial.print( " expected " );
+		Serial.println( expected );
+		_failures++;
+		return false;
+	}
+
+	// print the number of failed checks
+	void end() {
+		Serial.println( "==============" );
+		Serial.print( "Failures: " );
+		Serial.println( _failures );
+	}
+
+	// number of failed checks so far
+	inline int failures() const { return _failures; }
+
+private:
+
+	int _failures;
+};
+
+
+#endif // _MANYLABS_TEST_REPORT_H_
@@ -6,6 +6,10 @@
 HTTPClient::HTTPClient()
 {
   wifly = WiFly::getInstance();
+  state = HTTP_IDLE;
+  result = 0;
+  keep_alive = false;
+  write_interval = HTTP_WRITE_INTERVAL(DEFAULT_BAUDRATE);
 }
 
 int HTTPClient::get(const char *url, int timeout)
@@ -35,7 +39,19 @@ int HTTPClient::connect(const char *url, const char *method, const char *data, i
 
 int HTTPClient::connect(const char *url, const char *method, const char *headers, const char *data, int timeout)
 {
-  char host[HTTP_MAX_HOST_LEN];
+  int ret = start(url, method, headers, data);
+  while (ret == 0 && (ret = poll()) == HTTP_CLIENT_BUSY) {
+  }
+  return ret;
+}
+
+int HTTPClient::startPost(const char *url, const char *headers, const char *data)
+{
+  return start(url, "POST", headers, data);
+}
+
+int HTTPClient::start(const char *url, const char *method, const char *headers, const char *data)
+{
   uint16_t port;
   char path[HTTP_MAX_PATH_LEN];
 
@@ -44,41 +60,154 @@ int HTTPClient::connect(const char *url, const char *method, const char *headers
     return -1;
   }
 
-  if (!wifly->connect(host, port, timeout)) {
-    DBG("Failed to connect.\r\n");
+  if (state != HTTP_IDLE) {
+    DBG("Busy.\r\n");
     return -2;
   }
+  resp.reset();
 
-  // Send request
-  char buf[HTTP_MAX_BUF_LEN];
-  snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\r\n", method, path);
-  wifly->send(buf);
-
-  // Send all headers
-  snprintf(buf, sizeof(buf), "Host: %s\r\nConnection: close\r\n", host);
-  wifly->send(buf);
-
-  if (data != NULL) {
-    // WireGarden edit: the Manydata API uses application/json so we need to be able to customize
-    // the type we're sending
-    // snprintf(buf, sizeof(buf), "Content-Length: %d\r\nContent-Type: text/plain\r\n", strlen(data));
-    snprintf(buf, sizeof(buf), "Content-Length: %d\r\n", strlen(data));
-    wifly->send(buf);
+  // reuse the connection unless the module has reported it closed since
+  // the last request (the report may still be waiting to be read)
+  wifly->discard();
+  write_interval = HTTP_WRITE_INTERVAL(wifly->baudRate());
+  if (keep_alive && wifly->connected()) {
+    write_time = millis() - write_interval;
+    state = HTTP_WRITE;
+  } else if (wifly->startConnect(host, port)) {
+    state = HTTP_CONNECT;
+  } else {
+    DBG("Busy.\r\n");
+    return -2;
   }
 
-  if (headers != NULL) {
-    wifly->send(headers);
-  }
+  // the request line is the first segment
+  snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\r\n", method, path);
+  req_headers = headers;
+  req_data = data;
+  segment = 0;
+  write_ptr = buf;
+  return 0;
+}
+
+int HTTPClient::poll()
+{
+  switch (state) {
+  case HTTP_CONNECT:
+    switch (wifly->commandStatus()) {
+    case WIFLY_CMD_BUSY:
+      break;
+    case WIFLY_CMD_OK:
+      write_time = millis() - write_interval;
+      state = HTTP_WRITE;
+      break;
+    case WIFLY_CMD_FAILED:
+      DBG("Failed to connect.\r\n");
+      return closeConnection(-6);
+    default:
+      DBG("No reply to open.\r\n");
+      return closeConnection(-2);
+    }
+    return HTTP_CLIENT_BUSY;
 
-  // Close headers
-  wifly->send("\r\n");
+  case HTTP_WRITE:
+    if (millis() - write_time < write_interval) {
+      return HTTP_CLIENT_BUSY;
+    }
+    write_time = millis();
+    for (int i = 0; i < HTTP_WRITE_CHUNK; ) {
+      if (*write_ptr == '\0') {
+        if (!nextSegment()) {
+          resp.reset();
+          write_time = millis();
+          state = HTTP_RESPONSE;
+          return HTTP_CLIENT_BUSY;
+        }
+      } else {
+        wifly->write(*write_ptr++);
+        i++;
+      }
+    }
+    return HTTP_CLIENT_BUSY;
 
-  // Send body
-  if (data != NULL) {
-    wifly->send(data);
+  case HTTP_RESPONSE:
+    // without keep-alive, the rest of the response is dropped with the
+    // connection; with it, the body is read so the connection can be reused
+    for (int c = wifly->read(); c >= 0; c = wifly->read()) {
+      if ((resp.parse(c) && !keep_alive) || (keep_alive && resp.complete())) {
+        state = HTTP_IDLE;
+        result = 0;
+        return result;
+      }
+    }
+    if (wifly->connected() && millis() - write_time < HTTP_RESPONSE_TIMEOUT) {
+      return HTTP_CLIENT_BUSY;
+    }
+    if (!resp.headersComplete()) {
+      DBG("No response.\r\n");
+      return closeConnection(-3);
+    }
+
+    // a body without a length ends when the connection does
+    return closeConnection(0);
+
+  case HTTP_CLOSE:
+    if (wifly->commandStatus() == WIFLY_CMD_BUSY) {
+      return HTTP_CLIENT_BUSY;
+    }
+    wifly->discard();
+    state = HTTP_IDLE;
+    return result;
   }
+  return result;
+}
 
-  return 0;
+// end the request with the given result, closing the connection if it is open
+int HTTPClient::closeConnection(int error)
+{
+  result = error;
+  if (state == HTTP_CONNECT || wifly->connected()) {
+    wifly->startCommand("close\r");
+    state = HTTP_CLOSE;
+    return HTTP_CLIENT_BUSY;
+  }
+  state = HTTP_IDLE;
+  return result;
+}
+
+// move to the next non-empty part of the request; returns false after the body
+boolean HTTPClient::nextSegment()
+{
+  write_ptr = NULL;
+  while (write_ptr == NULL) {
+    switch (++segment) {
+    case 1:
+      snprintf(buf, sizeof(buf), "Host: %s\r\nConnection: %s\r\n", host, keep_alive ? "keep-alive" : "close");
+      write_ptr = buf;
+      break;
+    case 2:
+      if (req_data != NULL) {
+        // WireGarden edit: the Manydata API uses application/json so we need to be able to customize
+        // the type we're sending
+        // snprintf(buf, sizeof(buf), "Content-Length: %d\r\nContent-Type: text/plain\r\n", strlen(data));
+        snprintf(buf, sizeof(buf), "Content-Length: %d\r\n", strlen(req_data));
+        write_ptr = buf;
+      }
+      break;
+    case 3:
+      write_ptr = req_headers;
+      break;
+    case 4:
+      // close headers
+      write_ptr = "\r\n";
+      break;
+    case 5:
+      write_ptr = req_data;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
 }
 
 int HTTPClient::parseURL(const char *url, char *host, int max_host_len, uint16_t *port, char *path, int max_path_len)
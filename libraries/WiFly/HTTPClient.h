@@ -11,8 +11,21 @@
 
 #define HTTP_DEFAULT_PORT                   80
 
+// returned by poll() while a request is running
+#define HTTP_CLIENT_BUSY                    1
+
+// poll() writes at most HTTP_WRITE_CHUNK bytes every HTTP_WRITE_INTERVAL ms
+// at the rate the link runs at (see WiFly::baudRate()), which the serial port
+// sends before the next chunk, so writes never wait
+#define HTTP_WRITE_CHUNK                    16
+#define HTTP_WRITE_INTERVAL(baud)           (HTTP_WRITE_CHUNK * 10000L / (baud) + 1)
+
+// how long poll() waits for the response head (ms)
+#define HTTP_RESPONSE_TIMEOUT               10000
+
 #include <Arduino.h>
 #include <WiFly.h>
+#include <HttpResponse.h>
 
 class HTTPClient {
   public:
@@ -23,12 +36,58 @@ class HTTPClient {
     int post(const char *url, const char *data, int timeout = HTTP_CLIENT_DEFAULT_TIMEOUT);
     int post(const char *url, const char *headers, const char *data, int timeout = HTTP_CLIENT_DEFAULT_TIMEOUT);
 
+    // start a POST without blocking; data and headers must stay valid until
+    // poll() is done. returns 0, or a negative error as post()
+    int startPost(const char *url, const char *headers, const char *data);
+
+    // advance the running request; returns HTTP_CLIENT_BUSY until the request
+    // has been sent and the response head has arrived (in keep-alive mode:
+    // the whole response), then 0 or a negative error as post(); -2 if the
+    // module didn't answer the open, -6 if it couldn't connect to the server
+    // and -3 if no response arrived
+    int poll();
+
+    // keep the connection open between requests to the same server and reuse
+    // it while the module hasn't reported it closed. requests then read the
+    // whole response, so the next one can be written on the same connection
+    void setKeepAlive(boolean keep) {
+      keep_alive = keep;
+    }
+
+    // the last response (its status is -1 if none arrived)
+    const HttpResponseParser &response() {
+      return resp;
+    }
+
   private:
+    enum { HTTP_IDLE, HTTP_CONNECT, HTTP_WRITE, HTTP_RESPONSE, HTTP_CLOSE };
+
+    int start(const char *url, const char *method, const char *headers, const char *data);
+    boolean nextSegment();
+    int closeConnection(int error);
+
     int parseURL(const char *url, char *host, int max_host_len, uint16_t *port, char *path, int max_path_len);
     int connect(const char *url, const char *method, const char *data, int timeout = HTTP_CLIENT_DEFAULT_TIMEOUT);
     int connect(const char *url, const char *method, const char *header, const char *data, int timeout = HTTP_CLIENT_DEFAULT_TIMEOUT);
 
     WiFly* wifly;
+
+    // running request: the parts are written one segment at a time from buf
+    // or from the caller's strings
+    uint8_t state;
+    int result;
+    char host[HTTP_MAX_HOST_LEN];
+    char buf[HTTP_MAX_BUF_LEN];
+    const char *req_headers;
+    const char *req_data;
+    uint8_t segment;
+    const char *write_ptr;
+    unsigned long write_time;
+    unsigned long write_interval;
+
+    // keep-alive mode and the response being read
+    boolean keep_alive;
+    HttpResponseParser resp;
 };
 
 #endif // __HTTP_CLIENT_H__
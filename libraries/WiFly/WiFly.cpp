@@ -4,27 +4,53 @@
 
 WiFly *WiFly::instance;
 
+// replies that fail a command at once instead of after its timeout
+static const char reply_err[] PROGMEM = "ERR:";                     // ERR: ?-Cmd, ERR: Bad Args
+static const char reply_auth_err[] PROGMEM = "Auth-ERR";            // join
+static const char reply_connect_failed[] PROGMEM = "Connect FAILED";  // open
+static const char reply_assoc_fail[] PROGMEM = "Assoc=FAIL";        // show n
+static PGM_P const error_replies[] PROGMEM = {
+    reply_err, reply_auth_err, reply_connect_failed, reply_assoc_fail, NULL
+};
+
 WiFly::WiFly(Stream *serial)
+    : open_latency(DEFAULT_WAIT_RESPONSE_TIME*5, MIN_WAIT_RESPONSE_TIME, MAX_WAIT_RESPONSE_TIME)
 {
     instance = this;
     this->serial = serial;
+    baud_rate = DEFAULT_BAUDRATE;
 
     setTimeout(DEFAULT_WAIT_RESPONSE_TIME);
 
     command_mode = false;
     associated = false;
     error_count = 0;
+    cmd_state = CMD_IDLE;
+    cmd_status = WIFLY_CMD_OK;
+    cmd_open = false;
+    cmd_latency = NULL;
+    tcp_open = false;
+    close_match = 0;
 }
 
 WiFly::WiFly(Stream &serial)
+    : open_latency(DEFAULT_WAIT_RESPONSE_TIME*5, MIN_WAIT_RESPONSE_TIME, MAX_WAIT_RESPONSE_TIME)
 {
     instance = this;
     this->serial = &serial;
+    baud_rate = DEFAULT_BAUDRATE;
 
     setTimeout(DEFAULT_WAIT_RESPONSE_TIME);
 
     command_mode = false;
     associated = false;
+    error_count = 0;
+    cmd_state = CMD_IDLE;
+    cmd_status = WIFLY_CMD_OK;
+    cmd_open = false;
+    cmd_latency = NULL;
+    tcp_open = false;
+    close_match = 0;
 }
 
 int WiFly::available()
@@ -34,7 +60,7 @@ int WiFly::available()
 
 int WiFly::read()
 {
-    return serial->read();
+    return scanData(serial->read());
 }
 
 int WiFly::peek()
@@ -205,29 +231,29 @@ boolean WiFly::leave()
 
 boolean WiFly::connect(const char *host, uint16_t port, int timeout)
 {
-    char cmd[MAX_CMD_LEN];
-    timeout = DEFAULT_WAIT_RESPONSE_TIME*5;
-#if 0
-    snprintf(cmd, sizeof(cmd), "set d n %s\r", host);
-    sendCommand(cmd, "OK");
-    snprintf(cmd, sizeof(cmd), "set i r %d\r", port);
-    sendCommand(cmd, "OK");
-    sendCommand("set i p 2\r", "OK");
-    sendCommand("set i h 0\r", "OK");
-    sendCommand("set c r 0\r", "OK");
-    if (!sendCommand("open\r", "*OPEN*", timeout)) {
-#else
-    snprintf(cmd, sizeof(cmd), "open %s %d\r", host, port);
-    if (!sendCommand(cmd, "*OPEN*", timeout)) {
-#endif
+    uint8_t status;
 
-        command_mode = false;
+    startConnect(host, port);
+    while ((status = commandStatus()) == WIFLY_CMD_BUSY) {
+    }
+    if (status != WIFLY_CMD_OK) {
         sendCommand("close\r");
         clear();
         return false;
     }
 
-    command_mode = false;
+    return true;
+}
+
+boolean WiFly::startConnect(const char *host, uint16_t port)
+{
+    char cmd[MAX_CMD_LEN];
+
+    snprintf(cmd, sizeof(cmd), "open %s %d\r", host, port);
+    if (!startCommand(cmd, "*OPEN*", open_latency, true)) {
+        return false;
+    }
+    cmd_open = true;
     return true;
 }
 
@@ -275,7 +301,7 @@ int WiFly::send(const uint8_t *data, int len, int timeout)
 
 int WiFly::send(const char *data, int timeout)
 {
-    send((uint8_t *)data, strlen(data), timeout);
+    return send((uint8_t *)data, strlen(data), timeout);
 }
 
 boolean WiFly::ask(const char *q, const char *a, int timeout)
@@ -316,24 +342,169 @@ boolean WiFly::ask(const char *q, const char *a, int timeout)
 
 boolean WiFly::sendCommand(const char *cmd, const char *ack, int timeout)
 {
+    uint8_t status;
+
+    if (!startCommand(cmd, ack, timeout)) {
+        return false;
+    }
+    while ((status = commandStatus()) == WIFLY_CMD_BUSY) {
+    }
+    return status == WIFLY_CMD_OK;
+}
+
+boolean WiFly::startCommand(const char *cmd, const char *ack, int timeout, boolean leave)
+{
+    if (cmd_state != CMD_IDLE) {
+        return false;
+    }
+
     DBG("CMD: ");
     DBG(cmd);
     DBG("\r\n");
-    clear();
+    discard();
 
-    commandMode();
+    // a command leaves data mode (or closes the connection); only a
+    // successful open marks it usable again
+    tcp_open = false;
+    cmd_open = false;
 
-    if (!ask(cmd, ack, timeout)) {
-        DBG("Failed to run: ");
-        DBG(cmd);
-        DBG("\r\n");
-        error_count++;
+    strncpy(cmd_buf, cmd, MAX_CMD_LEN - 1);
+    cmd_buf[MAX_CMD_LEN - 1] = '\0';
+    cmd_ack = ack;
+    cmd_timeout = timeout;
+    cmd_leave = leave;
+    cmd_latency = NULL;
+    cmd_status = WIFLY_CMD_BUSY;
+
+    if (command_mode && (error_count < 2)) {
+        writeCommand();
+    } else {
+        send("$$$");
+        expect("CMD", DEFAULT_WAIT_RESPONSE_TIME);
+        cmd_state = CMD_ENTER;
+    }
+    return true;
+}
+
+boolean WiFly::startCommand(const char *cmd, const char *ack, LatencyTracker &latency, boolean leave)
+{
+    if (!startCommand(cmd, ack, (int)latency.timeout(), leave)) {
         return false;
     }
-    error_count = 0;
+    cmd_latency = &latency;
     return true;
 }
 
+uint8_t WiFly::commandStatus()
+{
+    while (cmd_state != CMD_IDLE) {
+        int c = serial->read();
+        if (c >= 0) {
+            uint8_t status = match(c);
+            if (status == WIFLY_CMD_FAILED) {
+                DBG("Error reply to: ");
+                DBG(cmd_buf);
+                DBG("\r\n");
+                finishCommand(WIFLY_CMD_FAILED);
+            } else if (status == WIFLY_CMD_OK) {
+                if (cmd_state == CMD_WAIT) {
+                    addLatency(true);
+                    finishCommand(WIFLY_CMD_OK);
+                } else {
+                    command_mode = true;
+                    writeCommand();
+                }
+            }
+        } else if ((millis() - expect_start) >= (unsigned long)expect_timeout) {
+            if (cmd_state == CMD_ENTER) {
+                // no prompt: maybe we are in command mode already
+                send("\r");
+                expect("ERR", DEFAULT_WAIT_RESPONSE_TIME);
+                cmd_state = CMD_ENTER_RETRY;
+            } else if (cmd_state == CMD_ENTER_RETRY) {
+                DBG("Failed to enter command mode\r\n");
+                writeCommand();
+            } else {
+                DBG("Failed to run: ");
+                DBG(cmd_buf);
+                DBG("\r\n");
+                addLatency(false);
+                finishCommand(WIFLY_CMD_TIMEOUT);
+            }
+        } else {
+            break;
+        }
+    }
+    return cmd_status;
+}
+
+void WiFly::writeCommand()
+{
+    send(cmd_buf);
+    if (cmd_ack == NULL) {
+        finishCommand(WIFLY_CMD_OK);
+    } else {
+        expect(cmd_ack, cmd_timeout, error_replies);
+        cmd_state = CMD_WAIT;
+    }
+}
+
+void WiFly::finishCommand(uint8_t status)
+{
+    if (status == WIFLY_CMD_OK) {
+        error_count = 0;
+    } else {
+        error_count++;
+    }
+    if (cmd_leave) {
+        command_mode = false;
+    }
+    if (cmd_open && status == WIFLY_CMD_OK) {
+        tcp_open = true;
+        close_match = 0;
+    }
+    cmd_state = CMD_IDLE;
+    cmd_status = status;
+}
+
+// add the time since the command was sent to its latency tracker (if any),
+// or a timeout if it got no reply. error replies are left out: they can
+// arrive much sooner than the ack
+void WiFly::addLatency(boolean replied)
+{
+    if (cmd_latency) {
+        if (replied) {
+            cmd_latency->add(millis() - expect_start);
+        } else {
+            cmd_latency->addTimeout();
+        }
+    }
+}
+
+// start waiting for ack; any of the errors (a flash table, see
+// ReplyMatcher) fails the wait
+void WiFly::expect(const char *ack, int timeout, const PGM_P *errors)
+{
+    expect_str = ack;
+    reply_matcher.begin(errors);
+    expect_start = millis();
+    expect_timeout = timeout;
+}
+
+// check the next received char; returns WIFLY_CMD_OK once the ack has
+// arrived, WIFLY_CMD_FAILED on an error reply and WIFLY_CMD_BUSY otherwise
+uint8_t WiFly::match(char c)
+{
+    if (*expect_str == '\0') {
+        return WIFLY_CMD_OK;
+    }
+    int8_t error = reply_matcher.match(c);
+    if (reply_matcher.endsWith(expect_str)) {
+        return WIFLY_CMD_OK;
+    }
+    return error < 0 ? WIFLY_CMD_BUSY : WIFLY_CMD_FAILED;
+}
+
 boolean WiFly::commandMode()
 {
     if (command_mode && (error_count < 2)) {
@@ -364,6 +535,82 @@ boolean WiFly::dataMode()
     return true;
 }
 
+unsigned long WiFly::setBaud(HardwareSerial &serial, unsigned long baud, unsigned long new_baud, int reset_pin)
+{
+    char cmd[MAX_CMD_LEN];
+
+    // the module keeps new_baud once saved
+    if (!linkAt(serial, new_baud)) {
+        if (!linkAt(serial, baud)) {
+            DBG("No reply at either baud rate\r\n");
+            return 0;
+        }
+
+        // switch without saving (the reply comes at the new rate), so if the
+        // link doesn't work at the new rate, a restart takes the module back
+        snprintf(cmd, sizeof(cmd), "set uart instant %lu\r", new_baud);
+        sendCommand(cmd);
+        if (!linkAt(serial, new_baud)) {
+            DBG("No reply at new baud rate\r\n");
+            return restartAt(serial, baud, new_baud, reset_pin) ? baud : 0;
+        }
+    }
+
+    snprintf(cmd, sizeof(cmd), "set uart baud %lu\r", new_baud);
+    if (!sendCommand(cmd, "AOK") || !save()) {
+        DBG("Failed to save baud rate\r\n");
+    }
+    return new_baud;
+}
+
+// get the module back to its saved rate (baud) after a switch to new_baud
+// that the link doesn't carry, and check that it answers there
+boolean WiFly::restartAt(HardwareSerial &serial, unsigned long baud, unsigned long new_baud, int reset_pin)
+{
+    // the switch may not have reached the module
+    if (linkAt(serial, baud)) {
+        return true;
+    }
+
+    if (reset_pin >= 0) {
+        // RESET is active low with a pull-up on the module; release it as an
+        // input rather than driving it high
+        digitalWrite(reset_pin, LOW);
+        pinMode(reset_pin, OUTPUT);
+        delay(RESET_PULSE_TIME);
+        pinMode(reset_pin, INPUT);
+    } else {
+        // the reboot has to go over the link at new_baud; one that drops
+        // chars still gets "$$$" and a short command through now and then
+        for (uint8_t i = 0; i < MAX_TRY_REBOOT; i++) {
+            serial.flush();
+            serial.begin(new_baud);
+            baud_rate = new_baud;
+            command_mode = false;
+            error_count = 0;
+            clear();
+            if (commandMode() && sendCommand("reboot\r", "Reboot")) {
+                break;
+            }
+        }
+        command_mode = false;
+    }
+    delay(DEFAULT_WAIT_RESPONSE_TIME * 2);
+    return linkAt(serial, baud);
+}
+
+// reopen serial at baud and check that the module answers
+boolean WiFly::linkAt(HardwareSerial &serial, unsigned long baud)
+{
+    serial.flush();
+    serial.begin(baud);
+    baud_rate = baud;
+    command_mode = false;
+    error_count = 0;
+    clear();
+    return sendCommand("ver\r", "Ver");
+}
+
 void WiFly::clear()
 {
     char r;
@@ -371,6 +618,29 @@ void WiFly::clear()
     }
 }
 
+void WiFly::discard()
+{
+    while (scanData(serial->read()) >= 0) {
+    }
+}
+
+// watch the received data for CLOSE_TOKEN; returns c
+int WiFly::scanData(int c)
+{
+    if (c >= 0 && tcp_open) {
+        if (c == CLOSE_TOKEN[close_match]) {
+            if (++close_match == sizeof(CLOSE_TOKEN) - 1) {
+                DBG("Connection closed\r\n");
+                tcp_open = false;
+                close_match = 0;
+            }
+        } else {
+            close_match = (c == CLOSE_TOKEN[0]) ? 1 : 0;
+        }
+    }
+    return c;
+}
+
 float WiFly::version()
 {
     if (!sendCommand("ver\r", "Ver ")) {
@@ -4,11 +4,24 @@
 
 #include <Arduino.h>
 #include <Stream.h>
+#include <ReplyMatcher.h>
+#include <LatencyTracker.h>
 
 #define DEFAULT_WAIT_RESPONSE_TIME      1000        // 1000ms
+#define MIN_WAIT_RESPONSE_TIME          250         // bounds of learned timeouts (see LatencyTracker)
+#define MAX_WAIT_RESPONSE_TIME          30000
 #define DEFAULT_BAUDRATE                9600
 #define MAX_CMD_LEN                     32
 #define MAX_TRY_JOIN                    3
+#define MAX_TRY_REBOOT                  3           // reboots tried over a link that drops chars (see setBaud)
+#define RESET_PULSE_TIME                10          // ms the RESET pin is held low
+#define CLOSE_TOKEN                     "*CLOS*"    // sent by the module when the peer closes the connection
+
+// Status of a command started with startCommand()
+#define WIFLY_CMD_BUSY         0
+#define WIFLY_CMD_OK           1
+#define WIFLY_CMD_FAILED       2    // an error reply arrived
+#define WIFLY_CMD_TIMEOUT      3    // no reply arrived in time
 
 // Auth Modes for Network Authentication
 // See WiFly manual for details
@@ -62,20 +75,101 @@ public:
     boolean commandMode();
     boolean dataMode();
 
+    // the rate of the serial link: DEFAULT_BAUDRATE until setBaud() moves it
+    unsigned long baudRate() {
+        return baud_rate;
+    }
+
+    // move the module's UART from baud to new_baud and save that, so it
+    // comes up at new_baud after a reboot. serial is the port given to the
+    // constructor; it is left open at the rate that works. if the link fails
+    // at new_baud, the module is restarted at its saved rate, through
+    // reset_pin (wired to its RESET) if given. returns the rate the link
+    // works at, or 0 if the module doesn't answer at either
+    unsigned long setBaud(HardwareSerial &serial, unsigned long baud, unsigned long new_baud, int reset_pin = -1);
+
+    // Non-blocking commands: startCommand() enters command mode if needed,
+    // sends cmd and returns at once; commandStatus() consumes the bytes that
+    // have arrived and returns WIFLY_CMD_BUSY until ack is found (OK), an
+    // error reply (see WiFly.cpp) arrives (FAILED) or the timeout expires
+    // (TIMEOUT: the module may have stopped answering). ack must stay
+    // valid until then; acks longer than REPLY_MATCHER_WINDOW match their
+    // last chars. Set leave for commands after
+    // which the module is back in data mode (open, reboot).
+    boolean startCommand(const char *cmd, const char *ack = NULL, int timeout = DEFAULT_WAIT_RESPONSE_TIME, boolean leave = false);
+
+    // the same with the timeout learned by latency; the time the ack takes
+    // is added to it, or a timeout if no reply arrives
+    boolean startCommand(const char *cmd, const char *ack, LatencyTracker &latency, boolean leave = false);
+    uint8_t commandStatus();
+    boolean commandBusy() {
+        return cmd_state != CMD_IDLE;
+    }
+
+    // start "open host port"; finish with commandStatus(). the timeout is
+    // learned by openLatency()
+    boolean startConnect(const char *host, uint16_t port);
+    const LatencyTracker &openLatency() {
+        return open_latency;
+    }
+
+    // true while the connection made by the last startConnect() is open and
+    // the module is in data mode. read() and discard() clear it when they
+    // see CLOSE_TOKEN; any other command clears it too
+    boolean connected() {
+        return tcp_open;
+    }
+
     void clear();
 
+    // drop received bytes without waiting for more
+    void discard();
+
     float version();
 
 private:
     static WiFly  *instance;
 
     Stream *serial;
+    unsigned long baud_rate;
 
     boolean command_mode;
     boolean associated;
     uint8_t dhcp;
     uint8_t error_count;
 
+    enum { CMD_IDLE, CMD_ENTER, CMD_ENTER_RETRY, CMD_WAIT };
+
+    void expect(const char *ack, int timeout, const PGM_P *errors = NULL);
+    uint8_t match(char c);
+    void writeCommand();
+    void finishCommand(uint8_t status);
+    boolean linkAt(HardwareSerial &serial, unsigned long baud);
+    boolean restartAt(HardwareSerial &serial, unsigned long baud, unsigned long new_baud, int reset_pin);
+    void addLatency(boolean replied);
+    int scanData(int c);
+
+    // running command
+    uint8_t cmd_state;
+    uint8_t cmd_status;
+    char cmd_buf[MAX_CMD_LEN];
+    const char *cmd_ack;
+    int cmd_timeout;
+    boolean cmd_leave;
+    boolean cmd_open;
+    LatencyTracker *cmd_latency;
+    LatencyTracker open_latency;
+
+    // connection state; close_match counts the chars of CLOSE_TOKEN seen
+    boolean tcp_open;
+    uint8_t close_match;
+
+    // reply matcher: the last received chars are compared with the expected
+    // string and the error replies as they arrive
+    const char *expect_str;
+    ReplyMatcher reply_matcher;
+    unsigned long expect_start;
+    int expect_timeout;
 };
 
 #endif // __WIFLY_H__
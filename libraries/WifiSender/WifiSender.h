@@ -12,6 +12,7 @@
 #endif
 #include "WiFly.h"
 #include "HTTPClient.h"
+#include "DataTransport.h"
 #ifdef ENABLE_WDT
 #include "avr/wdt.h"
 #endif
@@ -28,7 +29,7 @@
 
 
 // The WifiSender class can be used to send HTTP POST messages via WiFi.
-class WifiSender {
+class WifiSender : public DataTransport {
 public:
 
 	// create a new WifiSender object using the given serial object; does not connect until init(); diagStream is for displaying diagnostics
@@ -49,22 +50,128 @@ public:
 	template <typename T> void add( const T *name, long value );
 	template <typename T> void add( const T *name, unsigned long value );
 
+	// add a value that is a list of items, e.g. records=1,2.5;2,3.5 (values
+	// separated by ',', items by ';'); call startListItem() before the values
+	// of each item
+	template <typename T> void startList( const T *name );
+	void startListItem();
+	template <typename T> void addListValue( const T *value );
+	void addListValue( double value, byte decimalPlaces = 2 );
+	void addListValue( int value );
+	void addListValue( long value );
+	void addListValue( unsigned long value );
+
+	// bytes left in the parameter buffer
+	inline int spaceLeft() const { return m_paramBufLen - m_paramBufPos - 1; }
+
 	// post to the server with the values specified since the last call to send(); and with the specified
 	// headers; returns false on error
 	bool send( const char *headers="Content-Type: text/plain\r\n" );
 
+	// start a send without blocking; poll() joins the network if needed, posts
+	// the values and reads the response. the headers must stay valid and no
+	// values may be added until it has finished. returns false if a send is running
+	bool startSend( const char *headers="Content-Type: text/plain\r\n" );
+
+	// advance the running send; call this often from the main loop. returns
+	// true once when the send has finished; lastSendSucceeded() then holds its result
+	bool poll();
+
+	// true while a send is running
+	bool busy() { return m_step != STEP_IDLE; }
+
+	// false if the last send failed
+	inline bool lastSendSucceeded() const { return m_lastErrorCode == 0; }
+
+	// an error code for the last send (as GprsSender::lastErrorCode()):
+	// 0 No Error: the send was successful
+	// 1 Module Error: the WiFly didn't answer a command. If you receive
+	//   several of these, a reboot (startReboot()) may be helpful.
+	// 2 Server / Network Error: the WiFly couldn't join the network, reach
+	//   the server or get a response. A reboot is unlikely to help.
+	int lastErrorCode() { return m_lastErrorCode; }
+
+	// the HTTP status of the last send's response (-1 if none arrived)
+	int lastStatusCode() { return m_http.response().statusCode(); }
+
+	// the Retry-After header of the last send's response in seconds (0 if none)
+	unsigned long lastRetryAfter() { return m_http.response().retryAfter(); }
+
+	// keep the server connection open between sends (HTTP keep-alive); while
+	// it stays open, a send skips the association check and just posts
+	void setKeepAlive( bool keepAlive );
+
+	// the reply times learned for plain module commands, for joining the
+	// network and for opening the server connection; the timeouts of those
+	// commands follow them
+	inline const LatencyTracker &commandLatency() const { return m_commandLatency; }
+	inline const LatencyTracker &joinLatency() const { return m_joinLatency; }
+	inline const LatencyTracker &openLatency() { return m_wifly.openLatency(); }
+
+	// move the link to the WiFly from baud to fastBaud (e.g. 57600) and save
+	// that on the module; call after init(). serial is the port given to the
+	// constructor; resetPin, if wired to the module's RESET, restarts it if
+	// the link fails at fastBaud. returns the rate the link runs at, or 0 if
+	// the module didn't answer or a send is running (see WiFly::setBaud)
+	unsigned long setBaudRate( HardwareSerial &serial, unsigned long baud, unsigned long fastBaud, int resetPin = -1 );
+
 	// connect to network specified during init
 	void join();
 
 	// reboot module
 	void reboot();
 
+	// start rebooting the module without blocking; poll() returns true once
+	// it has had time to boot. returns false if a send is running
+	bool startReboot();
+
+	// DataTransport: startUpload() calls writeValues to add the values, then
+	// starts a send with the headers given to setUploadHeaders(), which may
+	// be written by writeValues (e.g. an auth header); startReset() starts a
+	// reboot
+	bool startUpload( UploadWriter writeValues );
+	inline void setUploadHeaders( const char *headers ) { m_uploadHeaders = headers; }
+	bool startReset() { return startReboot(); }
+
 private:
 
+	// steps of a send; each command step waits for its WiFly command
+	enum Step {
+		STEP_IDLE,
+		STEP_SET_SSID,
+		STEP_SET_AUTH,
+		STEP_SET_PASSPHRASE,
+		STEP_JOIN,
+		STEP_JOIN_RETRY_WAIT,
+		STEP_JOIN_CHECK,
+		STEP_REMOTE_OFF,
+		STEP_ASSOC_CHECK,
+		STEP_POST,
+		STEP_REBOOT,
+		STEP_BOOT_WAIT
+	};
+
+	// start a step
+	void enterStep( Step step );
+
+	// move on from a command step once its command has finished with the
+	// given WIFLY_CMD_ status
+	void commandFinished( byte status );
+
+	// handle the result of the HTTP POST
+	void postFinished( int errCode );
+
+	// end the running send (or join) with the given error code (see
+	// lastErrorCode())
+	void finish( int errorCode );
+
 	// add a string to the parameter buffer
 	void append( const char *str );
 	void append(const __FlashStringHelper *str);
 
+	// add the separator before a list value
+	void listSeparator();
+
 	// the (externally provided) buffer for POST parameters
 	char *m_paramBuf;
 
@@ -77,6 +184,10 @@ private:
 	// number of parameters currently in param buf
 	int m_paramCount;
 
+	// items in the current list, and values in its current item
+	int m_listItemCount;
+	int m_listValueCount;
+
 	// network info
 	const char *m_networkName;
 	const char *m_networkPassword;
@@ -84,6 +195,9 @@ private:
 	// true if successfully joined network
 	bool m_joined;
 
+	// true to reuse the server connection (see setKeepAlive)
+	bool m_keepAlive;
+
 	// stream for diagnostic output
 	Stream *m_diagStream;
 
@@ -91,7 +205,20 @@ private:
 	WiFly m_wifly;
 	HTTPClient m_http;
 
+	// the reply times learned for the commands (see commandLatency())
+	LatencyTracker m_commandLatency;
+	LatencyTracker m_joinLatency;
+
 	unsigned int m_rebootCount;
+
+	// running send
+	Step m_step;
+	unsigned long m_stepTime;
+	byte m_joinTries;
+	bool m_joinOnly; // stop after joining (join())
+	const char *m_headers;
+	const char *m_uploadHeaders;
+	int m_lastErrorCode;
 };
 
 
@@ -101,15 +228,23 @@ private:
 
 
 // create a new WifiSender object using the given serial object; does not connect until init(); diagStream is for displaying diagnostics
-WifiSender::WifiSender( Stream &serialStream, Stream *diagStream = NULL ) : m_wifly( serialStream ), m_diagStream( diagStream ) {
+WifiSender::WifiSender( Stream &serialStream, Stream *diagStream = NULL ) : m_wifly( serialStream ), m_diagStream( diagStream ),
+	m_commandLatency( DEFAULT_WAIT_RESPONSE_TIME, MIN_WAIT_RESPONSE_TIME, MAX_WAIT_RESPONSE_TIME ),
+	m_joinLatency( DEFAULT_WAIT_RESPONSE_TIME * 10, MIN_WAIT_RESPONSE_TIME, MAX_WAIT_RESPONSE_TIME ) {
 	m_paramBuf = NULL;
 	m_paramBufLen = 0;
 	m_paramBufPos = 0;
+	m_listItemCount = 0;
+	m_listValueCount = 0;
 	m_paramCount = 0;
 	m_networkName = NULL;
 	m_networkPassword = NULL;
 	m_joined = false;
+	m_keepAlive = false;
 	m_rebootCount = 0;
+	m_step = STEP_IDLE;
+	m_uploadHeaders = "Content-Type: text/plain\r\n";
+	m_lastErrorCode = 0;
 }
 
 
@@ -132,19 +267,26 @@ bool WifiSender::init( const char *networkName, const char *networkPassword, cha
 }
 
 
+// move the link to the WiFly from baud to fastBaud; call after init()
+unsigned long WifiSender::setBaudRate( HardwareSerial &serial, unsigned long baud, unsigned long fastBaud, int resetPin ) {
+	if (busy())
+		return 0;
+	return m_wifly.setBaud( serial, baud, fastBaud, resetPin );
+}
+
+
 // connect to network specified during init
 void WifiSender::join() {
-	m_joined = false;
-	if (m_wifly.join( m_networkName, m_networkPassword, WIFLY_AUTH_WPA2_PSK ) == false) {
-		if( m_diagStream ) m_diagStream->println( F("unable to join") );
-		return;
-	}
-	if (m_wifly.isAssociated() == false) {
-		if( m_diagStream ) m_diagStream->println( F("not associated after join") );
+	if (busy())
 		return;
+	m_joined = false;
+	m_joinOnly = true;
+	enterStep( STEP_SET_SSID );
+	while (poll() == false) {
+#ifdef ENABLE_WDT
+		wdt_reset();
+#endif
 	}
-	m_wifly.sendCommand( "set comm remote 0\r" ); // disable *HELLO* message at start of each post
-	m_joined = true;
 }
 
 // reboot module
@@ -155,6 +297,21 @@ void WifiSender::reboot() {
 }
 
 
+// start rebooting the module without blocking
+bool WifiSender::startReboot() {
+	if (busy())
+		return false;
+	if( m_diagStream ) {
+		m_diagStream->print( F("rebooting: ") );
+		m_diagStream->println( m_rebootCount++ );
+	}
+	m_joined = false;
+	m_joinOnly = true; // keep the values added meanwhile
+	enterStep( STEP_REBOOT );
+	return true;
+}
+
+
 // add data to transmit with the next call to send
 template <typename T>
 void WifiSender::add(const T *value)
@@ -236,59 +393,294 @@ void WifiSender::add( const T *name, unsigned long value ) {
 	}
 }
 
+
+// start a value that is a list of items (see startListItem)
+template <typename T>
+void WifiSender::startList( const T *name ) {
+	if (m_paramCount)
+		append( F("&") );
+	append( name );
+	append( F("=") );
+	m_paramCount++;
+	m_listItemCount = 0;
+	m_listValueCount = 0;
+}
+
+
+// start the next item of the current list
+void WifiSender::startListItem() {
+	if (m_listItemCount++)
+		append( F(";") );
+	m_listValueCount = 0;
+}
+
+
+// add a value to the current list item
+template <typename T>
+void WifiSender::addListValue( const T *value ) {
+	listSeparator();
+	append( value );
+}
+
+
+// add a value to the current list item
+void WifiSender::addListValue( double value, byte decimalPlaces ) {
+	if (m_paramBufPos + 16 < m_paramBufLen) { // we'll assume that the value doesn't have more than 14 digits
+		listSeparator();
+		dtostrf( value, decimalPlaces, decimalPlaces, m_paramBuf + m_paramBufPos );
+		while (m_paramBuf[ m_paramBufPos ] && m_paramBufPos < m_paramBufLen) // find new end of string
+			m_paramBufPos++;
+	}
+}
+
+
+// add a value to the current list item
+void WifiSender::addListValue( int value ) {
+	addListValue( (long) value );
+}
+
+
+// add a value to the current list item
+void WifiSender::addListValue( long value ) {
+	if (m_paramBufPos + 13 < m_paramBufLen) {
+		listSeparator();
+		ltoa( value, m_paramBuf + m_paramBufPos, 10 );
+		while (m_paramBuf[ m_paramBufPos ] && m_paramBufPos < m_paramBufLen) // find new end of string
+			m_paramBufPos++;
+	}
+}
+
+
+// add a value to the current list item
+void WifiSender::addListValue( unsigned long value ) {
+	if (m_paramBufPos + 13 < m_paramBufLen) {
+		listSeparator();
+		ultoa( value, m_paramBuf + m_paramBufPos, 10 );
+		while (m_paramBuf[ m_paramBufPos ] && m_paramBufPos < m_paramBufLen) // find new end of string
+			m_paramBufPos++;
+	}
+}
+
+
+// add the separator before a list value
+void WifiSender::listSeparator() {
+	if (m_listValueCount++)
+		append( F(",") );
+}
+
 // post to the server with the values specified since the last call to send(); returns false on error
 bool WifiSender::send(const char *headers) {
-	bool success = false;
+	if (startSend( headers ) == false)
+		return false;
+	while (poll() == false) {
+#ifdef ENABLE_WDT
+		wdt_reset();
+#endif
+	}
+	return m_lastErrorCode == 0;
+}
+
+
+// start a send without blocking; returns false if a send is running
+bool WifiSender::startSend( const char *headers ) {
+	if (busy())
+		return false;
+	m_headers = headers;
+	m_joinOnly = false;
+
+	// attempt to join network if not done already; an open connection shows
+	// that we're still associated (discard() notices if it has been closed)
+	m_wifly.discard();
+	if (m_joined == false)
+		enterStep( STEP_SET_SSID );
+	else if (m_keepAlive && m_wifly.connected())
+		enterStep( STEP_POST );
+	else
+		enterStep( STEP_ASSOC_CHECK );
+	return true;
+}
 
-	// attempt to join network if not done already
-	if (m_joined == false) {
-		join();
+
+// add the values of an upload with writeValues and start sending them
+bool WifiSender::startUpload( UploadWriter writeValues ) {
+	if (busy())
+		return false;
+	writeValues();
+	return startSend( m_uploadHeaders );
+}
+
+
+// keep the server connection open between sends
+void WifiSender::setKeepAlive( bool keepAlive ) {
+	m_keepAlive = keepAlive;
+	m_http.setKeepAlive( keepAlive );
+}
+
+
+// advance the running send; returns true once when it has finished
+bool WifiSender::poll() {
+	switch (m_step) {
+	case STEP_IDLE:
+		return false;
+	case STEP_JOIN_RETRY_WAIT:
+		if (millis() - m_stepTime >= DEFAULT_WAIT_RESPONSE_TIME)
+			enterStep( STEP_JOIN );
+		break;
+	case STEP_BOOT_WAIT:
+		if (millis() - m_stepTime >= DEFAULT_WAIT_RESPONSE_TIME * 2)
+			finish( 0 );
+		break;
+	case STEP_POST: {
+		int errCode = m_http.poll();
+		if (errCode != HTTP_CLIENT_BUSY)
+			postFinished( errCode );
+		break;
 	}
+	default: {
+		byte status = m_wifly.commandStatus();
+		if (status != WIFLY_CMD_BUSY)
+			commandFinished( status );
+		break;
+	}
+	}
+	return m_step == STEP_IDLE;
+}
+
 
-	// if connected, do the HTTP POST
-	if (m_wifly.isAssociated()) {
+// start a step
+void WifiSender::enterStep( Step step ) {
+	char cmd[ MAX_CMD_LEN ];
+	m_step = step;
+	m_stepTime = millis();
+	switch (step) {
+	case STEP_SET_SSID:
+		m_joinTries = 0;
+		snprintf( cmd, MAX_CMD_LEN, "set w s %s\r", m_networkName );
+		m_wifly.startCommand( cmd, "OK", m_commandLatency );
+		break;
+	case STEP_SET_AUTH:
+		snprintf( cmd, MAX_CMD_LEN, "set w a %d\r", WIFLY_AUTH_WPA2_PSK );
+		m_wifly.startCommand( cmd, "OK", m_commandLatency );
+		break;
+	case STEP_SET_PASSPHRASE:
+		snprintf( cmd, MAX_CMD_LEN, "set w p %s\r", m_networkPassword );
+		m_wifly.startCommand( cmd, "OK", m_commandLatency );
+		break;
+	case STEP_JOIN:
+		m_wifly.startCommand( "join\r", "Associated", m_joinLatency ); // may take a while
+		break;
+	case STEP_JOIN_CHECK:
+	case STEP_ASSOC_CHECK:
+		m_wifly.startCommand( "show n\r", "soc=O", m_commandLatency );
+		break;
+	case STEP_REMOTE_OFF:
+		m_wifly.startCommand( "set comm remote 0\r" ); // disable *HELLO* message at start of each post
+		break;
+	case STEP_POST:
 		if( m_diagStream ) {
 			m_diagStream->println( F("POST:") );
 			m_diagStream->println( m_paramBuf );
 		}
-#ifdef ENABLE_WDT
-        wdt_reset();
-#endif
-		int errCode = m_http.post( WIFI_POST_URL, headers, m_paramBuf );
-#ifdef ENABLE_WDT
-        wdt_reset();
-#endif
-		if (errCode) {
-			if( m_diagStream ) {
-				m_diagStream->print( F("error:") );
-				m_diagStream->println( errCode );
-			}
-			m_joined = false; // could be network error; try reconnecting next time
-			if(errCode == -2){
-				if( m_diagStream ) {
-					m_diagStream->print( F("rebooting: ") );
-					m_diagStream->println( m_rebootCount++ );
-				}
-				reboot();
-			}
+		if (int errCode = m_http.startPost( WIFI_POST_URL, m_headers, m_paramBuf ))
+			postFinished( errCode );
+		break;
+	case STEP_REBOOT:
+		m_wifly.startCommand( "reboot\r", NULL, DEFAULT_WAIT_RESPONSE_TIME, true );
+		break;
+	default:
+		break;
+	}
+}
+
+
+// move on from a command step once its command has finished
+void WifiSender::commandFinished( byte status ) {
+	bool ok = status == WIFLY_CMD_OK;
+	int errorCode = status == WIFLY_CMD_TIMEOUT ? 1 : 2; // if it failed
+	switch (m_step) {
+	case STEP_SET_SSID:
+		enterStep( STEP_SET_AUTH );
+		break;
+	case STEP_SET_AUTH:
+		enterStep( STEP_SET_PASSPHRASE );
+		break;
+	case STEP_SET_PASSPHRASE:
+		enterStep( STEP_JOIN );
+		break;
+	case STEP_JOIN:
+		if (ok) {
+			enterStep( STEP_JOIN_CHECK );
+		} else if (++m_joinTries < MAX_TRY_JOIN) {
+			enterStep( STEP_JOIN_RETRY_WAIT );
+		} else {
+			if( m_diagStream ) m_diagStream->println( F("unable to join") );
+			finish( errorCode );
+		}
+		break;
+	case STEP_JOIN_CHECK:
+		if (ok) {
+			enterStep( STEP_REMOTE_OFF );
+		} else {
+			if( m_diagStream ) m_diagStream->println( F("not associated after join") );
+			finish( errorCode );
+		}
+		break;
+	case STEP_REMOTE_OFF:
+		m_joined = true;
+		if (m_joinOnly)
+			finish( 0 );
+		else
+			enterStep( STEP_ASSOC_CHECK );
+		break;
+	case STEP_ASSOC_CHECK:
+		if (ok) {
+			enterStep( STEP_POST );
 		} else {
-			success = true;
-			if( m_diagStream ) {
-				char get;
-				while (m_wifly.receive((uint8_t *)&get, 1, 1000) == 1) {
-					m_diagStream->print(get);
-				}
-			}
+			m_joined = false;
+			finish( errorCode );
 		}
-	}else{
-		m_joined = false;
+		break;
+	case STEP_REBOOT:
+		enterStep( STEP_BOOT_WAIT );
+		break;
+	default:
+		break;
 	}
+}
+
+
+// handle the result of the HTTP POST; -2 means the module didn't answer
+// (the caller decides when that calls for a reboot), the other errors are
+// the network's or the server's
+void WifiSender::postFinished( int errCode ) {
+	if (errCode) {
+		if( m_diagStream ) {
+			m_diagStream->print( F("error:") );
+			m_diagStream->println( errCode );
+		}
+		m_joined = false; // could be network error; try reconnecting next time
+		finish( errCode == -2 ? 1 : 2 );
+	} else {
+		if( m_diagStream ) {
+			m_diagStream->print( F("status:") );
+			m_diagStream->println( lastStatusCode() );
+		}
+		finish( 0 );
+	}
+}
+
+
+// end the running send (or join)
+void WifiSender::finish( int errorCode ) {
+	m_lastErrorCode = errorCode;
+	m_step = STEP_IDLE;
 
 	// clear buffer for next round
-	m_paramBuf[ 0 ] = 0;
-	m_paramBufPos = 0;
-	m_paramCount = 0;
-	return success;
+	if (m_joinOnly == false) {
+		m_paramBuf[ 0 ] = 0;
+		m_paramBufPos = 0;
+		m_paramCount = 0;
+	}
 }
 
 
@@ -0,0 +1,95 @@
+// Manylabs packed record decoder
+// copyright Manylabs 2015; MIT license
+// --------
+// This host program reads the "packed" values of DustSystem uploads (sent
+// with SEND_PACKED_RECORDS) and prints their records as CSV, one packed value
+// per argument or per line of stdin. Build it with:
+//
+//   g++ -I../libraries/RecordCodec -o decode_records decode_records.cpp
+//
+// Schema 1 (DustSystem) records are: time (seconds on the sketch's sample
+// clock, which goes on across resets), missed windows, temperature (tenths
+// of a degree Celsius), humidity (tenths of a percent), then dust ratios
+// (65535 = 1); they are printed scaled, with -32768 (no reading) as an empty
+// value. Other schemas are printed raw.
+#include <stdio.h>
+#include <string.h>
+#include "RecordCodec.h"
+
+
+// schema of the DustSystem sketch's samples (see PACKED_SCHEMA there)
+#define DUST_SYSTEM_SCHEMA 1
+#define DUST_SYSTEM_NO_VALUE -32768
+
+
+// print a value of a schema 1 record
+void printDustSystemValue( int field, int32_t value ) {
+	if (field < 2) {
+		printf( "%ld", (long) value );
+	} else if (field < 4) {
+		if (value != DUST_SYSTEM_NO_VALUE)
+			printf( "%.1f", value / 10.0 );
+	} else {
+		printf( "%.5f", value / 65535.0 );
+	}
+}
+
+
+// decode one packed value and print its records; returns false if it is
+// malformed
+bool decode( const char *text ) {
+	static byte data[ 4096 ];
+	int length = RecordDecoder::fromBase64( text, data, sizeof( data ) );
+	if (length < 0) {
+		fprintf( stderr, "invalid base64\n" );
+		return false;
+	}
+	RecordDecoder decoder( data, length );
+	if (!decoder.start()) {
+		fprintf( stderr, "invalid header\n" );
+		return false;
+	}
+	bool scaled = decoder.schema() == DUST_SYSTEM_SCHEMA && decoder.fieldCount() >= 4;
+	if (scaled) {
+		printf( "time,missed,temperature,humidity" );
+		for (int i = 4; i < decoder.fieldCount(); i++)
+			printf( ",dust_%d", i - 3 );
+		printf( "\n" );
+	} else {
+		printf( "# schema %d, %d fields\n", decoder.schema(), decoder.fieldCount() );
+	}
+	int32_t values[ RECORD_MAX_FIELDS ];
+	while (decoder.next( values )) {
+		for (int i = 0; i < decoder.fieldCount(); i++) {
+			if (i)
+				printf( "," );
+			if (scaled)
+				printDustSystemValue( i, values[ i ] );
+			else
+				printf( "%ld", (long) values[ i ] );
+		}
+		printf( "\n" );
+	}
+	if (decoder.error()) {
+		fprintf( stderr, "payload cut short\n" );
+		return false;
+	}
+	return true;
+}
+
+
+int main( int argc, char **argv ) {
+	bool ok = true;
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++)
+			ok = decode( argv[ i ] ) && ok;
+	} else {
+		static char line[ 8192 ];
+		while (fgets( line, sizeof( line ), stdin )) {
+			line[ strcspn( line, "\r\n" ) ] = 0;
+			if (line[ 0 ])
+				ok = decode( line ) && ok;
+		}
+	}
+	return ok ? 0 : 1;
+}
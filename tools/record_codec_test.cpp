@@ -0,0 +1,178 @@
+// Manylabs RecordCodec host test
+// copyright Manylabs 2015; MIT license
+// --------
+// This host program checks the RecordCodec library on the host side: packed
+// rows survive base64 and decoding, and malformed payloads (cut short, bad
+// headers, random bytes) are rejected without the decoder looping. Build and
+// run it with:
+//
+//   g++ -I../libraries/RecordCodec -o record_codec_test record_codec_test.cpp
+//   ./record_codec_test
+//
+// It prints each check and exits with 1 if any failed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RecordCodec.h"
+
+
+#define FIELD_COUNT 7
+#define ROW_COUNT 6
+
+
+// time, missed, temperature (tenths), humidity (tenths), three dust ratios
+// (65535 = 1), like the DustSystem sketch's samples
+const int32_t rows[ ROW_COUNT ][ FIELD_COUNT ] = {
+	{ 3600, 0, 215, 452, 812, 65535, 0 },
+	{ 3660, 0, 214, 455, 790, 64012, 3 },
+	{ 3720, 0, 212, 455, 1210, 65535, 0 },
+	{ 3840, 1, -32768, -32768, 1003, 60111, 0 }, // a missed window, no reading
+	{ 3900, 0, -12, 980, 0, 0, 0 },
+	{ 3960, 255, 2147483647, -2147483647 - 1, 65535, 1, 65535 },
+};
+
+
+int failures = 0;
+
+
+// compare a result with the expected value and print it
+void check( const char *name, long value, long expected ) {
+	printf( "%s: %ld", name, value );
+	if (value == expected) {
+		printf( " ok\n" );
+	} else {
+		printf( " expected %ld\n", expected );
+		failures++;
+	}
+}
+
+
+// decode a payload and return the records read, or -1 if the decoder didn't
+// stop after at most one record per byte; wrong counts values that differ
+// from rows (if given)
+int decodeAll( const byte *data, unsigned int length, bool *error, int *wrong = NULL ) {
+	RecordDecoder decoder( data, length );
+	*error = !decoder.start();
+	if (*error)
+		return 0;
+	int32_t values[ RECORD_MAX_FIELDS ];
+	int count = 0;
+	while (decoder.next( values )) {
+		if (wrong) {
+			for (int f = 0; f < FIELD_COUNT; f++) {
+				if (count >= ROW_COUNT || values[ f ] != rows[ count ][ f ])
+					(*wrong)++;
+			}
+		}
+		if (++count > (int) length)
+			return -1;
+	}
+	*error = decoder.error();
+	return count;
+}
+
+
+// decode base64 text and return the records read (see decodeAll)
+int decodeText( const char *text, bool *error ) {
+	byte data[ 64 ];
+	int length = RecordDecoder::fromBase64( text, data, sizeof( data ) );
+	if (length < 0) {
+		*error = true;
+		return 0;
+	}
+	return decodeAll( data, length, error );
+}
+
+
+int main() {
+	byte payload[ 2 + ROW_COUNT * FIELD_COUNT * RECORD_MAX_FIELD_SIZE ];
+	char text[ RECORD_BASE64_SIZE( sizeof( payload ) ) ];
+	byte decoded[ sizeof( payload ) ];
+	unsigned int ends[ ROW_COUNT ]; // payload length after each record
+	bool error;
+
+	// all rows survive base64 and decoding, including the extremes
+	RecordEncoder encoder( payload, sizeof( payload ) );
+	check( "start", encoder.start( 1, FIELD_COUNT ), 1 );
+	for (int r = 0; r < ROW_COUNT; r++) {
+		encoder.startRecord();
+		for (int f = 0; f < FIELD_COUNT; f++)
+			encoder.add( rows[ r ][ f ] );
+		encoder.endRecord();
+		ends[ r ] = encoder.length();
+	}
+	check( "records", encoder.records(), ROW_COUNT );
+	unsigned int length = encoder.length();
+	RecordEncoder::toBase64( payload, length, text );
+	int decodedLength = RecordDecoder::fromBase64( text, decoded, sizeof( decoded ) );
+	check( "decoded length", decodedLength, length );
+	int wrong = 0;
+	check( "rows read", decodeAll( decoded, decodedLength, &error, &wrong ), ROW_COUNT );
+	check( "wrong values", wrong, 0 );
+	check( "decode error", error, 0 );
+
+	// every cut of the payload stops with the whole records before the cut;
+	// a cut inside a record is an error
+	int badCuts = 0;
+	for (unsigned int cut = 2; cut < length; cut++) {
+		int whole = 0;
+		while (ends[ whole ] <= cut)
+			whole++;
+		bool boundary = whole ? ends[ whole - 1 ] == cut : cut == 2;
+		if (decodeAll( payload, cut, &error ) != whole || error == boundary)
+			badCuts++;
+	}
+	check( "bad cuts", badCuts, 0 );
+
+	// malformed headers
+	check( "empty start", decodeText( "", &error ), 0 );
+	check( "empty error", error, 1 );
+	byte tooMany[] = { 1, RECORD_MAX_FIELDS + 1, 0 };
+	check( "too many fields", decodeAll( tooMany, sizeof( tooMany ), &error ), 0 );
+	check( "too many error", error, 1 );
+	byte longVarint[] = { 1, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+	decodeAll( longVarint, sizeof( longVarint ), &error );
+	check( "long varint error", error, 1 );
+
+	// records of 0 fields take no bytes, so any bytes after a field count of 0
+	// are an error, not endless empty records
+	check( "no fields, more bytes", decodeText( "AQAB", &error ), 0 );
+	check( "no fields error", error, 1 );
+	check( "no fields, end", decodeText( "AQA", &error ), 0 );
+	check( "no fields end error", error, 0 );
+	check( "encoder no fields", encoder.start( 1, 0 ), 0 );
+	RecordDecoder unstarted( payload, length );
+	int32_t values[ RECORD_MAX_FIELDS ];
+	check( "next before start", unstarted.next( values ), 0 );
+
+	// random payloads never make the decoder loop
+	srand( 1 );
+	int loops = 0;
+	for (int i = 0; i < 10000; i++) {
+		byte data[ 16 ];
+		unsigned int n = rand() % sizeof( data );
+		for (unsigned int j = 0; j < n; j++)
+			data[ j ] = rand() % 4 ? rand() % 4 : rand();
+		if (decodeAll( data, n, &error ) < 0)
+			loops++;
+	}
+	check( "random loops", loops, 0 );
+
+	// base64 of each length of the last group, and invalid text
+	byte bytes[] = { 0xFB, 0xFF, 0x00, 0x7E };
+	int badBase64 = 0;
+	for (unsigned int n = 0; n <= sizeof( bytes ); n++) {
+		byte back[ 4 ];
+		RecordEncoder::toBase64( bytes, n, text );
+		int backLength = RecordDecoder::fromBase64( text, back, sizeof( back ) );
+		if (backLength != (int) n || memcmp( back, bytes, n ))
+			badBase64++;
+	}
+	check( "bad base64", badBase64, 0 );
+	check( "invalid", RecordDecoder::fromBase64( "ab*d", decoded, sizeof( decoded ) ), -1 );
+	check( "one char", RecordDecoder::fromBase64( "abcde", decoded, sizeof( decoded ) ), -1 );
+	check( "too long", RecordDecoder::fromBase64( "abcdabcd", decoded, 5 ), -1 );
+
+	printf( "Failures: %d\n", failures );
+	return failures ? 1 : 0;
+}